@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+# Decodes the timeline of the step engine (see src/core/step_trace.h), which is
+# exported over TCP by the :XT# command if STEP_TRACE is defined in config.h.
+# Prints time, position and velocity of motors as CSV, plots them optionally. The header
+# has no steps per revolution of auxiliary axes, so those are in full steps instead of revs.
+
+from argparse import ArgumentParser
+
+import socket
+import struct
+import sys
+
+HEADER_FORMAT = "<IBBHIII"
+EVENT_FORMAT = "<IBBH"
+
+MAGIC_ID = 0x43525453
+VERSION = 3
+
+EVENT_RA = 0x01
+EVENT_SEGMENT = 0x02
+EVENT_REVERSE = 0x04
+EVENT_MICROSTEP = 0x08
+EVENT_LEVEL = 0x10
+EVENT_ACCELERATE = 0x20
+EVENT_AUX = 0x40
+EVENT_GAP = 0x80
+EVENT_END = 0xFF
+
+AXES = ["dec", "ra", "focus", "rotator"]
+
+
+def receive(host, port):
+	data = b""
+	with socket.create_connection((host, port), timeout=5) as s:
+		s.sendall(b":XT#")
+		end = struct.pack(EVENT_FORMAT, 0, EVENT_END, 0, 0)
+		while True:
+			chunk = s.recv(65536)
+			if not chunk:
+				break
+			data += chunk
+			# the end event is aligned to events after the header
+			offset = len(data) - struct.calcsize(HEADER_FORMAT)
+			if data.endswith(end) and offset % struct.calcsize(EVENT_FORMAT) == 0:
+				break
+	return data
+
+
+def decode(data):
+	header_size = struct.calcsize(HEADER_FORMAT)
+	start = data.find(struct.pack("<I", MAGIC_ID))
+	if start < 0:
+		raise ValueError("no trace header found")
+	magic, version, event_size, microstepping, cycles_per_us, steps_dec, steps_ra = \
+		struct.unpack_from(HEADER_FORMAT, data, start)
+	if version != VERSION or event_size != struct.calcsize(EVENT_FORMAT):
+		raise ValueError("unsupported trace version %d" % version)
+
+	header = {"microstepping": microstepping, "cycles_per_us": cycles_per_us, "steps_per_rev": [steps_dec, steps_ra]}
+	events = []
+	time = 0
+	last = None
+	wrap = 1 << 32
+	for offset in range(start + header_size, len(data) - event_size + 1, event_size):
+		cycles, flags, epoch, value = struct.unpack_from(EVENT_FORMAT, data, offset)
+		if flags == EVENT_END:
+			break
+		# the cycle counter wraps around, the engine marks gaps longer than a second with their length,
+		# so whole wraps of the counter are added to them
+		if last is not None:
+			delta = (cycles - last) & 0xFFFFFFFF
+			if flags == EVENT_GAP:
+				if value == 0xFFFF:
+					raise ValueError("gap of more than %d s at %.3f s cannot be decoded" % (value, time / cycles_per_us / 1e6))
+				delta += wrap * max(0, round((value * 1e6 * cycles_per_us - delta) / wrap))
+				print("gap of %d s at %.3f s" % (value, time / cycles_per_us / 1e6), file=sys.stderr)
+			time += delta
+		last = cycles
+		if flags != EVENT_GAP:
+			events.append((time / cycles_per_us / 1e6, flags, epoch, value))
+	return header, events
+
+
+def reconstruct(header, events):
+	# every edge is a pulse, the balance counts microsteps twice like the step engine does
+	balance = [0] * len(AXES)
+	last_time = [None] * len(AXES)
+	rows = []
+	for time, flags, epoch, value in events:
+		if flags & EVENT_SEGMENT:
+			rows.append((time, "segment", value, epoch, flags & EVENT_ACCELERATE != 0, flags & EVENT_MICROSTEP != 0))
+			continue
+		# edges carry the index of their axis, RA flag is kept for older tools
+		axis = value if flags & EVENT_AUX else (1 if flags & EVENT_RA else 0)
+		increment = 1 if flags & EVENT_MICROSTEP else header["microstepping"]
+		if flags & EVENT_REVERSE:
+			increment = -increment
+		balance[axis] += increment
+
+		steps = header["steps_per_rev"][axis] if axis < 2 else 1
+		pulses_per_rev = 2 * steps * header["microstepping"]
+		velocity = 0.0
+		if last_time[axis] is not None and time > last_time[axis]:
+			velocity = increment / pulses_per_rev / (time - last_time[axis])
+		last_time[axis] = time
+		rows.append((time, AXES[axis], balance[axis] / pulses_per_rev, velocity, flags & EVENT_LEVEL != 0))
+	return rows
+
+
+def main():
+	parser = ArgumentParser(description="Decodes the step engine timeline of the Star Tracker.")
+	parser.add_argument("source", help="file with the raw dump or host of the tracker")
+	parser.add_argument("-p", "--port", type=int, default=9000, help="TCP port of the tracker")
+	parser.add_argument("-r", "--raw", help="saves the received raw dump")
+	parser.add_argument("--plot", action="store_true", help="plots position and velocity (needs matplotlib)")
+	args = parser.parse_args()
+
+	try:
+		with open(args.source, "rb") as f:
+			data = f.read()
+	except OSError:
+		data = receive(args.source, args.port)
+		if args.raw:
+			with open(args.raw, "wb") as f:
+				f.write(data)
+
+	header, events = decode(data)
+	rows = reconstruct(header, events)
+
+	print("time,kind,position_revs,velocity_revs_per_sec,level")
+	for row in rows:
+		if row[1] == "segment":
+			print("%.7f,segment,%d,%d,%d" % (row[0], row[2], row[3], row[4]))
+		else:
+			print("%.7f,%s,%.7f,%.5f,%d" % row)
+
+	if args.plot:
+		import matplotlib.pyplot as plt
+		fig, (ax_pos, ax_vel) = plt.subplots(2, 1, sharex=True)
+		for axis in AXES:
+			samples = [r for r in rows if r[1] == axis]
+			if not samples:
+				continue
+			ax_pos.plot([r[0] for r in samples], [r[2] for r in samples], label=axis)
+			ax_vel.plot([r[0] for r in samples], [r[3] for r in samples], label=axis)
+		for r in rows:
+			if r[1] == "segment":
+				ax_pos.axvline(r[0], color="gray", linewidth=0.5)
+		ax_pos.set_ylabel("position (revs)")
+		ax_vel.set_ylabel("velocity (revs/s)")
+		ax_vel.set_xlabel("time (s)")
+		ax_pos.legend()
+		plt.show()
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+
+# Reports where functions and tables of the step engine tick path live in the ESP32 firmware
+# (see ENGINE_ATTR in src/core/motor_controller.h). Anything in flash can be stalled by a miss
+# of the flash cache, e.g. while SPI flash or the SD card is accessed. It runs after every build
+# of the esp32 env (extra_scripts in platformio.ini) or standalone on the ELF file. The build
+# fails if the call graph of the disassembled firmware gets from ROOTS to code in flash.
+
+from argparse import ArgumentParser
+
+import re
+import struct
+import subprocess
+import sys
+
+# (first address, end address, name, internal RAM or ROM)
+REGIONS = [
+	(0x3F400000, 0x3F800000, "flash data", False),
+	(0x3FF80000, 0x3FF82000, "RTC data", True),
+	(0x3FFAE000, 0x40000000, "DRAM", True),
+	(0x40000000, 0x40070000, "ROM", True),
+	(0x40070000, 0x400A0000, "IRAM", True),
+	(0x400C0000, 0x400C2000, "RTC code", True),
+	(0x400C2000, 0x40C00000, "flash code", False),
+]
+
+# tick path of the engine, all of it should be in internal RAM
+ENGINE = [
+	r"MotorController::(run|trigger|power_state|next_segment|halt|shorten|coordinate_motors|plan_goal|"
+	r"ramp_index|look_ahead|publish|change_motor_speed|step_micros|split_accelerated|step_accelerated|set_microstepping|"
+	r"aux_trigger|aux_commands|pec_commands|pec_advance|pec_correct|pec_period|compare_commands|compare_hit|compare_window|take_profile|"
+	r"compare_fire|apply_velocity|change_motor_velocity|"
+	r"motor_trigger|motor_pulse)\b",
+	r"MotorController::_aux_triggers\b",
+	r"MotorController::instance\(\)::instance\b",
+	r"^motor_isr\b",
+	r"^motor_task\b",
+	r"^motor_cache_stalled\b",
+	r"spsc_ring<.*>::(pop|peek|count|empty|pushed)\b",
+	r"log2_histogram::add\b",
+	r"step_trace<.*>::record\b",
+]
+
+# called by the motor task, but not ours to place, the call graph does not go into them
+PLATFORM = [
+	r"^(ulTaskNotifyTake|vTaskNotifyGiveFromISR|xTaskGenericNotify|spi_flash_cache_enabled)\b",
+]
+
+# entries of the tick path, the motor task (once it is started), the engine and the timer interrupt
+ROOTS = [
+	r"^MotorController::run\(\)$",
+	r"^MotorController::trigger\(",
+	r"^motor_isr\(\)$",
+]
+
+# direct calls and jumps to a known address, Xtensa calls far code by callx through a register loaded by l32r
+CALL = re.compile(r"\b(?:call\d*|j)\s+([0-9a-f]+) <")
+LITERAL = re.compile(r"\bl32r\s+a\d+,\s*([0-9a-f]+)\b")
+
+
+def region(address):
+	for first, end, name, internal in REGIONS:
+		if first <= address < end:
+			return name, internal
+	return "unknown", False
+
+
+def symbols(elf, nm, environ=None):
+	output = subprocess.run([nm, "-C", "-S", "--defined-only", elf], check=True, stdout=subprocess.PIPE,
+	                        universal_newlines=True, env=environ).stdout
+	for line in output.splitlines():
+		# address, size (missing for some), type and the demangled name which has spaces
+		m = re.match(r"([0-9a-f]+) (?:([0-9a-f]+) )?(\w) (.+)", line)
+		if m:
+			yield int(m.group(1), 16), int(m.group(2) or "0", 16), m.group(4)
+
+
+def report(elf, nm, out=sys.stdout, environ=None):
+	engine = [re.compile(p) for p in ENGINE]
+	platform = [re.compile(p) for p in PLATFORM]
+	rows = []
+	for address, size, name in symbols(elf, nm, environ):
+		if name.startswith("guard variable"):
+			continue
+		if any(p.search(name) for p in engine):
+			rows.append((name, address, size, True))
+		elif any(p.search(name) for p in platform):
+			rows.append((name, address, size, False))
+
+	misplaced = 0
+	out.write("%-11s %-10s %6s  %s\n" % ("region", "address", "size", "symbol"))
+	for name, address, size, ours in sorted(rows, key=lambda r: (not r[3], r[1])):
+		where, internal = region(address)
+		mark = ""
+		if not internal:
+			mark = "  <-- engine in flash" if ours else "  <-- platform in flash"
+			misplaced += ours
+		out.write("%-11s 0x%08x %6d  %s%s\n" % (where, address, size, name, mark))
+	out.write("%d symbols of the tick path, %d of them in flash\n" % (sum(r[3] for r in rows), misplaced))
+	return misplaced
+
+
+# reader of 32-bit words at addresses of loaded sections of the (little endian ELF32) file, None elsewhere
+def elf_words(elf):
+	with open(elf, "rb") as f:
+		data = f.read()
+	sections = []
+	if data[:5] == b"\x7fELF\x01":
+		shoff, = struct.unpack_from("<I", data, 0x20)
+		shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+		for i in range(shnum):
+			_, kind, _, address, offset, size = struct.unpack_from("<IIIIII", data, shoff + i * shentsize)
+			# program data, not NOBITS (.bss)
+			if address != 0 and kind == 1:
+				sections.append((address, size, offset))
+
+	def word(address):
+		for first, size, offset in sections:
+			if first <= address and address + 4 <= first + size:
+				return struct.unpack_from("<I", data, offset + address - first)[0]
+		return None
+	return word
+
+
+# (function address, function name, [(address of a callee or of a literal, is a literal)]) of the code
+def disassembly(elf, objdump, environ=None):
+	output = subprocess.run([objdump, "-d", "-C", "--no-show-raw-insn", elf], check=True, stdout=subprocess.PIPE,
+	                        universal_newlines=True, env=environ).stdout
+	function = None
+	for line in output.splitlines():
+		m = re.match(r"([0-9a-f]+) <(.+)>:$", line)
+		if m:
+			if function is not None:
+				yield function
+			function = (int(m.group(1), 16), m.group(2), [])
+			continue
+		if function is None:
+			continue
+		m = CALL.search(line)
+		if m:
+			function[2].append((int(m.group(1), 16), False))
+		m = LITERAL.search(line)
+		if m:
+			function[2].append((int(m.group(1), 16), True))
+	if function is not None:
+		yield function
+
+
+# reports code in flash reachable from ROOTS with the chain of calls to it, returns the number of such functions
+def flash_calls(elf, nm, objdump, out=sys.stdout, environ=None):
+	functions = {}
+	callees = {}
+	for address, name, targets in disassembly(elf, objdump, environ):
+		functions[address] = name
+		callees[address] = targets
+
+	# literals may point to tables of functions (e.g. of auxiliary axes) as well
+	tables = [(address, size) for address, size, name in symbols(elf, nm, environ) if size > 0 and address not in functions]
+	word = elf_words(elf)
+
+	def targets_of(address):
+		for target, literal in callees.get(address, []):
+			# jumps within functions and calls of ROM go to no function of the firmware
+			if not literal:
+				if target in functions or not region(target)[1]:
+					yield target
+				continue
+			value = word(target)
+			if value in functions:
+				yield value
+			elif value is not None:
+				for first, size in tables:
+					if first <= value < first + size:
+						for entry in range(first, first + size - 3, 4):
+							if word(entry) in functions:
+								yield word(entry)
+						break
+
+	roots = [re.compile(p) for p in ROOTS]
+	platform = [re.compile(p) for p in PLATFORM]
+	parents = {a: None for a, name in functions.items() if any(p.search(name) for p in roots)}
+	if not parents:
+		out.write("no entries of the tick path found\n")
+		return 0
+	queue = list(parents)
+	flash = []
+	while queue:
+		address = queue.pop(0)
+		if not region(address)[1]:
+			flash.append(address)
+			continue
+		if any(p.search(functions.get(address, "")) for p in platform):
+			continue
+		for target in targets_of(address):
+			if target not in parents:
+				parents[target] = address
+				queue.append(target)
+
+	for address in flash:
+		chain = []
+		at = address
+		while at is not None:
+			chain.append(functions.get(at, "0x%08x" % at))
+			at = parents[at]
+		out.write("flash code reachable from the tick path: %s\n" % " <- ".join(chain))
+	out.write("%d functions reachable from the tick path, %d of them in flash\n" % (len(parents), len(flash)))
+	return len(flash)
+
+
+def main():
+	parser = ArgumentParser(description="Reports placement of the step engine of the Star Tracker.")
+	parser.add_argument("elf", help="firmware ELF file, e.g. .pio/build/esp32/firmware.elf")
+	parser.add_argument("--nm", default="xtensa-esp32-elf-nm", help="nm of the toolchain")
+	parser.add_argument("--objdump", default="xtensa-esp32-elf-objdump", help="objdump of the toolchain")
+	parser.add_argument("--strict", action="store_true", help="fails if the engine has anything in flash")
+	args = parser.parse_args()
+	misplaced = report(args.elf, args.nm)
+	reachable = flash_calls(args.elf, args.nm, args.objdump)
+	return 1 if reachable or (args.strict and misplaced) else 0
+
+
+if "Import" in globals():
+	# PlatformIO extra script, reports once the firmware is linked
+	Import("env")
+
+	def after_build(source, target, env):
+		nm = env.subst("$CC").replace("gcc", "nm")
+		objdump = env.subst("$CC").replace("gcc", "objdump")
+		report(str(target[0]), nm, environ=env["ENV"])
+		# a non-zero result fails the build
+		return 1 if flash_calls(str(target[0]), nm, objdump, environ=env["ENV"]) else 0
+
+	env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", after_build)
+elif __name__ == "__main__":
+	sys.exit(main())
@@ -19,6 +19,7 @@
 #include "net/wireless.h"
 
 #include <stdint.h>
+#include <lwip/sockets.h>
 #include <soc/timer_group_struct.h>
 #include <soc/timer_group_reg.h>
 #include <esp_task_wdt.h>
@@ -57,26 +58,93 @@ void tcp_task(void* param) {
 
 void IRAM_ATTR motor_task(void* param) {
 //	watchdog_add_task();
-	uint8_t state = 0;
+	MotorController& motors = MotorController::instance();
+	motors.start();
+	motors.run();
+}
+
+// switches the CPU frequency while the motor task sleeps
+void power_task(void* param) {
+	MotorController::instance().power_run();
+}
+
+void tracking_task(void* param) {
+	while(42) {
+		mount.update_tracking();
+		vTaskDelay(TRACKING_POLL/portTICK_PERIOD_MS);
+	}
+}
+
+// actions of position events, the step engine only queues them
+void event_task(void* param) {
 	while(42) {
-		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-		digitalWrite(33, state);
-		state = !state;
-		MotorController::instance().trigger();
-//		watchdog_feed();
+		MotorController::instance().dispatch_events(portMAX_DELAY);
 	}
 }
 
-hw_timer_t* motor_timer = NULL;
-static TaskHandle_t motor_task_handle = NULL;
+#ifdef LX200_FLOOD
+// value below which 'fraction' of the histogram lies (upper bound of its bucket)
+static uint32_t percentile(const log2_histogram& h, double fraction) {
+	uint64_t total = 0, seen = 0;
+	for(uint8_t i = 0; i < log2_histogram::BUCKETS; ++i) total += h.counts[i];
+	for(uint8_t i = 0; i < log2_histogram::BUCKETS; ++i) {
+		seen += h.counts[i];
+		if(seen >= fraction * total) return i + 1 < log2_histogram::BUCKETS ? log2_histogram::bucket_min(i + 1) : h.max;
+	}
+	return h.max;
+}
+
+static void flood_report(const char* phase, const MotorController::stats_t& stats) {
+	log_i("%s: wakeups=%u late_alarms=%u missed_pulses=%u latency_us p50<%u p99<%u max=%u", phase, stats.wakeups, 
+	      stats.late_alarms, stats.missed_pulses, percentile(stats.latency, 0.5), percentile(stats.latency, 0.99), stats.latency.max);
+}
 
-void IRAM_ATTR motor_isr() {
-	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-	vTaskNotifyGiveFromISR(motor_task_handle, &xHigherPriorityTaskWoken);
-	if(xHigherPriorityTaskWoken) {
-		portYIELD_FROM_ISR();
+// benchmark of the step jitter, motors run while the network is idle and then while a client floods the
+// LX200 server over the loopback (or the parser directly if it cannot connect), results go to the log
+void flood_task(void* param) {
+	static const char* commands[] = {":GR#", ":GD#", ":GT#", ":GL#", ":XH#"};
+	MotorController& motors = MotorController::instance();
+	vTaskDelay(5000/portTICK_PERIOD_MS);
+
+	motors.set_velocity(0.5, 0.5, false);
+	motors.reset_stats();
+	vTaskDelay(LX200_FLOOD * 1000/portTICK_PERIOD_MS);
+	flood_report("idle", motors.get_stats());
+
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(9000);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bool connected = client >= 0 && connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	if(!connected) log_w("flood: no loopback connection, the parser is called directly");
+
+	motors.reset_stats();
+	uint32_t sent = 0;
+	char buf[256];
+	unsigned long end = millis() + LX200_FLOOD * 1000UL;
+	while(millis() < end) {
+		const char* command = commands[sent % (sizeof(commands) / sizeof(commands[0]))];
+		if(connected) {
+			::send(client, command, strlen(command), 0);
+			// replies go to every client, so they are drained
+			while(recv(client, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+		} else {
+			strcpy(buf, command);
+			lx200_handle_message((uint8_t*)buf, strlen(buf));
+		}
+		// the idle task of the core keeps the watchdog fed
+		if(++sent % 16 == 0) vTaskDelay(1);
 	}
+	flood_report("flood", motors.get_stats());
+	log_i("flood: %u commands in %d s", sent, LX200_FLOOD);
+
+	if(client >= 0) close(client);
+	motors.stop();
+	vTaskDelete(NULL);
 }
+#endif
 
 void info_task(void*) {
 	while(42) {
@@ -85,8 +153,8 @@ void info_task(void*) {
 		log_v("Moving to 90,0");
 		mount.move_absolute(90, 0);
 		log_v("done!");
-		// FIXME: timing problem. if delay is too small I don't reach the target
-		// seems to be another problem
+		// is_moving counts queued segments as well, so any delay works, the same sequence
+		// is replayed by the simulator (native_bench env in platformio.ini)
 		do {
 			log_v("Waiting for mount controller...");
 			vTaskDelay(10000/portTICK_PERIOD_MS);
@@ -100,33 +168,47 @@ void info_task(void*) {
 	}
 }
 
+struct task_t {
+	TaskFunction_t function;
+	const char* name;
+	BaseType_t core;
+	UBaseType_t priority;
+	uint32_t stack;
+};
+
+// scheduling table, see TASKS in config.h, the engine starts first, so it takes commands from the rest
+static const task_t tasks[] = {
+	{&motor_task, "motor_task", TASK_MOTOR},
+	{&power_task, "power_task", TASK_POWER},
+	{&tcp_task, "tcp_task", TASK_TCP},
+	{&tracking_task, "tracking_task", TASK_TRACKING},
+	{&event_task, "event_task", TASK_EVENTS},
+//	{&info_task, "info_task", TASK_TRACKING},
+#ifdef LX200_FLOOD
+	{&flood_task, "flood_task", TASK_FLOOD},
+#endif
+};
+
 void setup() {
-	pinMode(33, OUTPUT);
   Serial.begin(SERIAL_BAUD_RATE);
   esp_log_level_set("*", ESP_LOG_VERBOSE);
   Serial.println("Starting tcp, lx200 and wifi");
   log_e("TEST!");
   ESP_LOGI("HI", "ESP test!");
-  lx200_init(&mount, &my_clock);
+  lx200_init(&mount, &camera, &my_clock);
   initWifiAP();
   tcp_init();
   delay(10);
   control.initialize();
   delay(100);
 
-  xTaskCreatePinnedToCore(&tcp_task, "tcp_task", 18096, NULL, 5, NULL, 1);
-//  xTaskCreatePinnedToCore(&info_task, "info_task", 8096, NULL, 5, NULL, 1);
-  xTaskCreatePinnedToCore(&motor_task, "motor_task", 8096, NULL, 5, &motor_task_handle, 0);
-
-  motor_timer = timerBegin(0, 80, true);
-  timerAttachInterrupt(motor_timer, &motor_isr, true);
-  timerAlarmWrite(motor_timer, TMR_RESOLUTION, true);
-  timerAlarmEnable(motor_timer);
-
+  for(const task_t& task : tasks) {
+    xTaskCreatePinnedToCore(task.function, task.name, task.stack, NULL, task.priority, NULL, task.core);
+  }
 }
 
+// the loop task of Arduino runs on the core of the step engine, the tracking has its own task
 void loop() {
-	mount.update_tracking();
-	vTaskDelay(10/portTICK_PERIOD_MS);
 //	watchdog_feed();
+	vTaskDelete(NULL);
 }
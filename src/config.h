@@ -25,19 +25,21 @@
 #define DEFAULT_POLE_DEC        5   // these values are changed during alignment
 #define DEFUALT_RA_OFFSET       0    // offset of RA axis (defines where mount's local RA is 0)
 
+#define RATE_SIDEREAL           15.041067  // apparent motion of stars (arc seconds per second)
+#define RATE_SOLAR              15.0       // mean apparent motion of the Sun (arc seconds per second)
+#define RATE_LUNAR              14.685     // mean apparent motion of the Moon (arc seconds per second)
+#define RATE_KING               15.0369    // sidereal rate corrected for the mean refraction (arc seconds per second)
+#define INTERCEPT_ITERATIONS    8          // max. number of refinements of the moving target of GOTO
+#define INTERCEPT_PRECISION     1          // refinements stop if the duration changes less (millis)
+#define TRACKING_PERIOD         1000       // tracking speeds are updated this often (millis)
+#define TRACKING_HORIZON        2000       // tracking aims where the target is after this time (millis)
+#define TRACKING_POLL           100        // the main loop checks the tracking this often (millis)
 
-// Alignement is done by optimization of rotation matrix parameters (three), this is done 
-// by a simple evolutionary strategy. Exact numeric solutions can be unstable due to Arduino
-// doubleing point precision and I haven't found a better soluiton than this :( 
+
+// Alignement fits the rotation between the global and the mount coordinates of stars in closed
+// form (Horn's quaternion method, least squares), so it is exact, deterministic and fast
 
 #define CAL_BUFFER_SIZE         12         // maximal number of point pairs used for alignmenet
-#define OPT_PRECISION           5000000    // if objective is less then 1/OPT_PRECISION, opt. stops
-#define OPT_POPULATION_SIZE     4          // population size of the ES
-#define OPT_GENERAITONS         1250       // # gen., reduce for faster but less precise solutions
-                                           // higher number of generations probably does not imply
-                                           // better solutions
-#define OPT_SIGMA               1.0        // initial sigma value
-#define OPT_SIGMA_DECAY         0.997      // every generation is sigma multiplied by this value 
 
 
 /* ==================================== STEPPER MOTORS ================================== */
@@ -60,14 +62,24 @@
 #define MS_PIN_RA               22    // = A11
 #endif
 
+#ifndef MICROSTEPPING_MUL
 #define MICROSTEPPING_MUL       1   // level of microstepping (depends of your wiring of A4988 pins)
+#endif
 
 #define STEPS_PER_REV_DEC       (16*200)     // number of steps per DEC motor revolution (200 for NEMA 17)
 #define STEPS_PER_REV_RA        (16*200)     // number of steps per RA motor revolution (200 for NEMA 17)
 
-// period in µs
+// period in µs of the fixed ATmega tick, ESP32 schedules every pulse (edge) on its own
 #define TMR_RESOLUTION  64
 
+#define MOTOR_TIMER             0       // ESP32 hardware timer used for scheduling of pulses
+#define MIN_PULSE_DELAY         32      // minimal delay (µs) between two pulses, bounds the maximal speed
+#define MIN_ALARM_LEAD          4       // pulses due sooner than this (µs) are done without waiting for the timer
+
+// steps per revolution and ramps of DEC and RA are defaults of the motion configuration, it is changed
+// at runtime by :XM commands of LX200 and kept in NVS, see motion_config_t
+#define MOTION_NVS_NAMESPACE    "motion"
+
 #define ACCEL_STEPS_DEC         256     // every ACCEL_STEPS_DEC steps is the delay in/decreased by
 #define ACCEL_DELAY_DEC         64      // ACCEL_DELAY_DEC (should be even, multiple of 2)
 #define FAST_DELAY_START_DEC    2048    // DEC delay at the start of fast movement (2048 us, ~488 Hz)
@@ -78,8 +90,98 @@
 #define FAST_DELAY_START_RA     2048    // RA delay at the start of fast movement (2048 us, ~488 Hz)
 #define FAST_DELAY_END_RA       0    // RA delay at the end of fast movement (1024 us, ~976 Hz)
 
-#define FAST_REVS_PER_SEC_DEC   1000000.0 / FAST_DELAY_START_DEC / STEPS_PER_REV_DEC 
-#define FAST_REVS_PER_SEC_RA    1000000.0 / FAST_DELAY_START_RA  / STEPS_PER_REV_RA
+// ramps are precomputed with a constant acceleration which covers the same distance as the stairs
+// given by ACCEL_STEPS_xx and ACCEL_DELAY_xx, jerk limited ramps (S-curve) are smoother but longer
+#define RAMP_TABLE_SIZE         256     // maximal number of segments of the precomputed ramp of every motor
+#define RAMP_JERK_LIMITED       0       // 1 for jerk limited (S-curve) ramps, 0 for constant acceleration
+
+
+/* ============================= PERIODIC ERROR CORRECTION ============================== */
+
+// tracking speed of RA is modulated by a table of corrections per worm revolution indexed by the RA position,
+// the table is recorded from pulse guiding or uploaded over TCP, see :XE commands in LX200.cpp
+#define PEC_WORM_REVS_RA        REDUCTION_RATIO_RA  // RA motor revolutions per worm revolution, 0 disables PEC
+#define PEC_SEGMENTS            128     // corrections per worm revolution
+#define PEC_MAX_CORRECTION      0.05    // corrections of the table are clamped to this part of the tracking speed
+#define GUIDE_RATE              0.5     // pulse guiding (:Mgw, :Mge) changes the RA tracking speed by this part
+
+
+/* =================================== POSITION EVENTS ================================== */
+
+// the step engine fires events once axes get to armed positions, actions run later in the events task,
+// e.g. the camera shoots at exact RA positions of a drift scan, see MotorController::compare_callback
+#define COMPARE_EVENTS          8       // slots of armed events
+#define COMPARE_SLOT_CAMERA     0       // slot of the camera, see CameraController::shoot_at
+
+
+/* =================================== AUXILIARY AXES =================================== */
+
+// focuser and field rotator are driven by the step engine of the mount, but independently of it,
+// axes with 0 steps per revolution are not wired, they are never touched and cost nothing
+
+#ifdef BOARD_ATMEGA
+// there are no free pins of MOTORS_PORT left
+#define STEP_PIN_FOCUS          0
+#define DIR_PIN_FOCUS           0
+#define MS_PIN_FOCUS            0
+#define STEP_PIN_ROTATOR        0
+#define DIR_PIN_ROTATOR         0
+#define MS_PIN_ROTATOR          0
+#define STEPS_PER_REV_FOCUS     0
+#define STEPS_PER_REV_ROTATOR   0
+#else
+#define STEP_PIN_FOCUS          26
+#define DIR_PIN_FOCUS           27
+#define MS_PIN_FOCUS            32
+#define STEP_PIN_ROTATOR        18
+#define DIR_PIN_ROTATOR         19
+#define MS_PIN_ROTATOR          23
+#define STEPS_PER_REV_FOCUS     200          // number of steps per focuser motor revolution
+#define STEPS_PER_REV_ROTATOR   0            // number of steps per rotator motor revolution
+#endif
+
+#define DIRECTION_FOCUS         0
+#define ACCEL_STEPS_FOCUS       32      // stairs of the ramp, see ACCEL_STEPS_DEC
+#define ACCEL_DELAY_FOCUS       64
+#define FAST_DELAY_START_FOCUS  4096
+#define FAST_DELAY_END_FOCUS    1024
+
+#define DIRECTION_ROTATOR       0
+#define ACCEL_STEPS_ROTATOR     64      // stairs of the ramp, see ACCEL_STEPS_DEC
+#define ACCEL_DELAY_ROTATOR     64
+#define FAST_DELAY_START_ROTATOR 4096
+#define FAST_DELAY_END_ROTATOR  1024
+
+
+/* ======================================== POWER ======================================= */
+
+// the power task sets the CPU frequency by the job of the step engine, it is raised at once and lowered
+// once the lower demand lasts CPU_FREQ_HOLD, 80 MHz is the minimum for WiFi and for the step timer,
+// tracking runs above it, so its ticks with PEC and guiding stay short and it differs from the idle state,
+// the frequency stays as it is if STEP_TRACE is defined, because the trace counts CPU cycles
+#define CPU_FREQ_IDLE           80      // MHz while no motor moves
+#define CPU_FREQ_TRACKING       160     // MHz while motors move slowly (tracking, microsteps)
+#define CPU_FREQ_SLEWING        240     // MHz while some motor moves along its ramp or fast
+#define CPU_FREQ_HOLD           2000    // ms of the lower demand before the frequency is lowered
+
+// rough model of the current of the board with WiFi connected, just for estimates reported by :XP#
+#define CURRENT_BASE_MA         20      // current (mA) independent of the CPU
+#define CURRENT_IDLE_UA_PER_MHZ 100     // current (µA per MHz) of the CPU waiting for interrupts
+#define CURRENT_BUSY_UA_PER_MHZ 250     // current (µA per MHz) of the running CPU
+
+
+/* ======================================== TASKS ======================================= */
+
+// scheduling table of the ESP32, WiFi and lwIP run on the core 0 (PRO_CPU), so the step engine has the
+// core 1 alone at the highest priority (its timer interrupt goes with it), the network, the UI and the
+// tracking math share the core 0, priorities are of FreeRTOS (0 .. 24), the loop task of Arduino quits
+//                              core    priority    stack (B)
+#define TASK_MOTOR              1,      24,         8096        // step engine, see MotorController::run
+#define TASK_POWER              1,      2,          2048        // CPU frequency, see MotorController::power_run
+#define TASK_TCP                0,      5,          18096       // LX200 over TCP and the UI (Control)
+#define TASK_TRACKING           0,      4,          8096        // MountController::update_tracking
+#define TASK_EVENTS             0,      6,          4096        // actions of position events, see MotorController::dispatch_events
+#define TASK_FLOOD              0,      5,          4096        // LX200 client of the benchmark, see LX200_FLOOD
 
 
 /* ==================================== OTHER SETTINGS ================================== */
@@ -108,5 +210,8 @@
 // #define DEBUG_OUTPUT_TIME
 // #define DEBUG_OUTPUT_CONTROL
 // #define DEBUG_OUTPUT_KEYS
+// #define DEBUG_TICK_PIN       33      // toggled at every wake up of the motor task (logic analyzer)
+// #define STEP_TRACE           8192    // events of the step engine timeline (power of 2, 8 B each), see :XT#
+// #define LX200_FLOOD          30      // seconds of the step jitter benchmark, idle network and then an LX200 flood
 
 #endif
@@ -10,13 +10,293 @@
 #include <string.h>
 
 static MountController* mount_controller = NULL;
+static CameraController* camera_controller = NULL;
 static Clock* rt_clock = NULL;
+static uint8_t focus_rate = 4; // 1 (slowest) to 4 (fastest), every rate is 4 times slower than the next one
+static int16_t pec_upload[PEC_SEGMENTS]; // PEC table written by :XEW and played by :XEU
+static uint64_t schedule_us = 0; // time of the step timer set by :XSU or :XSL, see lx200_start
 
-void lx200_init(MountController* mc, Clock* c) {
+void lx200_init(MountController* mc, CameraController* cc, Clock* c) {
 	mount_controller = mc;
+	camera_controller = cc;
 	rt_clock = c;
 }
 
+#ifdef STEP_TRACE
+// binary dump of the step engine timeline, decoded by decode_trace.py, it goes just to the client which asked for it
+static void lx200_send_trace() {
+	motion_config_t motion = MotorController::instance().get_motion();
+	step_trace_header_t header = {STEP_TRACE_MAGIC, STEP_TRACE_VERSION, sizeof(step_event_t), MICROSTEPPING_MUL, 
+	                              (uint32_t)getCpuFrequencyMhz(), motion.dec.steps_per_rev, motion.ra.steps_per_rev};
+	if(!tcp_reply((uint8_t*)&header, sizeof(header))) return;
+
+	const step_trace<STEP_TRACE>& trace = MotorController::instance().get_trace();
+	step_event_t events[64];
+	// before the ring fills once, slots above the head were never written
+	uint32_t to = trace.recorded();
+	uint32_t from = to > STEP_TRACE ? to - STEP_TRACE : 0;
+	while ((int32_t)(to - from) > 0) {
+		uint32_t n = trace.read(from, events, min((uint32_t)64, to - from));
+		if (n == 0) break;
+		if(!tcp_reply((uint8_t*)events, n * sizeof(step_event_t))) return;
+		from += n;
+	}
+
+	step_event_t end = {0, STEP_EVENT_END, 0, 0};
+	tcp_reply((uint8_t*)&end, sizeof(end));
+}
+#endif
+
+// appends non-empty buckets as "lowest value:count" pairs
+static int lx200_print_histogram(char* buf, int size, const char* name, const log2_histogram& h) {
+	int len = snprintf(buf, size, "%s max=%u", name, h.max);
+	for(uint8_t i = 0; i < log2_histogram::BUCKETS && len < size; ++i) {
+		if(h.counts[i] == 0) continue;
+		len += snprintf(buf + len, size - len, " %u:%u", log2_histogram::bucket_min(i), h.counts[i]);
+	}
+	if(len < size) len += snprintf(buf + len, size - len, "\n");
+	return min(len, size - 1);
+}
+
+// timing statistics of the step engine as a text report terminated by #
+static void lx200_send_stats() {
+	char buf[896];
+	const MotorController::stats_t& stats = MotorController::instance().get_stats();
+	int len = snprintf(buf, sizeof(buf), "wakeups=%u late_alarms=%u missed_pulses=%u cache_stalls=%u stalled_missed_pulses=%u lost_events=%u\n", 
+	                   stats.wakeups, stats.late_alarms, stats.missed_pulses, stats.cache_stalls, stats.stalled_missed_pulses, stats.lost_events);
+	len += lx200_print_histogram(buf + len, sizeof(buf) - len, "latency_us", stats.latency);
+	len += lx200_print_histogram(buf + len, sizeof(buf) - len, "stall_latency_us", stats.stall_latency);
+	len += lx200_print_histogram(buf + len, sizeof(buf) - len, "execution_cycles", stats.execution);
+	len += snprintf(buf + len, sizeof(buf) - len, "#");
+	tcp_send_packet((uint8_t*)buf, min(len, (int)sizeof(buf) - 1));
+}
+
+// time, duty cycle of the motor task and estimated current (see CURRENT_* in config.h) in every 
+// power state of the step engine as a text report terminated by #, other tasks are not counted
+static void lx200_send_power() {
+	static const char* names[MotorController::POWER_STATES] = {"idle", "tracking", "slewing"};
+	char buf[384];
+	const MotorController::stats_t& stats = MotorController::instance().get_stats();
+	int len = 0;
+	double total_us = 0, total_charge = 0;
+	for(uint8_t i = 0; i < MotorController::POWER_STATES; ++i) {
+		const MotorController::power_t& power = stats.power[i];
+		if(power.time_us == 0) continue;
+		double mhz = (double)power.mhz_us / power.time_us;
+		double duty = (double)power.busy_us / power.time_us;
+		double current = CURRENT_BASE_MA + mhz * (CURRENT_IDLE_UA_PER_MHZ * (1 - duty) + CURRENT_BUSY_UA_PER_MHZ * duty) / 1000.0;
+		total_us += power.time_us;
+		total_charge += current * power.time_us;
+		len += snprintf(buf + len, sizeof(buf) - len, "%s time_s=%.1f mhz=%.0f duty=%.4f%% wakeups_per_s=%.1f current_ma=%.1f\n",
+		                names[i], power.time_us / 1e6, mhz, duty * 100, power.wakeups * 1e6 / power.time_us, current);
+		if(len >= (int)sizeof(buf)) break;
+	}
+	if(len < (int)sizeof(buf)) {
+		len += snprintf(buf + len, sizeof(buf) - len, "average current_ma=%.1f frequency_switches=%u#", 
+		                total_us > 0 ? total_charge / total_us : 0.0, stats.frequency_switches);
+	}
+	tcp_send_packet((uint8_t*)buf, min(len, (int)sizeof(buf) - 1));
+}
+
+// periodic error correction, corrections are signed parts of the RA speed in 1/65536
+//   :XE#               state as playing,recording,segment#
+//   :XEO#              the current RA position is the start of the table
+//   :XEP1# :XEP0#      plays the last table or stops it
+//   :XER#              records the table from pulse guiding during the next worm revolution
+//   :XEW<i>,<c>,<c>..# writes corrections from the segment i into the upload buffer, 0 if some is out of
+//                      the limits of PEC_MAX_CORRECTION, those are written clamped
+//   :XEU#              plays the upload buffer
+//   :XEG<i>#           reads up to 16 corrections of the played table from the segment i as c,c,..#
+static void lx200_handle_pec(uint8_t* msg, char* return_msg) {
+	MotorController& motors = MotorController::instance();
+	char* end;
+	switch(msg[3]) {
+		case '#':
+			{
+				MotorController::pec_status_t status;
+				motors.get_pec(status, NULL);
+				snprintf(return_msg, 128, "%d,%d,%u#", status.playing, status.recording, status.segment);
+			}
+			break;
+		case 'O':
+			motors.pec_set_origin();
+			snprintf(return_msg, 128, "1");
+			break;
+		case 'P':
+			motors.pec_play(msg[4] == '1');
+			snprintf(return_msg, 128, "1");
+			break;
+		case 'R':
+			motors.pec_record();
+			snprintf(return_msg, 128, "1");
+			break;
+		case 'W':
+			{
+				long i = strtol((char*)msg + 4, &end, 10);
+				bool in_range = true;
+				while(*end == ',' && i >= 0 && i < PEC_SEGMENTS) {
+					long correction = strtol(end + 1, &end, 10);
+					in_range = in_range && correction >= -PEC_LIMIT && correction <= PEC_LIMIT;
+					pec_upload[i++] = constrain(correction, (long)-PEC_LIMIT, (long)PEC_LIMIT);
+				}
+				snprintf(return_msg, 128, "%d", *end == '#' && in_range);
+			}
+			break;
+		case 'U':
+			motors.pec_upload(pec_upload);
+			snprintf(return_msg, 128, "1");
+			break;
+		case 'G':
+			{
+				static int16_t table[PEC_SEGMENTS];
+				MotorController::pec_status_t status;
+				motors.get_pec(status, table);
+				long i = constrain(strtol((char*)msg + 4, &end, 10), 0, PEC_SEGMENTS);
+				int len = 0;
+				for(long last = min(i + 16, (long)PEC_SEGMENTS); i < last; ++i) {
+					len += snprintf(return_msg + len, 128 - len, i + 1 < last ? "%d," : "%d", table[i]);
+				}
+				snprintf(return_msg + len, 128 - len, "#");
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// motion configuration of the mount, an axis is steps,accel_steps,accel_delay,delay_start,delay_end
+// (see STEPS_PER_REV_DEC, ACCEL_*_DEC and FAST_DELAY_*_DEC in config.h)
+//   :XM#               DEC and RA as <axis>;<axis>#
+//   :XMD<axis>#        sets DEC, the step engine takes new ramps once motors stand
+//   :XMR<axis>#        sets RA
+//   :XMW#              stores the configuration in NVS, it is loaded at start
+//   :XML#              loads the stored configuration
+//   :XMF#              defaults of config.h
+// the mount should be synced again once steps per revolution change
+static void lx200_handle_motion(uint8_t* msg, char* return_msg) {
+	MotorController& motors = MotorController::instance();
+	motion_config_t config = motors.get_motion();
+	switch(msg[3]) {
+		case '#':
+			{
+				const axis_motion_t& d = config.dec;
+				const axis_motion_t& r = config.ra;
+				snprintf(return_msg, 128, "%u,%d,%d,%d,%d;%u,%d,%d,%d,%d#", d.steps_per_rev, d.accel_steps, d.accel_delay, d.delay_start, d.delay_end,
+				         r.steps_per_rev, r.accel_steps, r.accel_delay, r.delay_start, r.delay_end);
+			}
+			break;
+		case 'D':
+		case 'R':
+			{
+				axis_motion_t& axis = msg[3] == 'D' ? config.dec : config.ra;
+				char* end = (char*)msg + 3;
+				long values[5];
+				uint8_t n = 0;
+				for(; n < 5 && (n == 0 || *end == ','); ++n) values[n] = strtol(end + 1, &end, 10);
+				if(n < 5 || *end != '#') {
+					snprintf(return_msg, 128, "0");
+					break;
+				}
+				axis = {(uint32_t)values[0], (int32_t)values[1], (int32_t)values[2], (int32_t)values[3], (int32_t)values[4]};
+				snprintf(return_msg, 128, "%d", motors.set_motion(config));
+			}
+			break;
+		case 'W':
+			snprintf(return_msg, 128, "%d", config.save());
+			break;
+		case 'L':
+			snprintf(return_msg, 128, "%d", config.load() && motors.set_motion(config));
+			break;
+		case 'F':
+			snprintf(return_msg, 128, "%d", motors.set_motion(motion_config_t::defaults()));
+			break;
+		default:
+			break;
+	}
+}
+
+// start of slews and rate changes, 0 (at once) unless the scheduled time is still ahead
+static uint64_t lx200_start() {
+	return schedule_us > MotorController::instance().time_us() ? schedule_us : 0;
+}
+
+// time in seconds from HH:MM:SS with optional fraction of seconds
+static bool lx200_parse_time(uint8_t* msg, double& seconds) {
+	char* end;
+	long hours = strtol((char*)msg, &end, 10);
+	if(*end != ':') return false;
+	long minutes = strtol(end + 1, &end, 10);
+	if(*end != ':') return false;
+	seconds = hours * 3600 + minutes * 60 + strtod(end + 1, &end);
+	return *end == '#';
+}
+
+// slews (:Sr, :Sd) and rate changes (:TQ, :TS, :TL, :TK) start at the scheduled instant 
+//   :XSU<HH:MM:SS.sss>#   schedules them to the UTC time within the next 12 hours
+//   :XSL<HH:MM:SS.sss>#   schedules them to the local sidereal time within the next 12 hours
+//   :XSC#                 commands start at once again
+//   :XS#                  seconds remaining to the scheduled instant or none#
+// the instant is as precise as the clock, the step engine holds the commands until then
+static void lx200_handle_schedule(uint8_t* msg, char* return_msg) {
+	MotorController& motors = MotorController::instance();
+	double seconds;
+	switch(msg[3]) {
+		case '#':
+			if(lx200_start() == 0) snprintf(return_msg, 128, "none#");
+			else snprintf(return_msg, 128, "%.3f#", (schedule_us - motors.time_us()) / 1e6);
+			break;
+		case 'U':
+		case 'L':
+			if(!lx200_parse_time(msg + 4, seconds)) {
+				snprintf(return_msg, 128, "0");
+				break;
+			}
+			seconds = Clock::seconds_until(seconds, msg[3] == 'L');
+			if(seconds > 43200) {
+				snprintf(return_msg, 128, "0");
+				break;
+			}
+			schedule_us = motors.time_us() + (uint64_t)(seconds * 1e6);
+			log_i("Commands scheduled in %f s", seconds);
+			snprintf(return_msg, 128, "1");
+			break;
+		case 'C':
+			schedule_us = 0;
+			snprintf(return_msg, 128, "1");
+			break;
+		default:
+			break;
+	}
+}
+
+// :XCS<axis>,<position>,<interval>,<duration># shoots at positions (pulses) of an axis, see CameraController::shoot_at,
+// :XCC# stops it
+static void lx200_handle_camera(uint8_t* msg, char* return_msg) {
+	char* end;
+	switch(msg[3]) {
+		case 'S':
+			{
+				long axis = strtol((char*)msg + 4, &end, 10);
+				long position = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+				long interval = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+				long duration = *end == ',' ? strtol(end + 1, &end, 10) : -1;
+				if(*end != '#' || axis < 0 || axis > 1 || duration < 0) {
+					snprintf(return_msg, 128, "0");
+					break;
+				}
+				camera_controller->shoot_at(axis, position, interval, duration);
+				snprintf(return_msg, 128, "1");
+			}
+			break;
+		case 'C':
+			camera_controller->stop_shooting_at();
+			snprintf(return_msg, 128, "1");
+			break;
+		default:
+			break;
+	}
+}
+
 static void lx200_handle_single_message(uint8_t* msg, uint32_t len) {
 	char return_msg[128];
 	uint8_t data_begin = 0; // used to skip unwanted " " sent by libindi :/
@@ -98,9 +378,9 @@ static void lx200_handle_single_message(uint8_t* msg, uint32_t len) {
 						break;
 					}
 					break;
-				// tracking rate TODO
+				// tracking rate, 60.0 is sidereal
 				case 'T':
-					snprintf(return_msg, 128, "60.0#");
+					snprintf(return_msg, 128, "%04.1f#", 60.0 * mount_controller->get_tracking_rate());
 					break;
 				// UTC offset TODO
 				case 'G':
@@ -150,7 +430,7 @@ static void lx200_handle_single_message(uint8_t* msg, uint32_t len) {
 						int minutes = (msg[data_begin + 3] - '0') * 10 + (msg[data_begin + 4] - '0');
 						int seconds = (msg[data_begin + 6] - '0') * 10 + (msg[data_begin + 7] - '0');
 						double ra = hours * 15 + minutes/4.0 + seconds/240.0;
-						mount_controller->set_target_ra(ra);
+						mount_controller->set_target_ra(ra, lx200_start());
 						log_i("Moving ra to %f. %02d:%02d:%02d. msg was %s", ra, hours, minutes, seconds, msg);
 						snprintf(return_msg, 128, "%d", 1);
 					}
@@ -162,7 +442,7 @@ static void lx200_handle_single_message(uint8_t* msg, uint32_t len) {
 						int minutes = (msg[data_begin + 4] - '0') * 10 + (msg[data_begin + 5] - '0');
 						int seconds = (msg[data_begin + 7] - '0') * 10 + (msg[data_begin + 8] - '0');
 						double dec = sign * (deg + minutes/60.0 + seconds/3600.0);
-						mount_controller->set_target_dec(dec);
+						mount_controller->set_target_dec(dec, lx200_start());
 						log_i("Moving dec to %f. %+02d*%02d:%02d. msg was %s", dec, deg, minutes, seconds, msg);
 						snprintf(return_msg, 128, "%d", 1);
 					}
@@ -222,6 +502,13 @@ static void lx200_handle_single_message(uint8_t* msg, uint32_t len) {
 				case 'S':
 					snprintf(return_msg, 128, "%d", 0);
 					break;
+				// pulse guiding by the given milliseconds, just west and east by the RA speed, there is no reply
+				case 'g':
+					if(msg[3] == 'w' || msg[3] == 'e') {
+						MotorController::instance().guide_ra((msg[3] == 'w' ? 1 : -1) * GUIDE_RATE, strtol((char*)msg + 4, NULL, 10));
+					}
+					no_return = true;
+					goto lx200_end;
 				default:
 					break;
 			}
@@ -242,6 +529,115 @@ static void lx200_handle_single_message(uint8_t* msg, uint32_t len) {
 					no_return = true;
 					break;
 			}
+			break;
+		// focuser runs independently of the mount, :Q# does not stop it
+		case 'F':
+			switch(msg[2]) {
+				case '+':
+				case '-':
+					MotorController::instance().aux_velocity(AXIS_FOCUS, (msg[2] == '+' ? 1 : -1) * 
+						MotorController::instance().aux_max_speed(AXIS_FOCUS) / (1 << 2 * (4 - focus_rate)));
+					no_return = true;
+					break;
+				case 'Q':
+					MotorController::instance().aux_stop(AXIS_FOCUS, false);
+					no_return = true;
+					break;
+				case 'F':
+					focus_rate = 4;
+					no_return = true;
+					break;
+				case 'S':
+					focus_rate = 1;
+					no_return = true;
+					break;
+				case '1':
+				case '2':
+				case '3':
+				case '4':
+					focus_rate = msg[2] - '0';
+					no_return = true;
+					break;
+				case 'B':
+					snprintf(return_msg, 128, "%d", MotorController::instance().aux_busy(AXIS_FOCUS) ? 1 : 0);
+					break;
+				default:
+					break;
+			}
+			break;
+		// tracking rates, there is no reply
+		case 'T':
+			switch(msg[2]) {
+				case 'Q':
+					mount_controller->set_tracking_rate(1, lx200_start());
+					no_return = true;
+					break;
+				case 'S':
+					mount_controller->set_tracking_rate(RATE_SOLAR / RATE_SIDEREAL, lx200_start());
+					no_return = true;
+					break;
+				case 'L':
+					mount_controller->set_tracking_rate(RATE_LUNAR / RATE_SIDEREAL, lx200_start());
+					no_return = true;
+					break;
+				case 'K':
+					mount_controller->set_tracking_rate(RATE_KING / RATE_SIDEREAL, lx200_start());
+					no_return = true;
+					break;
+				default:
+					break;
+			}
+			break;
+		// extensions of this mount
+		case 'X':
+			switch(msg[2]) {
+				// scheduled start of commands
+				case 'S':
+					lx200_handle_schedule(msg, return_msg);
+					break;
+				// emergency stop, :Q# decelerates motors along their ramps
+				case 'Q':
+					mount_controller->emergency_stop();
+					no_return = true;
+					break;
+				// camera shots at positions of the step engine
+				case 'C':
+					lx200_handle_camera(msg, return_msg);
+					break;
+				// periodic error correction
+				case 'E':
+					lx200_handle_pec(msg, return_msg);
+					break;
+				// motion configuration of the mount
+				case 'M':
+					lx200_handle_motion(msg, return_msg);
+					break;
+				// duty cycle and estimated current by power states, :XHR# clears them too
+				case 'P':
+					lx200_send_power();
+					no_return = true;
+					break;
+				// timing statistics of the step engine, :XHR# clears them
+				case 'H':
+					if(msg[3] == 'R') {
+						MotorController::instance().reset_stats();
+						snprintf(return_msg, 128, "1");
+					} else {
+						lx200_send_stats();
+						no_return = true;
+					}
+					break;
+#ifdef STEP_TRACE
+				// timeline of the step engine
+				case 'T':
+					lx200_send_trace();
+					no_return = true;
+					break;
+#endif
+				default:
+					break;
+			}
+			break;
 		// use Autostar responses for now
 		case 'L':
 			switch(msg[2]) {
@@ -2,6 +2,9 @@
 #define CAMERACONTROLLER_H
 
 #include "../config.h"
+#include "motor_controller.h"
+
+#include <atomic>
 
 class CameraController {
   
@@ -28,8 +31,19 @@ class CameraController {
             _last_invoked = 0;
             _last_duration = 0;
             _last_delay = 0;
+            _position_shot = -1;
+        }
+
+        // shoots for 'duration' (s) once 'axis' of the step engine gets to 'position' (pulses) and every 'interval' 
+        // pulses further if not 0, e.g. frames of a drift scan, the engine fires it and the events task just hands 
+        // the shot over to update(), so the state of the camera stays with the task which calls update()
+        void shoot_at(uint8_t axis, long position, long interval, int duration) {
+            _event_duration = duration;
+            MotorController::instance().compare_callback(COMPARE_SLOT_CAMERA, axis, position, interval, &on_position, this);
         }
 
+        inline void stop_shooting_at() { MotorController::instance().compare_disarm(COMPARE_SLOT_CAMERA); }
+
         inline void set_repeating(boolean repeating) { _repeating = repeating; }
         inline bool get_repeating() { return _repeating; }
 
@@ -38,10 +52,23 @@ class CameraController {
         // stop shooting
         virtual void stop() = 0;
 
+        static void on_position(const MotorController::compare_event_t& event, void* arg) {
+            CameraController* camera = static_cast<CameraController*>(arg);
+            camera->_position_shot = camera->_event_duration.load();
+        }
+
+        // takes the duration (s) of the shot handed over by on_position, returns false if there is none
+        inline bool take_position_shot(int& duration) {
+            duration = _position_shot.exchange(-1);
+            return duration >= 0;
+        }
+
         unsigned long _last_invoked = 0;
         unsigned long _last_duration = 0;
         unsigned long _last_delay = 0;
         boolean _repeating = false;
+        std::atomic<int> _event_duration{0};
+        std::atomic<int> _position_shot{-1};  // set by the events task, -1 if there is no shot
 };
 
 #endif
\ No newline at end of file
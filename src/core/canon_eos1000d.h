@@ -22,6 +22,9 @@ class CanonEOS1000D : public CameraController {
         }
 
         boolean update() override {
+
+            int position_duration;
+            if (take_position_shot(position_duration)) shoot(position_duration, 0);
             
             unsigned long from_last_snap = millis() - _last_invoked;
 
@@ -48,6 +48,14 @@ class Clock  {
             return dt.hour() + dt.minute() / 60.0 + ((double)dt.second() + _time.sub_second_millis() / 1000.0) / 3600.0;   
         }
 
+        // seconds (of the UTC time) until the next 'seconds' of the day of the UTC time or of the local sidereal time
+        static double seconds_until(double seconds, bool sidereal) {
+            double now = 3600 * (sidereal ? get_decimal_LST() : get_decimal_time());
+            seconds = fmod(seconds - now + 86400, 86400);
+            // sidereal seconds are shorter
+            return sidereal ? seconds / 1.00273790935 : seconds;
+        }
+
 		static void recalc_LST_offset(double longitude) {
 			_local_siderial_time_offset =  compute_LST_offset(longitude);
 		}
@@ -0,0 +1,79 @@
+#ifndef FAST_PIN_H
+#define FAST_PIN_H
+
+#include <stdint.h>
+#include "../config.h"
+
+// Compile-time access to the pins of stepper drivers, so every edge is a single register
+// write. PIN is a bit of MOTORS_PORT on ATmega and a GPIO number on ESP32. Levels are never
+// read back from pins, the step engine keeps them in RAM. The HOST_BUILD backend just
+// records levels and edges, so the step engine can run without any hardware.
+
+#if defined(HOST_BUILD)
+
+struct mock_gpio {
+    static uint8_t* levels() { static uint8_t levels[64] = {}; return levels; }
+    static uint32_t* edges() { static uint32_t edges[64] = {}; return edges; }
+    // called on every change of a pin level if set, e.g. to timestamp pulses
+    static void (*&on_change())(uint8_t pin, uint8_t level) { static void (*callback)(uint8_t, uint8_t) = NULL; return callback; }
+};
+
+template<uint8_t PIN>
+struct fast_pin {
+    static inline void output() { mock_gpio::levels()[PIN] = 0; }
+    static inline void set() { change(1); }
+    static inline void clear() { change(0); }
+    static inline void write(bool value) { change(value); }
+
+    private:
+        static inline void change(uint8_t level) {
+            if (mock_gpio::levels()[PIN] == level) return;
+            mock_gpio::levels()[PIN] = level;
+            ++mock_gpio::edges()[PIN];
+            if (mock_gpio::on_change() != NULL) mock_gpio::on_change()(PIN, level);
+        }
+};
+
+#elif defined(BOARD_ATMEGA)
+
+template<uint8_t PIN>
+struct fast_pin {
+    static inline void output() { MOTORS_DDR |= (1 << PIN); MOTORS_PORT &= ~(1 << PIN); }
+    static inline void set() { MOTORS_PORT |= (1 << PIN); }
+    static inline void clear() { MOTORS_PORT &= ~(1 << PIN); }
+    static inline void write(bool value) { value ? set() : clear(); }
+};
+
+#else
+
+#include <soc/gpio_struct.h>
+
+template<uint8_t PIN>
+struct fast_pin {
+    static inline void output() { pinMode(PIN, OUTPUT); clear(); }
+    // w1ts/w1tc registers set/clear just the written bits, no read-modify-write is needed
+    static inline void set() {
+        if (PIN < 32) GPIO.out_w1ts = 1UL << PIN;
+        else GPIO.out1_w1ts.val = 1UL << (PIN - 32);
+    }
+    static inline void clear() {
+        if (PIN < 32) GPIO.out_w1tc = 1UL << PIN;
+        else GPIO.out1_w1tc.val = 1UL << (PIN - 32);
+    }
+    static inline void write(bool value) { value ? set() : clear(); }
+};
+
+#endif
+
+// pins of a single stepper driver
+template<uint8_t STEP, uint8_t DIR, uint8_t MS, bool DIR_SWAP>
+struct driver_pins {
+    typedef fast_pin<STEP> step;
+    typedef fast_pin<DIR>  dir;
+    typedef fast_pin<MS>   ms;
+    static const bool dir_swap = DIR_SWAP;
+
+    static inline void output() { step::output(); dir::output(); ms::output(); }
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Histogram with power of two buckets, the bucket 'i' counts values from 2^(i-1) to 2^i - 1
+// and the bucket 0 counts zeros. It has a single writer, readers just copy counters which
+// are 32 bit each, so they are never torn, but the copy is not a consistent snapshot.
+struct log2_histogram {
+
+    static const uint8_t BUCKETS = 33;
+
+    uint32_t counts[BUCKETS];
+    uint32_t max;
+
+    // always inlined, the step engine runs from IRAM
+    inline __attribute__((always_inline)) void add(uint32_t value) {
+        ++counts[value == 0 ? 0 : 32 - __builtin_clz(value)];
+        if (value > max) max = value;
+    }
+
+    inline void clear() {
+        for (uint8_t i = 0; i < BUCKETS; ++i) counts[i] = 0;
+        max = 0;
+    }
+
+    // lowest value of the bucket 'i'
+    static inline uint32_t bucket_min(uint8_t i) { return i == 0 ? 0 : 1UL << (i - 1); }
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef MOTIONCONFIG_H
+#define MOTIONCONFIG_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#include "../config.h"
+
+// motion parameters of a mount axis, see STEPS_PER_REV_DEC, ACCEL_STEPS_DEC and FAST_DELAY_*_DEC in config.h
+struct axis_motion_t {
+    uint32_t steps_per_rev;  // full steps per revolution of the motor
+    int32_t accel_steps;  // the old stair ramp changed the delay every 'accel_steps' steps
+    int32_t accel_delay;  // by 'accel_delay' µs
+    int32_t delay_start;  // delay (µs) between pulses at the start of the fast movement
+    int32_t delay_end;  // delay (µs) between pulses at its top speed
+
+    inline bool valid() const {
+        return steps_per_rev > 0 && steps_per_rev <= 1000000 && accel_steps > 0 && accel_steps <= 65535 &&
+               accel_delay > 0 && accel_delay <= 65535 && delay_start >= 0 && delay_start <= 65535 &&
+               delay_end >= 0 && delay_end <= 65535;
+    }
+};
+
+// motion configuration of the mount, config.h gives defaults, LX200 (:XM) changes it at runtime
+// and it is kept in NVS, so the fastest reliable slew can be found without reflashing
+struct motion_config_t {
+    axis_motion_t dec;
+    axis_motion_t ra;
+
+    static motion_config_t defaults() {
+        return {
+            {STEPS_PER_REV_DEC, ACCEL_STEPS_DEC, ACCEL_DELAY_DEC, FAST_DELAY_START_DEC, FAST_DELAY_END_DEC},
+            {STEPS_PER_REV_RA,  ACCEL_STEPS_RA,  ACCEL_DELAY_RA,  FAST_DELAY_START_RA,  FAST_DELAY_END_RA}
+        };
+    }
+
+    inline bool valid() const { return dec.valid() && ra.valid(); }
+
+    // reads the stored configuration, returns false and keeps this one if there is none
+    // or if it was stored by a firmware with another layout
+    bool load() {
+        Preferences preferences;
+        if (!preferences.begin(MOTION_NVS_NAMESPACE, true)) return false;
+        motion_config_t stored;
+        bool loaded = preferences.getBytes("config", &stored, sizeof(stored)) == sizeof(stored) && stored.valid();
+        preferences.end();
+        if (loaded) *this = stored;
+        return loaded;
+    }
+
+    bool save() const {
+        Preferences preferences;
+        if (!preferences.begin(MOTION_NVS_NAMESPACE, false)) return false;
+        bool saved = preferences.putBytes("config", this, sizeof(*this)) == sizeof(*this);
+        preferences.end();
+        return saved;
+    }
+};
+
+#endif
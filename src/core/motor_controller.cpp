@@ -6,23 +6,35 @@
 
 #include <Arduino.h>
 #include "esp32-hal-timer.h"
+#include "esp_timer.h"
+#include "esp_spi_flash.h"
 #include "motor_controller.h"
+#include "step_timer.h"
 
-void MotorController::initialize() {
-#ifdef BOARD_ATMEGA    
-    uint8_t pin_mask = (1 << STEP_PIN_DEC) | (1 << DIR_PIN_DEC) | (1 << MS_PIN_DEC) |
-                       (1 << STEP_PIN_RA)  | (1 << DIR_PIN_RA)  | (1 << MS_PIN_RA);
+#ifndef BOARD_ATMEGA
+typedef step_timer<MOTOR_TIMER> motor_timer;
 
-    MOTORS_DDR |= pin_mask;
-    MOTORS_PORT &= ~pin_mask;
+// motor task to be notified by the step timer, kept outside of the singleton for the ISR
+static TaskHandle_t motor_task_handle = NULL;
 
-    #ifdef DEBUG_OUTPUT
-        Serial.println(F("Stepper motors pins initialized:"));
-        Serial.print(F("  Pinout: ")); Serial.println(pin_mask, BIN);
-        Serial.print(F("  DDR:    ")); Serial.println(MOTORS_DDR, BIN);
-        Serial.print(F("  PORT:   ")); Serial.println(MOTORS_PORT, BIN);
-    #endif
+// the alarm came while the flash cache was disabled (SPI flash writes), the ISR runs from IRAM
+// even then, but the motor task waits until the flash is done
+static std::atomic<bool> motor_cache_stalled {false};
+
+static void IRAM_ATTR motor_isr() {
+    if (!spi_flash_cache_enabled()) motor_cache_stalled.store(true, std::memory_order_relaxed);
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    vTaskNotifyGiveFromISR(motor_task_handle, &higher_priority_task_woken);
+    if (higher_priority_task_woken) portYIELD_FROM_ISR();
+}
+#endif
+
+void MotorController::initialize() {
 
+    dec_pins::output();
+    ra_pins::output();
+
+#ifdef BOARD_ATMEGA    
     // Timer/Counter Control Register: set Fast PWM mode
     TCCR5A = 0x23 ; // || set mode 7 (Fast PWM) with
     TCCR5B = 0x09 ; // || prescaler 1 (no prescaling)
@@ -41,16 +53,24 @@ void MotorController::initialize() {
         Serial.print(F("  TIMSKx: ")); Serial.println(TIMSK5, BIN);
     #endif
 #else
-	pinMode(STEP_PIN_DEC, OUTPUT);
-	pinMode(DIR_PIN_DEC, OUTPUT);
-	pinMode(MS_PIN_DEC, OUTPUT);
-	pinMode(STEP_PIN_RA, OUTPUT);
-	pinMode(DIR_PIN_RA, OUTPUT);
-	pinMode(MS_PIN_RA, OUTPUT);
-
+    #ifdef DEBUG_TICK_PIN
+        pinMode(DEBUG_TICK_PIN, OUTPUT);
+    #endif
 #endif
 
-    _commands = queue<command_t>(8);
+    // the stored motion configuration replaces defaults of config.h
+    _motion = motion_config_t::defaults();
+    if (_motion.load()) log_i("Motion configuration loaded");
+    build_profile(_profiles[0], _motion);
+    _profile_latest = 0;
+    _profile_pending.store(0, std::memory_order_relaxed);
+    take_profile();
+    log_d("Ramps: DEC %d pulses, RA %d pulses", _profile->dec_ramp.pulses(), _profile->ra_ramp.pulses());
+    _ra.axis = 1;
+
+    static_assert(AUX_AXES == 2, "every auxiliary axis must be initialized and listed in _aux_triggers");
+    aux_initialize<AXIS_FOCUS>();
+    aux_initialize<AXIS_ROTATOR>();
 
     _dec_balance = 0;
     _ra_balance = 0;
@@ -59,221 +79,1414 @@ void MotorController::initialize() {
 
 void MotorController::stop() {
 
-	xSemaphoreTake(_motor_lock, portMAX_DELAY);
     #ifdef DEBUG_OUTPUT
-        Serial.println(F("Stopping both motors:"));
+        Serial.println(F("Stopping both motors."));
     #endif
-    
-    cli();
-    _dec.pulses_remaining = 0;
-    _ra.pulses_remaining = 0;
-    sei();
 
-    #ifdef DEBUG_OUTPUT
-        Serial.print(F("  DEC: ")); Serial.println(_dec.pulses_remaining);
-        Serial.print(F("  RA:  ")); Serial.println(_ra.pulses_remaining);
-    #endif
-      
+    // the step engine drops queued segments of the old epoch and decelerates running ones,
+    // step pins stay as they are, so the balance still matches the real position
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    _epoch.fetch_add(1, std::memory_order_release);
+	xSemaphoreGive(_motor_lock);
+    wake();
+}
+
+void MotorController::emergency_stop() {
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    _emergency.store(true, std::memory_order_relaxed);
+    _epoch.fetch_add(1, std::memory_order_release);
+	xSemaphoreGive(_motor_lock);
+    for (uint8_t i = 0; i < AUX_AXES; ++i) aux_stop(i, true);
+    wake();
+}
+
+uint64_t MotorController::time_us() const {
 #ifdef BOARD_ATMEGA
-    MOTORS_PORT &= ~((1 << STEP_PIN_DEC) | (1 << STEP_PIN_RA)); // step pins to LOW
+    // ticks of the engine start together with the board, so this is just about a tick off
+    return micros();
+#else
+    // both timers run from the same clock, so producers do not touch the step timer of the motor task
+    return esp_timer_get_time() - _time_offset_us;
+#endif
+}
 
-    #ifdef DEBUG_OUTPUT
-        Serial.print(F("  PORT:   ")); Serial.println(MOTORS_PORT, BIN);
+void MotorController::wake() {
+    if (_task != NULL) xTaskNotifyGive(_task);
+}
+
+void MotorController::start() {
+#ifndef BOARD_ATMEGA
+    _task = xTaskGetCurrentTaskHandle();
+    motor_task_handle = _task;
+
+    // 1 µs resolution, the counter is never reset and pulses are scheduled by alarms at absolute times
+    hw_timer_t* timer = timerBegin(MOTOR_TIMER, 80, true);
+    timerAttachInterrupt(timer, &motor_isr, true);
+    _time_offset_us = esp_timer_get_time() - motor_timer::read();
+    _cpu_mhz = getCpuFrequencyMhz();
+    _power_mhz.store(_cpu_mhz, std::memory_order_relaxed);
+    _power_us = motor_timer::read();
+    _power_holding = false;
+#endif
+}
+
+void ENGINE_ATTR MotorController::run() {
+#ifndef BOARD_ATMEGA
+    #ifdef DEBUG_TICK_PIN
+        bool tick_level = false;
     #endif
-#else
-	digitalWrite(STEP_PIN_DEC, LOW);
-	digitalWrite(STEP_PIN_RA, LOW);
+
+    while (42) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t awake = cpu_cycles();
+        uint64_t woken = motor_timer::read();
+        #ifdef DEBUG_TICK_PIN
+            tick_level = !tick_level;
+            fast_pin<DEBUG_TICK_PIN>::write(tick_level);
+        #endif
+
+        if (_stats_reset.exchange(false, std::memory_order_acquire)) _stats = {};
+        ++_stats.wakeups;
+        // wake ups by new commands come before the alarm and say nothing about latency
+        if (_alarm_us != 0 && woken >= _alarm_us) _stats.latency.add(min(woken - _alarm_us, (uint64_t)UINT32_MAX));
+
+        // pulses missed after a stall are counted apart, so they can be told from other delays
+        bool stalled = motor_cache_stalled.exchange(false, std::memory_order_relaxed);
+        uint32_t missed = _stats.missed_pulses;
+        if (stalled) {
+            ++_stats.cache_stalls;
+            if (_alarm_us != 0 && woken >= _alarm_us) _stats.stall_latency.add(min(woken - _alarm_us, (uint64_t)UINT32_MAX));
+        }
+
+        uint64_t next;
+        while (42) {
+            uint32_t cycles = cpu_cycles();
+            next = trigger(motor_timer::read());
+            _stats.execution.add(cpu_cycles() - cycles);
+
+            _alarm_us = next;
+            if (next == 0) {
+                // no axis has any job, the timer stays silent until somebody wakes us up
+                motor_timer::disarm();
+                break;
+            }
+            motor_timer::alarm(next);
+            // the alarm might have been set too late to fire, do the pulse right now
+            if (motor_timer::read() + MIN_ALARM_LEAD < next) break;
+            ++_stats.late_alarms;
+        }
+        if (stalled) _stats.stalled_missed_pulses += _stats.missed_pulses - missed;
+
+        // everything since the last sleep belongs to the state set then
+        _stats.power[_power_state].busy_us += (cpu_cycles() - awake) / _cpu_mhz;
+        account_power(next, motor_timer::read());
+    }
 #endif
+}
+
+bool ENGINE_ATTR MotorController::account_power(uint64_t next, uint64_t now) {
+    power_t& power = _stats.power[_power_state];
+    power.time_us += now - _power_us;
+    power.mhz_us += (now - _power_us) * _cpu_mhz;
+    ++power.wakeups;
+    _power_us = now;
+
+    // the frequency switched by the power task meanwhile counts from now on
+    uint32_t mhz = _power_mhz.load(std::memory_order_relaxed);
+    if (mhz != _cpu_mhz) {
+        _cpu_mhz = mhz;
+        ++_stats.frequency_switches;
+    }
+
+    // the power task is woken up only by changes of the demand, it runs once this task sleeps
+    power_state_t state = power_state(next);
+    if (state == _power_state) return false;
+    _power_demand.store(state, std::memory_order_release);
+    if (_power_task != NULL) xTaskNotifyGive(_power_task);
+    _power_state = state;
+    return true;
+}
+
+void MotorController::power_run() {
+#ifndef BOARD_ATMEGA
+    _power_task = xTaskGetCurrentTaskHandle();
+    TickType_t wait = 0;
 
-    _commands.clear();
+    while (42) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        uint32_t wait_ms = set_power(millis());
+        wait = wait_ms == 0 ? portMAX_DELAY : max(wait_ms / portTICK_PERIOD_MS, (uint32_t)1);
+    }
+#endif
+}
+
+uint32_t MotorController::set_power(uint32_t now_ms) {
+#if !defined(BOARD_ATMEGA) && !defined(STEP_TRACE)
+    static const uint32_t frequencies[POWER_STATES] = {CPU_FREQ_IDLE, CPU_FREQ_TRACKING, CPU_FREQ_SLEWING};
+    uint32_t mhz = _power_mhz.load(std::memory_order_relaxed);
+    uint32_t wanted = frequencies[_power_demand.load(std::memory_order_acquire)];
+
+    // raised at once, the hold starts when a lower demand is seen first, so short pauses between 
+    // movements do not switch it back and forth
+    if (wanted >= mhz) {
+        _power_holding = false;
+        if (wanted == mhz) return 0;
+    } else {
+        if (!_power_holding) {
+            _power_holding = true;
+            _power_hold_ms = now_ms;
+        }
+        if (now_ms - _power_hold_ms < CPU_FREQ_HOLD) return CPU_FREQ_HOLD - (now_ms - _power_hold_ms);
+        _power_holding = false;
+    }
+
+    setCpuFrequencyMhz(wanted);
+    _power_mhz.store(getCpuFrequencyMhz(), std::memory_order_relaxed);
+#endif
+    return 0;
+}
+
+MotorController::power_state_t ENGINE_ATTR MotorController::power_state(uint64_t next) const {
+    if (next == 0) return POWER_IDLE;
+    if (is_fast(_dec) || is_fast(_ra)) return POWER_SLEWING;
+    for (uint32_t axes = _aux_active; axes != 0; axes &= axes - 1) {
+        if (is_fast(_aux[__builtin_ctz(axes)].motor)) return POWER_SLEWING;
+    }
+    return POWER_TRACKING;
+}
+
+bool MotorController::set_motion(const motion_config_t& config) {
+    if (!config.valid()) return false;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    // the pending profile is rebuilt unless the engine takes it meanwhile, the engine runs along 
+    // the latest one otherwise, so the other one is free
+    uint8_t pending = _profile_pending.load(std::memory_order_acquire);
+    bool rebuilt = pending != PROFILE_NONE && _profile_pending.compare_exchange_strong(pending, PROFILE_WRITING, std::memory_order_acquire);
+    uint8_t spare = rebuilt ? pending : 1 - _profile_latest;
+    build_profile(_profiles[spare], config);
+    _motion = config;
+    _profile_latest = spare;
+    _profile_pending.store(spare, std::memory_order_release);
 	xSemaphoreGive(_motor_lock);
+    wake();
+	log_i("Motion profile %d built, DEC %u steps per rev, RA %u steps per rev", spare, config.dec.steps_per_rev, config.ra.steps_per_rev);
+    return true;
+}
+
+void MotorController::build_profile(motion_profile_t& profile, const motion_config_t& config) {
+    build_ramp(profile.dec_ramp, config.dec.accel_steps, config.dec.accel_delay, config.dec.delay_start, config.dec.delay_end);
+    build_ramp(profile.ra_ramp,  config.ra.accel_steps,  config.ra.accel_delay,  config.ra.delay_start,  config.ra.delay_end);
+    profile.pec_worm_pulses = (uint32_t)(2.0 * config.ra.steps_per_rev * MICROSTEPPING_MUL * PEC_WORM_REVS_RA);
+    profile.pec_scale = profile.pec_worm_pulses == 0 ? 0 : ((uint64_t)PEC_SEGMENTS << 32) / profile.pec_worm_pulses + 1;
+}
+
+void MotorController::build_ramp(ramp_t& ramp, int accel_each, int accel_amount, int delay_start, int delay_end) {
+
+    delay_end = max(delay_end, MIN_PULSE_DELAY);
+    ramp.shift = 0;
+
+    if (delay_start <= delay_end) {
+        ramp.delay[0] = delay_end;
+        ramp.time[0] = 0;
+        ramp.length = 1;
+        ramp.jump = 1000000.0 / delay_end;
+        ramp.accel = 1e9;
+        return;
+    }
+
+    // the stairs changed the delay by 'accel_amount' every 'accel_each' steps (two pulses)
+    double distance = 2.0 * accel_each * (delay_start - delay_end) / accel_amount;
+    double v_start = 1000000.0 / delay_start;
+    double v_end = 1000000.0 / delay_end;
+    double accel = (v_end * v_end - v_start * v_start) / (2.0 * distance);
+    ramp.accel = accel;
+    ramp.jump = v_start;
+
+    // peak acceleration of the S-curve is 1.5 times the average one, so keep the peak at 'accel'
+    double duration = (v_end - v_start) / accel * (RAMP_JERK_LIMITED ? 1.5 : 1.0);
+    double total = ramp_position(duration, v_start, v_end, duration);
+
+    while (RAMP_HEAD + (total - RAMP_HEAD) / (1UL << ramp.shift) > RAMP_TABLE_SIZE) ++ramp.shift;
+    ramp.length = RAMP_TABLE_SIZE;
+    while (ramp.length > 1 && ramp.start(ramp.length - 1) >= total) --ramp.length;
+
+    // times of segment boundaries are found by bisection, delays are their differences so 
+    // the rounding errors do not accumulate along the ramp
+    double t_prev = 0;
+    uint32_t time = 0;
+    for (uint16_t i = 0; i < ramp.length; ++i) {
+        double target = ramp.start(i + 1);
+        double t;
+        if (target >= total) t = duration + (target - total) / v_end;
+        else {
+            double lo = t_prev, hi = duration;
+            for (int j = 0; j < 40; ++j) {
+                t = (lo + hi) / 2;
+                if (ramp_position(t, v_start, v_end, duration) < target) lo = t; 
+                else hi = t;
+            }
+        }
+        ramp.delay[i] = max((uint32_t)round((t - t_prev) * 1000000.0 / (target - ramp.start(i))), (uint32_t)delay_end);
+        ramp.time[i] = time;
+        time += ramp.delay[i] * (target - ramp.start(i));
+        t_prev = t;
+    }
+}
+
+double MotorController::ramp_position(double t, double v_start, double v_end, double duration) {
+#if RAMP_JERK_LIMITED
+    // velocity follows the smoothstep 3u^2 - 2u^3, so acceleration is continuous
+    double u = t / duration;
+    return v_start * t + (v_end - v_start) * duration * (u * u * u - u * u * u * u / 2.0);
+#else
+    return v_start * t + (v_end - v_start) * t * t / (2.0 * duration);
+#endif
 }
 
 double MotorController::estimate_fast_turn_time(double revs_dec, double revs_ra) {
 
+    // the motor with more pulses is the master of the coordinated movement and the other
+    // one just follows it, so the master defines the duration
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
     int sd, sr;
-    revs_to_steps(&sd, &sr, revs_dec, revs_ra, false);
-    
-    auto time_dec = estimate_motor_fast_turn_time(sd, ACCEL_STEPS_DEC, ACCEL_DELAY_DEC, FAST_DELAY_START_DEC, FAST_DELAY_END_DEC);
-    auto time_ra  = estimate_motor_fast_turn_time(sr, ACCEL_STEPS_RA,  ACCEL_DELAY_RA,  FAST_DELAY_START_RA,  FAST_DELAY_END_RA);
-
-    return max(time_dec, time_ra);
+    revs_to_steps(&sd, &sr, revs_dec, revs_ra, true);
+    const motion_profile_t& profile = _profiles[_profile_latest];
+    double duration = (sd >= sr ? accelerated_duration(sd * 2, profile.dec_ramp) : accelerated_duration(sr * 2, profile.ra_ramp)) / 1000.0;
+	xSemaphoreGive(_motor_lock);
+    return duration;
 } 
 
-double MotorController::estimate_motor_fast_turn_time(double steps, int accel_each, int accel_amount, int delay_start, int delay_end) {
+uint64_t MotorController::ramp_duration(uint32_t pulses, const ramp_t& ramp) {
 
-    double time = 0;
+    // follows change_motor_speed: pulse 'j' moves to the ramp position 'j' until the remaining pulses 
+    // reach the position, stopping then takes as many pulses as is the position
+    if (pulses < 2) return 0;
+    uint32_t top = ramp.pulses() - 1;
+    uint32_t peak = pulses / 2;
 
-    double total_steps = floor(steps);
-    double accel_steps = floor(steps);
-    int delay_curr = delay_start; 
+    // accelerate to the top, cruise, decelerate
+    if (pulses > 2 * top) return 2 * ramp.sum(top) - ramp.at(0) + (uint64_t)(pulses - 2 * top) * ramp.at(top);
 
-    for (accel_steps -= accel_each; (accel_steps > steps / 2.0) && (delay_curr > delay_end);) {
-        time += (double)delay_curr * accel_each;
-        delay_curr -= accel_amount;
-        accel_steps -= accel_each;
-    }
-    accel_steps += accel_each;
+    // triangle with one or two pulses at the peak speed
+    if (pulses % 2) return 2 * ramp.sum(peak) + ramp.at(peak) - ramp.at(0);
+    return 2 * ramp.sum(peak) + ramp.at(peak) - 2 * ramp.at(0);
+}
 
-    return (2 * time + (2 * accel_steps - total_steps) * delay_curr) / 1000.0; 
+uint64_t MotorController::accelerated_duration(uint32_t pulses, const ramp_t& ramp) {
+
+    // see split_accelerated, the motor is at a full step position, so there are no microsteps before full steps
+    if (pulses == 0) return 0;
+    uint32_t full = MICROSTEPPING_MUL > 1 ? pulses / (2 * MICROSTEPPING_MUL) * 2 : pulses;
+    uint32_t tail = pulses - full * MICROSTEPPING_MUL;
+    if (full == 0) return (tail - 1) * micro_period(ramp) >> 32;
+    return ramp_duration(full, ramp) + (tail * micro_period(ramp) >> 32);
 }
 
 void MotorController::fast_turn(double revs_dec, double revs_ra, boolean queueing) {
-    turn_internal({revs_dec, revs_ra, FAST_DELAY_START_DEC, FAST_DELAY_START_RA, FAST_DELAY_END_DEC, FAST_DELAY_END_RA, false}, queueing);
+    turn_internal({revs_dec, revs_ra, 0, 0, false}, queueing);
 }
 
 void MotorController::slow_turn(double revs_dec, double revs_ra, double speed_dec, double speed_ra, boolean queueing) {
-    // revolutions per second convert to delay in micros
-    // there might be some overflows, but nobody cares ... (hopefully)
-    uint32_t delay_dec = 1000000.0 / (speed_dec * STEPS_PER_REV_DEC * MICROSTEPPING_MUL);
-    uint32_t delay_ra  = 1000000.0 / (speed_ra  * STEPS_PER_REV_RA  * MICROSTEPPING_MUL);
-    turn_internal({revs_dec, revs_ra, delay_dec, delay_ra, delay_dec, delay_ra, true}, queueing);
+    turn_internal({revs_dec, revs_ra, speed_dec, speed_ra, true}, queueing);
 }
 
-void MotorController::turn_internal(command_t cmd, bool queueing) {
-    if (queueing && !is_ready()) {
-        _commands.push(cmd);
-        return;
+void MotorController::move_to(double revs_dec, double revs_ra, boolean queueing, uint64_t start_us) {
+    segment_t segment = {};
+    segment.start_us = start_us;
+    segment.absolute = true;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    // steps per revolution are read under the lock, so the goal is of the configuration which the engine runs it with
+    segment.goal_dec = lround(revs_dec * _motion.dec.steps_per_rev * MICROSTEPPING_MUL) * 2;
+    segment.goal_ra = lround(revs_ra * _motion.ra.steps_per_rev * MICROSTEPPING_MUL) * 2;
+    push_segment(segment, queueing);
+	xSemaphoreGive(_motor_lock);
+    wake();
+	log_d("moving to DEC %f RA %f revs", revs_dec, revs_ra);
+}
+
+void MotorController::set_velocity(double speed_dec, double speed_ra, boolean queueing, uint64_t start_us) {
+    segment_t segment = {};
+    segment.start_us = start_us;
+    segment.reverse_dec = speed_dec < 0;
+    segment.reverse_ra = speed_ra < 0;
+    segment.velocity = true;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    segment.period_dec = revs_per_sec_to_period(speed_dec, _motion.dec.steps_per_rev);
+    segment.period_ra = revs_per_sec_to_period(speed_ra, _motion.ra.steps_per_rev);
+    push_segment(segment, queueing);
+	xSemaphoreGive(_motor_lock);
+    wake();
+	log_d("velocity DEC %f RA %f revs/s", speed_dec, speed_ra);
+}
+
+template<uint8_t AXIS>
+void MotorController::aux_initialize() {
+    typedef aux_axis_config<AXIS> config;
+    aux_data& axis = _aux[AXIS];
+    axis.motor.axis = 2 + AXIS;
+    axis.steps_per_rev = config::steps_per_rev;
+    if (config::steps_per_rev == 0) return;
+
+    config::pins::output();
+    build_ramp(axis.ramp, config::accel_steps, config::accel_delay, config::delay_start, config::delay_end);
+    axis.motor.accel = axis.ramp.accel * MICROSTEPPING_MUL;
+    axis.motor.jump = axis.ramp.jump * MICROSTEPPING_MUL;
+    log_d("Ramp: auxiliary axis %d %d pulses", AXIS, axis.ramp.pulses());
+}
+
+const MotorController::aux_trigger_t ENGINE_DATA MotorController::_aux_triggers[AUX_AXES] = {
+    &MotorController::aux_trigger<AXIS_FOCUS>,
+    &MotorController::aux_trigger<AXIS_ROTATOR>
+};
+
+void MotorController::aux_move(uint8_t axis, double revs) {
+    if (axis >= AUX_AXES || _aux[axis].steps_per_rev == 0) return;
+    aux_command_t command = {};
+    command.pulses = lround(fabs(revs) * _aux[axis].steps_per_rev * MICROSTEPPING_MUL) * 2;
+    command.reverse = revs < 0;
+    aux_push(axis, command);
+	log_d("auxiliary axis %d moving by %f revs", axis, revs);
+}
+
+void MotorController::aux_velocity(uint8_t axis, double speed) {
+    if (axis >= AUX_AXES || _aux[axis].steps_per_rev == 0) return;
+    aux_command_t command = {};
+    command.period = revs_per_sec_to_period(speed, _aux[axis].steps_per_rev);
+    command.reverse = speed < 0;
+    command.velocity = true;
+    aux_push(axis, command);
+	log_d("auxiliary axis %d velocity %f revs/s", axis, speed);
+}
+
+void MotorController::aux_stop(uint8_t axis, bool emergency) {
+    if (axis >= AUX_AXES || _aux[axis].steps_per_rev == 0) return;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    if (emergency) _aux[axis].emergency.store(true, std::memory_order_relaxed);
+    _aux[axis].epoch.fetch_add(1, std::memory_order_release);
+	xSemaphoreGive(_motor_lock);
+    _aux_pending.fetch_or(1UL << axis, std::memory_order_release);
+    wake();
+}
+
+void MotorController::aux_push(uint8_t axis, aux_command_t& command) {
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    command.epoch = _aux[axis].epoch.load(std::memory_order_relaxed);
+    while (!_aux[axis].commands.push(command)) vTaskDelay(1);
+	xSemaphoreGive(_motor_lock);
+    _aux_pending.fetch_or(1UL << axis, std::memory_order_release);
+    wake();
+}
+
+bool MotorController::aux_busy(uint8_t axis) {
+    if (axis >= AUX_AXES) return false;
+    position_t position;
+    get_position(position);
+    return (position.aux_active & (1UL << axis)) || !_aux[axis].commands.empty();
+}
+
+double MotorController::aux_revolutions(uint8_t axis) {
+    if (axis >= AUX_AXES || _aux[axis].steps_per_rev == 0) return 0;
+    position_t position;
+    get_position(position);
+    return (double) position.aux[axis] / 2.0 / _aux[axis].steps_per_rev / MICROSTEPPING_MUL;
+}
+
+double MotorController::aux_max_speed(uint8_t axis) {
+    if (axis >= AUX_AXES || _aux[axis].steps_per_rev == 0) return 0;
+    const ramp_t& ramp = _aux[axis].ramp;
+    return 1000000.0 / ramp.at(ramp.pulses() - 1) / 2.0 / _aux[axis].steps_per_rev;
+}
+
+void MotorController::pec_set_origin() {
+    if (!PEC_ENABLED) return;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    pec_push({PEC_ORIGIN, PEC_TABLES, 0, 0});
+	xSemaphoreGive(_motor_lock);
+	log_d("PEC origin set");
+}
+
+void MotorController::pec_upload(const int16_t* corrections) {
+    if (!PEC_ENABLED) return;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    uint8_t table = pec_free_table();
+    for (uint16_t i = 0; i < PEC_SEGMENTS; ++i) _pec.tables[table][i] = constrain(corrections[i], -PEC_LIMIT, PEC_LIMIT);
+    pec_push({PEC_PLAY, table, 0, 0});
+	xSemaphoreGive(_motor_lock);
+	log_d("PEC table %d uploaded", table);
+}
+
+void MotorController::pec_play(bool enable) {
+    if (!PEC_ENABLED) return;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    pec_push({enable ? PEC_PLAY : PEC_STOP, PEC_TABLES, 0, 0});
+	xSemaphoreGive(_motor_lock);
+}
+
+void MotorController::pec_record() {
+    if (!PEC_ENABLED) return;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    uint8_t table = pec_free_table();
+    pec_push({PEC_RECORD, table, 0, 0});
+	xSemaphoreGive(_motor_lock);
+	log_d("PEC recording into table %d", table);
+}
+
+void MotorController::guide_ra(double rate, uint32_t ms) {
+    if (!PEC_ENABLED) return;
+    // the speed never drops to zero or below
+    rate = constrain(rate, -0.75, 0.75);
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    pec_push({PEC_GUIDE, PEC_TABLES, (int32_t)lround(rate * PEC_UNIT), ms * 1000});
+	xSemaphoreGive(_motor_lock);
+}
+
+void MotorController::get_pec(pec_status_t& status, int16_t* corrections) {
+    uint8_t state = _pec.state.load(std::memory_order_acquire);
+    position_t position;
+    get_position(position);
+    status.playing = (state >> 4) & 1;
+    status.recording = ((state >> 2) & 3) != PEC_TABLES;
+    status.segment = position.pec_segment;
+    if (corrections == NULL) return;
+
+    // producers do not touch the last played table, the engine does not write it
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    uint8_t table = _pec.state.load(std::memory_order_acquire) & 3;
+    for (uint16_t i = 0; i < PEC_SEGMENTS; ++i) corrections[i] = table == PEC_TABLES ? 0 : _pec.tables[table][i];
+	xSemaphoreGive(_motor_lock);
+}
+
+void MotorController::pec_push(const pec_command_t& command) {
+    while (!_pec.commands.push(command)) vTaskDelay(1);
+    wake();
+}
+
+uint8_t MotorController::pec_free_table() {
+    // once commands are taken, the state can change only by the end of the recording, 
+    // which just makes the recorded table the played one
+    while (!_pec.commands.empty()) vTaskDelay(1);
+    uint8_t state = _pec.state.load(std::memory_order_acquire);
+    uint8_t table = 0;
+    while (table == (state & 3) || table == ((state >> 2) & 3)) ++table;
+    return table;
+}
+
+void MotorController::compare_callback(uint8_t slot, uint8_t axis, long position, long interval, compare_callback_t callback, void* arg) {
+    compare_arm(slot, axis, position, interval, {callback, arg, 0, false, 0});
+}
+
+void MotorController::compare_pin(uint8_t slot, uint8_t axis, long position, long interval, uint8_t pin, bool level) {
+    pinMode(pin, OUTPUT);
+    compare_arm(slot, axis, position, interval, {NULL, NULL, pin, level, 0});
+}
+
+void MotorController::compare_disarm(uint8_t slot) {
+    if (slot >= COMPARE_EVENTS) return;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    // queued events of the slot are dropped
+    uint8_t generation = ++_compare.actions[slot].generation;
+    compare_push({COMPARE_DISARM, slot, 0, generation, 0, 0});
+	xSemaphoreGive(_motor_lock);
+}
+
+void MotorController::compare_arm(uint8_t slot, uint8_t axis, long position, long interval, compare_action_t action) {
+    if (slot >= COMPARE_EVENTS || axis >= 2 + AUX_AXES) return;
+	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    action.generation = _compare.actions[slot].generation + 1;
+    _compare.actions[slot] = action;
+    compare_push({COMPARE_ARM, slot, axis, action.generation, position, interval});
+	xSemaphoreGive(_motor_lock);
+	log_d("event %d armed at %ld of axis %d, interval %ld", slot, position, axis, interval);
+}
+
+void MotorController::compare_push(const compare_command_t& command) {
+    while (!_compare.commands.push(command)) vTaskDelay(1);
+    wake();
+}
+
+uint32_t MotorController::dispatch_events(TickType_t ticks) {
+    _compare.dispatcher.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+    if (_compare.events.empty()) ulTaskNotifyTake(pdTRUE, ticks);
+
+    uint32_t performed = 0;
+    compare_event_t event;
+    while (_compare.events.pop(event)) {
+        // producers replace actions under the lock, the action runs without it as it may arm events
+	    xSemaphoreTake(_motor_lock, portMAX_DELAY);
+        compare_action_t action = _compare.actions[event.slot];
+	    xSemaphoreGive(_motor_lock);
+        if (action.generation != event.generation) continue;
+        if (action.callback != NULL) action.callback(event, action.arg);
+        else digitalWrite(action.pin, action.level);
+        ++performed;
     }
+    return performed;
+}
+
+void MotorController::turn_internal(command_t cmd, bool queueing) {
+
+    segment_t segment = {};
+    segment.reverse_dec = cmd.revs_dec < 0;
+    segment.reverse_ra = cmd.revs_ra < 0;
+    segment.accelerate = !cmd.microstepping;
+    segment.microstepping = cmd.microstepping;
+    segment.velocity = false;
+    segment.absolute = false;
+
 	xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    // accelerated movements are in microsteps too, the engine decides which of them are done by full steps
     int steps_dec, steps_ra;
-    revs_to_steps(&steps_dec, &steps_ra, cmd.revs_dec, cmd.revs_ra, cmd.microstepping);
-	log_d("turning by DEC %f RA %f revs, %d %d steps %d %d balance",cmd.revs_dec, cmd.revs_ra, steps_dec, steps_ra, this->_dec_balance, this->_ra_balance);
-	log_d("total steps ra %d dec %d", _dec_balance, _ra_balance);
-	
-    //cli();
+    revs_to_steps(&steps_dec, &steps_ra, cmd.revs_dec, cmd.revs_ra, true);
+    segment.pulses_dec = steps_dec * 2;
+    segment.pulses_ra = steps_ra * 2;
+    // fixed point delays keep the fraction of microsecond, so even tracking rates do not drift
+    if (cmd.microstepping) {
+        segment.period_dec = revs_per_sec_to_period(cmd.speed_dec, _motion.dec.steps_per_rev);
+        segment.period_ra = revs_per_sec_to_period(cmd.speed_ra, _motion.ra.steps_per_rev);
+    }
+    push_segment(segment, queueing);
+	xSemaphoreGive(_motor_lock);
+    wake();
+	log_d("turning by DEC %f RA %f revs, %d %d steps", cmd.revs_dec, cmd.revs_ra, steps_dec, steps_ra);
 
-    // wait 1ms for pins to stabilize if needed
-    bool dec_rev = cmd.revs_dec < 0;
-	bool ra_rev = cmd.revs_ra < 0;
+    log_d("Queued new movement:");
+    log_d("  steps DEC: %d RA: %d", steps_dec, steps_ra);
+    log_d("  micro s. (t/f): %s", cmd.microstepping ? "enabled" : "disabled");
+}
+
+void MotorController::push_segment(segment_t& segment, bool queueing) {
+    // not queued command cancels everything what is running or waiting
+    if (!queueing) _epoch.fetch_add(1, std::memory_order_release);
+    segment.epoch = _epoch.load(std::memory_order_relaxed);
+    segment.join = join_position(_last_segment, segment);
+    while (!_segments.push(segment)) vTaskDelay(1);
+    _last_segment = segment;
+}
+
+uint32_t MotorController::join_position(const segment_t& prev, const segment_t& next) const {
+
+    // timed segments start from standstill
+    if (prev.epoch != next.epoch || !prev.accelerate || !next.accelerate || next.start_us != 0) return 0;
+
+    // the master keeps its speed, so it must be the same motor moving in the same direction
+    bool dec_master = prev.pulses_dec >= prev.pulses_ra;
+    if (dec_master != (next.pulses_dec >= next.pulses_ra)) return 0;
+    if ((dec_master ? prev.reverse_dec != next.reverse_dec : prev.reverse_ra != next.reverse_ra)) return 0;
+
+    const motion_profile_t& profile = _profiles[_profile_latest];
+    const ramp_t& ramp = dec_master ? profile.dec_ramp : profile.ra_ramp;
+    const ramp_t& slave_ramp = dec_master ? profile.ra_ramp : profile.dec_ramp;
+    uint32_t master_prev = dec_master ? prev.pulses_dec : prev.pulses_ra;
+    uint32_t master_next = dec_master ? next.pulses_dec : next.pulses_ra;
+    if (master_prev == 0 || master_next == 0) return 0;
+
+    // the next segment must be able to stop from the junction speed by itself
+    uint32_t join = min(master_next / MICROSTEPPING_MUL, ramp.pulses() - 1);
+
+    // speed of the slave jumps at the junction as the ratio of pulses changes, the jump must not
+    // be higher than the starting speed of its ramp
+    double slave_prev = (double)(dec_master ? prev.pulses_ra : prev.pulses_dec) / master_prev;
+    double slave_next = (double)(dec_master ? next.pulses_ra : next.pulses_dec) / master_next;
+    if ((dec_master ? prev.reverse_ra : prev.reverse_dec)) slave_prev = -slave_prev;
+    if ((dec_master ? next.reverse_ra : next.reverse_dec)) slave_next = -slave_next;
+    return ramp_index(ramp, fabs(slave_next - slave_prev) * slave_ramp.at(0), join);
+}
+
+template<class PINS>
+void ENGINE_ATTR MotorController::step_micros(motor_data& data, uint32_t pulses, uint64_t period, bool reverse, bool microstepping, const ramp_t* ramp) {
+    data.pulses_remaining = pulses;
+	data.reverse = reverse;
+    data.ramp = ramp;
+    data.ramp_pos = 0;
+    data.ramp_top = ramp == NULL ? 0 : ramp->pulses() - 1;
+    data.exit_pos = 0;
+    data.micro_head = 0;
+    data.micro_tail = 0;
+    data.carry = 0;
+    data.endless = false;
+    data.microstepping = microstepping;
+    data.speed = 0;
+    if (ramp != NULL) period = microstepping ? micro_period(*ramp) : (uint64_t)ramp->delay[0] << 32;
+    if ((period >> 32) < MIN_PULSE_DELAY) period = (uint64_t)MIN_PULSE_DELAY << 32;
+	data.current_steps_delay = period >> 32;
+    data.delay_fraction = (uint32_t)period;
+    data.phase = 0;
+    data.next_pulse_us = 0;
+    data.increment = (microstepping ? 1 : MICROSTEPPING_MUL) * (reverse ? -1 : 1);
+    data.slaved = false;
+    data.trace_flags = trace_flags(data);
+
+    // set long before the first pulse, so the driver has enough time to settle
+    PINS::dir::write(reverse != PINS::dir_swap);
+    if (MICROSTEPPING_MUL > 1) PINS::ms::write(microstepping);
+}
+
+void ENGINE_ATTR MotorController::split_accelerated(const motor_data& data, uint32_t pulses, bool reverse, uint32_t& head, uint32_t& full, uint32_t& tail) {
+
+    head = 0;
+    full = pulses;
+    tail = 0;
+    if (MICROSTEPPING_MUL == 1) return;
+
+    // running full steps might be between edges of a step, the next pulse gets to a full step position then
+    const uint32_t cycle = 2 * MICROSTEPPING_MUL;
+    bool running = data.pulses_remaining > 0 && !data.microstepping;
+    if (!running) head = min(pulses, reverse ? data.step_phase : (cycle - data.step_phase) % cycle);
+    uint32_t odd = running && data.step_phase != 0;
+
+    full = (pulses - head) / MICROSTEPPING_MUL;
+    if (full > 0 && ((full + odd) & 1)) --full;
+    tail = pulses - head - full * MICROSTEPPING_MUL;
+
+    // just microsteps if there is no full step to do
+    if (full == 0) {
+        head += tail;
+        tail = 0;
+    }
+}
+
+template<class PINS>
+void ENGINE_ATTR MotorController::step_accelerated(motor_data& data, uint32_t pulses, bool reverse, const ramp_t* ramp) {
+    uint32_t head, full, tail;
+    split_accelerated(data, pulses, reverse, head, full, tail);
+    step_micros<PINS>(data, head + full + tail, 0, reverse, head > 0 || full == 0, ramp);
+    data.micro_head = full > 0 ? head : 0;
+    data.micro_tail = tail;
+}
+
+template<class PINS>
+void ENGINE_ATTR MotorController::set_microstepping(motor_data& data, bool microstepping) {
+    data.microstepping = microstepping;
+    data.increment = (microstepping ? 1 : MICROSTEPPING_MUL) * (data.reverse ? -1 : 1);
+    data.trace_flags = trace_flags(data);
+    if (MICROSTEPPING_MUL > 1) PINS::ms::write(microstepping);
+}
+
+void ENGINE_ATTR MotorController::next_segment(uint64_t now) {
+
+    uint8_t epoch = _epoch.load(std::memory_order_acquire);
+    bool aborted = epoch != _engine_epoch;
+    if (aborted) {
+        _engine_epoch = epoch;
+        _goal_valid = false;
+        halt(_emergency.exchange(false, std::memory_order_acquire));
+    }
+
+    if (_velocity_mode) {
+        // segments pushed before the last stop are dropped, they would hold the ring forever
+        segment_t segment = {};
+        const segment_t* next = due_segment(now, epoch);
+        while (next != NULL && next->epoch != epoch && _segments.pop(segment)) next = due_segment(now, epoch);
+        // new speeds are taken at once, the engine never waits for endless motors
+        if (next != NULL && next->velocity) {
+            _segments.pop(segment);
+            trace(STEP_EVENT_SEGMENT | STEP_EVENT_MICROSTEP, _segments.popped());
+            apply_velocity<dec_pins>(_dec, segment.period_dec, segment.reverse_dec);
+            apply_velocity<ra_pins>(_ra, segment.period_ra, segment.reverse_ra);
+            return;
+        }
+        // movements wait until both motors stop, slow ones stop at once, so timed movements start in time
+        if (next != NULL) {
+            _dec.target_speed = 0;
+            _ra.target_speed = 0;
+            if (!is_fast(_dec)) _dec.pulses_remaining = 0;
+            if (!is_fast(_ra)) _ra.pulses_remaining = 0;
+        }
+        // the mode ends once both motors stand, after a halt as well
+        if (_dec.pulses_remaining > 0 || _ra.pulses_remaining > 0) return;
+        _velocity_mode = false;
+    }
+
+    const segment_t* next = due_segment(now, epoch);
+    bool retargeting = next != NULL && next->absolute && next->epoch == epoch;
 
+    if (_dec.pulses_remaining > 0 || _ra.pulses_remaining > 0) {
+        // new goal replaces the goal of the running fast movement at once
+        if (_goal_valid && retargeting && _coordination.master != NULL) {
+            segment_t segment = {};
+            _segments.pop(segment);
+            trace(STEP_EVENT_SEGMENT | STEP_EVENT_ACCELERATE, _segments.popped());
+            _goal_dec = segment.goal_dec;
+            _goal_ra = segment.goal_ra;
+            plan_goal();
+        }
+        return;
+    }
 
-    int32_t effective_steps_dec = steps_dec;
-    int32_t effective_steps_ra = steps_ra;
+    // the absolute movement goes on until its goal is reached unless there is a newer one
+    if (_goal_valid && !retargeting && plan_goal()) return;
+    _goal_valid = false;
 
-    _dec.pulses_to_accel = 0;
-    _ra.pulses_to_accel  = 0;
+    // state of the master which may continue into the next segment without stopping
+    motor_data* master = _coordination.master;
+    uint32_t ramp_pos = master != NULL ? master->ramp_pos : 0;
+    uint64_t next_pulse_us = master != NULL ? master->next_pulse_us : 0;
 
-    _dec.steps_total = effective_steps_dec;
-    _ra.steps_total = effective_steps_ra;
+    // a new motion profile is taken only between moves, nothing runs along the old ramps then
+    if (ramp_pos == 0 && _profile_pending.load(std::memory_order_relaxed) < PROFILE_NONE) take_profile();
     
-    _dec.target_steps_delay = cmd.delay_end_dec;
-    _ra.target_steps_delay  = cmd.delay_end_ra;
-
-    _dec.start_steps_delay = cmd.delay_start_dec;
-    _ra.start_steps_delay  = cmd.delay_start_ra;
-
-    step_micros(&_dec, effective_steps_dec * 2, _dec.start_steps_delay, dec_rev);
-    step_micros(&_ra,  effective_steps_ra  * 2, _ra.start_steps_delay, ra_rev);
-        log_d("Initializing new movement.");
-        log_d("  revs DEC:       %f", cmd.revs_dec);
-        log_d("  resv RA:        %f", cmd.revs_ra);
-		log_d("  steps DEC: %d RA: %d", effective_steps_dec, effective_steps_ra);
-        log_d("  micro s. (t/f): %s", cmd.microstepping ? "enabled" : "disabled");
-		log_d("Direction dec %d ra %d", digitalRead(DIR_PIN_DEC), digitalRead(DIR_PIN_RA));
-	xSemaphoreGive(_motor_lock);
+    // pulses of the slow movement keep their cadence, so the microstepping tail does not
+    // start before the previous pulse is complete, slaves follow the cadence of their master
+    uint64_t dec_pulse_us = _dec.slaved ? next_pulse_us : _dec.next_pulse_us;
+    uint64_t ra_pulse_us = _ra.slaved ? next_pulse_us : _ra.next_pulse_us;
+
+    segment_t segment = {};
+    while (due_segment(now, epoch) != NULL && _segments.pop(segment)) {
+        // segments pushed before the last stop are dropped
+        if (segment.epoch != _epoch.load(std::memory_order_acquire)) continue;
+        bool continues = !aborted && segment.epoch == _engine_epoch;
+        _engine_epoch = segment.epoch;
+        trace(STEP_EVENT_SEGMENT | (segment.accelerate ? STEP_EVENT_ACCELERATE : 0) | (segment.microstepping ? STEP_EVENT_MICROSTEP : 0), _segments.popped());
+
+        if (segment.absolute) {
+            _goal_dec = segment.goal_dec;
+            _goal_ra = segment.goal_ra;
+            _goal_valid = true;
+            if (plan_goal()) break;
+            _goal_valid = false;
+            continue;
+        }
+
+        if (segment.velocity) {
+            _coordination.master = NULL;
+            _velocity_mode = true;
+            apply_velocity<dec_pins>(_dec, segment.period_dec, segment.reverse_dec);
+            apply_velocity<ra_pins>(_ra, segment.period_ra, segment.reverse_ra);
+            return;
+        }
+
+        if (segment.accelerate) {
+            if (continues) {
+                segment.pulses_dec += _dec.carry;
+                segment.pulses_ra += _ra.carry;
+            }
+            step_accelerated<dec_pins>(_dec, segment.pulses_dec, segment.reverse_dec, &_profile->dec_ramp);
+            step_accelerated<ra_pins>(_ra,   segment.pulses_ra,  segment.reverse_ra,  &_profile->ra_ramp);
+        } else {
+            step_micros<dec_pins>(_dec, segment.pulses_dec, segment.period_dec, segment.reverse_dec, segment.microstepping, NULL);
+            step_micros<ra_pins>(_ra,   segment.pulses_ra,  segment.period_ra,  segment.reverse_ra,  segment.microstepping, NULL);
+        }
+
+        // fast movements are coordinated, the shorter one is slaved and gets no schedule of its own
+        _coordination.master = NULL;
+        if (segment.accelerate && (segment.pulses_dec > 0 || segment.pulses_ra > 0)) {
+            coordinate_motors();
+
+            // blended junction, the master goes on with its speed (at most the join one) and schedule
+            if (continues && segment.join > 0 && ramp_pos > 0 && _coordination.master == master && !master->microstepping) {
+                master->ramp_pos = min(ramp_pos, segment.join);
+                master->current_steps_delay = master->ramp->at(master->ramp_pos);
+                master->next_pulse_us = next_pulse_us;
+            }
+        } else if (continues && segment.microstepping) {
+            _dec.next_pulse_us = dec_pulse_us;
+            _ra.next_pulse_us = ra_pulse_us;
+        }
 
-    // compensate coarse resolution of the full-step movement
-    if (!cmd.microstepping) {
-        double revs_dec, revs_ra;
-        steps_to_revs(&revs_dec, &revs_ra, steps_dec - effective_steps_dec, steps_ra - effective_steps_ra, false);
-        slow_turn(revs_dec, revs_ra, FAST_REVS_PER_SEC_DEC / MICROSTEPPING_MUL, FAST_REVS_PER_SEC_RA / MICROSTEPPING_MUL, true);
+        if (_dec.pulses_remaining > 0 || _ra.pulses_remaining > 0) break;
     }
 
-#ifdef BOARD_ATMEGA
-    TCNT1 = 0; // reset Timer1 counter
-#endif
+    look_ahead();
+}
 
-    //sei();
+void ENGINE_ATTR MotorController::take_profile() {
+    uint8_t pending = _profile_pending.load(std::memory_order_acquire);
+    if (pending >= PROFILE_NONE || !_profile_pending.compare_exchange_strong(pending, PROFILE_NONE, std::memory_order_acquire)) return;
+    _profile = &_profiles[pending];
+
+    // limits of the velocity mode in microsteps
+    _dec.accel = _profile->dec_ramp.accel * MICROSTEPPING_MUL;
+    _dec.jump = _profile->dec_ramp.jump * MICROSTEPPING_MUL;
+    _ra.accel = _profile->ra_ramp.accel * MICROSTEPPING_MUL;
+    _ra.jump = _profile->ra_ramp.jump * MICROSTEPPING_MUL;
+
+    // steps per revolution of RA might have changed
+    if (_profile->pec_worm_pulses != 0) _pec.position %= _profile->pec_worm_pulses;
 }
 
-bool MotorController::change_pin(byte pin, byte value) {
-#ifdef BOARD_ATMEGA
-    if (((MOTORS_PORT >> pin) & 1) == value) return false;
-    MOTORS_PORT ^= (-value ^ MOTORS_PORT) & (1 << pin);
-#else
-	uint8_t state = digitalRead(pin);
-	if(state == value) return false;
-	digitalWrite(pin, value);
-	log_d("Changed pin %d to %d", pin, value);
-#endif
+void ENGINE_ATTR MotorController::halt(bool emergency) {
+
+    // the velocity mode ramps speeds down by itself and ends once motors stand
+    if (_velocity_mode && !emergency) {
+        _dec.target_speed = 0;
+        _ra.target_speed = 0;
+        return;
+    }
+    _velocity_mode = false;
+
+    // accelerated movement gets just as many pulses as its master needs to stop from the current 
+    // speed, the slave keeps the ratio, so both stay on the line, slow movements stop at once
+    motor_data* master = _coordination.master;
+    if (!emergency && master != NULL && master->pulses_remaining > 0) {
+        shorten(min(full_remaining(*master), master->ramp_pos), 0);
+        return;
+    }
+
+    _dec.pulses_remaining = 0;
+    _ra.pulses_remaining = 0;
+    _coordination.master = NULL;
+}
+
+void ENGINE_ATTR MotorController::shorten(uint32_t pulses, uint32_t exit_pos) {
+    motor_data* master = _coordination.master;
+    motor_data* slave = master == &_dec ? &_ra : &_dec;
+    pulses = cut_pulses(*master, pulses);
+    uint32_t slave_pulses = (uint64_t)pulses * _coordination.slave_pulses / max(_coordination.master_pulses, (uint32_t)1);
+    // the slave pulses only with its master, so it cannot get more pulses than the master has
+    slave_pulses = cut_pulses(*slave, min(slave->pulses_remaining, slave_pulses));
+    if (slave_pulses > pulses) slave_pulses -= 2;
+    slave->pulses_remaining = slave_pulses;
+    master->pulses_remaining = pulses;
+    master->exit_pos = exit_pos;
+    // microsteps of the tails are dropped, those of the slave head as well if it never gets to full steps
+    master->micro_tail = 0;
+    slave->micro_tail = 0;
+    if (slave->micro_head >= slave->pulses_remaining) slave->micro_head = 0;
+    _coordination.master_pulses = master->pulses_remaining;
+    _coordination.slave_pulses = slave->pulses_remaining;
+    _coordination.error = _coordination.master_pulses / 2;
+}
+
+void ENGINE_ATTR MotorController::coordinate_motors() {
+    bool dec_master = _dec.pulses_remaining >= _ra.pulses_remaining;
+    motor_data& slave = dec_master ? _ra : _dec;
+    _coordination.master = dec_master ? &_dec : &_ra;
+    _coordination.master->slaved = false;
+    _coordination.master_pulses = _coordination.master->pulses_remaining;
+    _coordination.slave_pulses = slave.pulses_remaining;
+    _coordination.error = _coordination.master_pulses / 2;
+    slave.slaved = true;
+}
+
+bool ENGINE_ATTR MotorController::plan_goal() {
+
+    long dec = _goal_dec - _dec_balance;
+    long ra = _goal_ra - _ra_balance;
+    if (dec == 0 && ra == 0) {
+        _coordination.master = NULL;
+        return false;
+    }
+
+    // the running master (if any) goes on if it keeps its direction, stays the master and has
+    // enough full steps to stop, speed of the slave jumps by the change of the ratio of pulses
+    motor_data* master = _coordination.master;
+    uint32_t ramp_pos = master != NULL && !master->microstepping ? master->ramp_pos : 0;
+    if (ramp_pos > 0) {
+        motor_data* slave = master == &_dec ? &_ra : &_dec;
+        long to_master = master == &_dec ? dec : ra;
+        long to_slave = master == &_dec ? ra : dec;
+        uint32_t head, full, tail, slave_head, slave_full, slave_tail;
+        split_accelerated(*master, labs(to_master), to_master < 0, head, full, tail);
+        split_accelerated(*slave, labs(to_slave), to_slave < 0, slave_head, slave_full, slave_tail);
+        uint32_t master_pulses = head + full + tail;
+        uint32_t slave_pulses = slave_head + slave_full + slave_tail;
+
+        // coordinate_motors prefers DEC if both have the same number of pulses
+        bool stays = master_pulses > slave_pulses || (master_pulses == slave_pulses && master == &_dec);
+        uint32_t limit = 0;
+        if (stays && full >= ramp_pos && (to_master < 0) == master->reverse) {
+            double ratio_old = (double)_coordination.slave_pulses / max(_coordination.master_pulses, (uint32_t)1);
+            double ratio_new = (double)slave_pulses / master_pulses;
+            if (slave->reverse != master->reverse) ratio_old = -ratio_old;
+            if ((to_slave < 0) != (to_master < 0)) ratio_new = -ratio_new;
+            const ramp_t& slave_ramp = master == &_dec ? _profile->ra_ramp : _profile->dec_ramp;
+            limit = ramp_index(*master->ramp, fabs(ratio_new - ratio_old) * slave_ramp.at(0), ramp_pos);
+        }
+
+        // switch to the new line right now, the speed and the schedule of the master are kept
+        if (limit > 0 && ramp_pos <= limit + 1) {
+            uint64_t next_pulse_us = master->next_pulse_us;
+            step_accelerated<dec_pins>(_dec, labs(dec), dec < 0, &_profile->dec_ramp);
+            step_accelerated<ra_pins>(_ra, labs(ra), ra < 0, &_profile->ra_ramp);
+            coordinate_motors();
+            master->ramp_pos = min(ramp_pos, limit);
+            master->current_steps_delay = master->ramp->at(master->ramp_pos);
+            master->next_pulse_us = next_pulse_us;
+            return true;
+        }
+
+        // slow down along the old line to the speed which allows the switch or stop if there is
+        // none, this is planned again once motors get there
+        uint32_t pulses = min(full_remaining(*master), ramp_pos - limit);
+        if (pulses > 0) {
+            shorten(pulses, limit);
+            return true;
+        }
+    }
+
+    // microsteps up to full step positions, full steps along ramps and microsteps of the rest
+    step_accelerated<dec_pins>(_dec, labs(dec), dec < 0, &_profile->dec_ramp);
+    step_accelerated<ra_pins>(_ra, labs(ra), ra < 0, &_profile->ra_ramp);
+    coordinate_motors();
     return true;
 }
 
-void MotorController::step_micros(motor_data* data, int pulses, unsigned long micros_between_steps, bool reverse) {
-    data->pulses_remaining = pulses;
-	data->reverse = reverse;
-	if(micros_between_steps != data->current_steps_delay) log_d("Changed delay from %ul to %ul", data->current_steps_delay, micros_between_steps);
-	data->current_steps_delay = micros_between_steps;
+uint32_t ENGINE_ATTR MotorController::ramp_index(const ramp_t& ramp, double delay, uint32_t pos) {
+    // delays of the ramp are decreasing, so bisect it
+    if (ramp.at(pos) >= delay) return pos;
+    uint32_t low = 0, high = pos;
+    while (low + 1 < high) {
+        uint32_t mid = (low + high) / 2;
+        if (ramp.at(mid) >= delay) low = mid;
+        else high = mid;
+    }
+    return low;
 }
+void ENGINE_ATTR MotorController::look_ahead() {
+    _lookahead = _segments.pushed();
+    // absolute movements plan their exit speeds by themselves
+    if (_coordination.master == NULL || _goal_valid) return;
+    motor_data* master = _coordination.master;
+    const segment_t* next = _segments.peek();
+    if (next == NULL || next->epoch != _engine_epoch || next->join == 0) {
+        master->exit_pos = 0;
+        return;
+    }
 
-void MotorController::trigger() {
-	xSemaphoreTake(_motor_lock, portMAX_DELAY);
-	// All current commands are finished, so take the next from the queue
-    if (_ra.pulses_remaining == 0 && _dec.pulses_remaining == 0 && _commands.count() > 0) {
-		// TODO: never call turn_internal directly elsewhere. just use the queue
-		xSemaphoreGive(_motor_lock);
-        turn_internal(_commands.pop(), false);
-		xSemaphoreTake(_motor_lock, portMAX_DELAY);
+    // microsteps of the tail are left to the following segment which goes on in the same direction,
+    // the slave keeps all its pulses, the master stops before them if it cannot do that
+    motor_data* slave = master == &_dec ? &_ra : &_dec;
+    uint32_t pulses = master->pulses_remaining - master->micro_tail;
+    if (master->micro_tail > 0 && master->pulses_remaining > master->micro_tail && slave->pulses_remaining <= pulses) {
+        master->carry = master->micro_tail;
+        master->pulses_remaining = pulses;
+        master->micro_tail = 0;
+        _coordination.master_pulses = master->pulses_remaining;
+        _coordination.slave_pulses = slave->pulses_remaining;
+        _coordination.error = _coordination.master_pulses / 2;
     }
+    master->exit_pos = master->micro_tail == 0 ? next->join : 0;
+}
+
+uint64_t ENGINE_ATTR MotorController::trigger(uint64_t now) {
+
+    // nothing in here may block, producers talk to us only through the ring and the epoch
+#ifdef STEP_TRACE
+    _trace_now_us = now;
+#endif
+    next_segment(now);
+    if (_lookahead != _segments.pushed()) look_ahead();
+
+    // events armed at the current position fire before it is left
+    if (!_compare.commands.empty()) compare_commands(now);
+
     // DEC motor pulse should be done
-    _dec_balance += motor_trigger(_dec, STEP_PIN_DEC, DIR_PIN_DEC, DIRECTION_DEC, MS_PIN_DEC);
+    int dec = motor_trigger<dec_pins>(_dec, now);
 
     // RA motor pulse should be done
-    _ra_balance += motor_trigger(_ra, STEP_PIN_RA, DIR_PIN_RA, DIRECTION_RA, MS_PIN_RA);
+    int ra = motor_trigger<ra_pins>(_ra, now);
 
-    // these calls will take some time so we will probaly miss some next 
-    // interrupts but we do not really care because we are changing speed
-    // and this does not happen during tracking so everything should be ok
-    change_motor_speed(_dec, ACCEL_STEPS_DEC * 2, ACCEL_DELAY_DEC);
-    change_motor_speed(_ra, ACCEL_STEPS_RA * 2, ACCEL_DELAY_RA);
-	xSemaphoreGive(_motor_lock);
+    // slave motor follows pulses of its master
+    if (_coordination.master == &_dec && dec != 0 && _ra.pulses_remaining > 0 && coordinate()) ra = motor_pulse<ra_pins>(_ra);
+    else if (_coordination.master == &_ra && ra != 0 && _dec.pulses_remaining > 0 && coordinate()) dec = motor_pulse<dec_pins>(_dec);
+
+    _dec_balance += dec;
+    _ra_balance += ra;
+
+    // position events, the window of an axis is left only if it got to some
+    compare_check(0, _dec_balance, now);
+    compare_check(1, _ra_balance, now);
+
+    // periodic error correction follows RA, it has a job only if it is enabled
+    if (PEC_ENABLED) {
+        if (!_pec.commands.empty()) pec_commands(now);
+        if (ra != 0) pec_advance(ra);
+    }
+
+    // the following segment starts right after the last pulse of this one
+    next_segment(now);
+
+    // auxiliary axes cost nothing until they get a command
+    if (_aux_pending.load(std::memory_order_relaxed) != 0) _aux_active |= _aux_pending.exchange(0, std::memory_order_acquire);
+    uint32_t aux = _aux_active;
+    for (uint32_t axes = aux; axes != 0; axes &= axes - 1) {
+        uint8_t i = __builtin_ctz(axes);
+        if (!(this->*_aux_triggers[i])(now)) _aux_active &= ~(1UL << i);
+    }
+
+    publish(now, aux);
+
+    uint64_t next = 0;
+    if (_dec.pulses_remaining > 0 && !_dec.slaved) next = earliest(next, _dec.next_pulse_us == 0 ? now : _dec.next_pulse_us);
+    if (_ra.pulses_remaining > 0  && !_ra.slaved)  next = earliest(next, _ra.next_pulse_us == 0 ? now : _ra.next_pulse_us);
+    for (uint32_t axes = _aux_active; axes != 0; axes &= axes - 1) {
+        const motor_data& data = _aux[__builtin_ctz(axes)].motor;
+        if (data.pulses_remaining > 0) next = earliest(next, data.next_pulse_us == 0 ? now : data.next_pulse_us);
+    }
+    // the timer wakes us up when the held segment starts
+    return earliest(next, _held_us);
 }
 
-void MotorController::change_motor_speed(motor_data& data, unsigned int change_pulses, int amount) {
+template<uint8_t AXIS>
+bool ENGINE_ATTR MotorController::aux_trigger(uint64_t now) {
+    typedef typename aux_axis_config<AXIS>::pins pins;
+    aux_data& axis = _aux[AXIS];
+    aux_commands<pins>(axis);
+    axis.balance += motor_trigger<pins>(axis.motor, now);
+    compare_check(2 + AXIS, axis.balance, now);
+    // the following command starts right after the last pulse of this one
+    if (axis.motor.pulses_remaining == 0) aux_commands<pins>(axis);
+    return axis.motor.pulses_remaining > 0 || !axis.commands.empty();
+}
 
-    bool accel_desired = false;
-    bool decel_desired = false;
+template<class PINS>
+void ENGINE_ATTR MotorController::aux_commands(aux_data& axis) {
 
-    if (data.pulses_to_accel >= change_pulses) {
+    motor_data& data = axis.motor;
+    uint8_t epoch = axis.epoch.load(std::memory_order_acquire);
+    if (epoch != axis.engine_epoch) {
+        axis.engine_epoch = epoch;
+        // stops the same way as halt does with the mount
+        if (axis.emergency.exchange(false, std::memory_order_acquire)) data.pulses_remaining = 0;
+        else if (data.endless) data.target_speed = 0;
+        else {
+            data.pulses_remaining = cut_pulses(data, min(full_remaining(data), data.ramp_pos));
+            data.micro_head = 0;
+            data.micro_tail = 0;
+        }
+    }
+
+    const aux_command_t* command;
+    while ((command = axis.commands.peek()) != NULL) {
+        // commands pushed before the last stop are dropped
+        if (command->epoch == epoch) {
+            bool standing = data.pulses_remaining == 0;
+            if (command->velocity && (standing || data.endless)) apply_velocity<PINS>(data, command->period, command->reverse);
+            else if (!command->velocity && standing) step_accelerated<PINS>(data, command->pulses, command->reverse, &axis.ramp);
+            else {
+                if (data.endless) data.target_speed = 0;
+                return;
+            }
+        }
+        aux_command_t done;
+        axis.commands.pop(done);
+    }
+}
 
-        // are we at the middle of the motor movement?
-        if (data.pulses_remaining > data.steps_total) {
-            accel_desired = (data.current_steps_delay > data.target_steps_delay);
+void ENGINE_ATTR MotorController::pec_commands(uint64_t now) {
+    const pec_command_t* command;
+    while ((command = _pec.commands.peek()) != NULL) {
+        // no switch, its jump table would be read from the flash
+        if (command->op == PEC_ORIGIN) {
+            _pec.position = 0;
+            _pec.segment = 0;
+            _pec.record = PEC_TABLES;
+        }
+        else if (command->op == PEC_PLAY) {
+            // a new table replaces the recorded one
+            if (command->table != PEC_TABLES) {
+                _pec.table = command->table;
+                _pec.record = PEC_TABLES;
+            }
+            _pec.playing = _pec.table != PEC_TABLES;
         }
-        else if ((data.start_steps_delay - data.current_steps_delay) / amount >= data.pulses_remaining / change_pulses) {
-            decel_desired = (data.current_steps_delay < data.start_steps_delay);
+        else if (command->op == PEC_STOP) {
+            _pec.playing = false;
         }
- 
-        if (accel_desired || decel_desired) {
-            int new_steps_delay = data.current_steps_delay - (accel_desired ? 1 : -1) * amount;
-            step_micros(&data, data.pulses_remaining,  new_steps_delay, data.reverse); 
-            // this procedure take some time (like 100 us) so we may compensate missed intrrupts somehow
+        else if (command->op == PEC_RECORD) {
+            _pec.record = command->table;
+            _pec.recorded = -1;
         }
+        else if (command->op == PEC_GUIDE) {
+            _pec.guide = command->rate;
+            _pec.guide_end_us = now + command->duration;
+        }
+        pec_correct();
+        // producers look for a free table once commands are taken
+        pec_publish();
+        pec_command_t done;
+        _pec.commands.pop(done);
+    }
+}
 
-        data.pulses_to_accel = 0;
+void ENGINE_ATTR MotorController::compare_commands(uint64_t now) {
+    uint32_t axes = 0;
+    const compare_command_t* command;
+    while ((command = _compare.commands.peek()) != NULL) {
+        compare_slot_t& slot = _compare.slots[command->slot];
+        // an armed slot keeps its axis until it is armed again
+        if (slot.armed) axes |= 1UL << slot.axis;
+        if (command->op == COMPARE_ARM) {
+            slot = {true, command->axis, command->generation, command->position, command->interval};
+            axes |= 1UL << slot.axis;
+        }
+        else slot.armed = false;
+        compare_command_t done;
+        _compare.commands.pop(done);
+    }
+    for (; axes != 0; axes &= axes - 1) {
+        uint8_t axis = __builtin_ctz(axes);
+        compare_window(axis, compare_balance(axis), now);
     }
 }
 
-int MotorController::motor_trigger(motor_data& data, byte step_pin, byte dir_pin, bool dir_swap, byte ms) {
+void ENGINE_ATTR MotorController::compare_hit(uint8_t axis, long balance, uint64_t now) {
+    // a pulse moves the balance by a microstep or a full step, so events between the edge of the window
+    // which was crossed and the balance fire, repeated ones possibly more times
+    const compare_window_t& window = _compare.windows[axis];
+    uint32_t over = (uint32_t)balance - ((uint32_t)window.base + window.span);
+    uint32_t under = (uint32_t)window.base - 1 - (uint32_t)balance;
+    // the nearer edge was crossed
+    bool up = over <= under;
+    uint32_t edge = up ? (uint32_t)window.base + window.span : (uint32_t)window.base - 1;
+    uint32_t range = up ? over : under;
+    for (uint8_t i = 0; i < COMPARE_EVENTS; ++i) {
+        compare_slot_t& slot = _compare.slots[i];
+        while (slot.armed && slot.axis == axis && (up ? (uint32_t)slot.position - edge : edge - (uint32_t)slot.position) <= range) {
+            compare_fire(i, now);
+        }
+    }
+    compare_window(axis, balance, now);
+}
 
-    if (data.pulses_remaining == 0) return 0;
-	data.inactive_us += TMR_RESOLUTION;
-	if(data.inactive_us < data.current_steps_delay) return 0;
+void ENGINE_ATTR MotorController::compare_window(uint8_t axis, long balance, uint64_t now) {
+    uint32_t below = 0x7FFFFFFF, above = 0x7FFFFFFF;
+    for (uint8_t i = 0; i < COMPARE_EVENTS; ++i) {
+        compare_slot_t& slot = _compare.slots[i];
+        if (!slot.armed || slot.axis != axis) continue;
+        // slots armed right at the balance fire at once
+        while (slot.armed && slot.position == balance) compare_fire(i, now);
+        if (!slot.armed) continue;
+        int32_t distance = (int32_t)((uint32_t)slot.position - (uint32_t)balance);
+        if (distance > 0) above = min(above, (uint32_t)distance);
+        else below = min(below, (uint32_t)-distance);
+    }
+    compare_window_t& window = _compare.windows[axis];
+    window.base = (int32_t)((uint32_t)balance - below + 1);
+    window.span = below + above - 1;
+}
 
-    ++data.pulses_to_accel;
-    --data.pulses_remaining;
+void ENGINE_ATTR MotorController::compare_fire(uint8_t slot, uint64_t now) {
+    compare_slot_t& data = _compare.slots[slot];
+    compare_event_t event = {slot, data.axis, data.generation, data.position, now};
+    if (!_compare.events.push(event)) ++_stats.lost_events;
+    else {
+        TaskHandle_t dispatcher = _compare.dispatcher.load(std::memory_order_acquire);
+        if (dispatcher != NULL) xTaskNotifyGive(dispatcher);
+    }
+    if (data.interval != 0) data.position += data.interval;
+    else data.armed = false;
+}
 
-	data.inactive_us = 0;
-#ifdef BOARD_ATMEGA
-    MOTORS_PORT ^= (1 << step_pin);
-    return (MOTORS_PORT & (1 << ms) ? 1 : MICROSTEPPING_MUL) * (((MOTORS_PORT >> dir_pin) & 1) != dir_swap ? -1 : 1);
-#else
-	// TODO: use proper xor
-	digitalWrite(dir_pin, data.reverse);
-	digitalWrite(step_pin, !digitalRead(step_pin));
-	int8_t retval =  (digitalRead(ms) ? 1 : MICROSTEPPING_MUL) * (data.reverse ? -1 : 1);
-	return retval;
-#endif
+void ENGINE_ATTR MotorController::pec_advance(int ra) {
+    _pec.sum += _pec.correction;
+    ++_pec.count;
+
+    int32_t position = (int32_t)_pec.position + ra;
+    if (position < 0) position += _profile->pec_worm_pulses;
+    else if (position >= (int32_t)_profile->pec_worm_pulses) position -= _profile->pec_worm_pulses;
+    _pec.position = position;
+
+    uint16_t segment = min((uint32_t)(((uint64_t)_pec.position * _profile->pec_scale) >> 32), (uint32_t)PEC_SEGMENTS - 1);
+    if (segment == _pec.segment) return;
+
+    if (_pec.record != PEC_TABLES) {
+        // just whole segments of tracking are recorded, the first one begins now
+        if (!_ra.endless || segment != (_pec.segment + 1) % PEC_SEGMENTS) _pec.record = PEC_TABLES;
+        else if (_pec.recorded >= 0) {
+            int64_t average = _pec.sum / (int64_t)_pec.count;
+            _pec.tables[_pec.record][_pec.segment] = constrain(average, (int64_t)-PEC_LIMIT, (int64_t)PEC_LIMIT);
+            if (++_pec.recorded == PEC_SEGMENTS) {
+                _pec.table = _pec.record;
+                _pec.record = PEC_TABLES;
+                _pec.playing = true;
+            }
+        }
+        else _pec.recorded = 0;
+        if (_pec.record == PEC_TABLES) pec_publish();
+    }
+    _pec.sum = 0;
+    _pec.count = 0;
+    _pec.segment = segment;
+    pec_correct();
+}
+
+void ENGINE_ATTR MotorController::pec_correct() {
+    int32_t correction = _pec.guide;
+    if (_pec.playing) correction += _pec.tables[_pec.table][_pec.segment];
+    _pec.correction = constrain(correction, -PEC_UNIT * 3 / 4, PEC_UNIT * 3 / 4);
+}
+
+uint64_t ENGINE_ATTR MotorController::pec_period(uint64_t period, uint64_t now) {
+    if (_pec.guide != 0 && now >= _pec.guide_end_us) {
+        _pec.guide = 0;
+        pec_correct();
+    }
+    if (_pec.correction == 0) return period;
+
+    // the speed is multiplied by 1 + correction, the period is split so the slowest speeds do not overflow
+    uint32_t divisor = PEC_UNIT + _pec.correction;
+    return ((period / divisor) << 16) + (((period % divisor) << 16) / divisor);
+}
+
+void ENGINE_ATTR MotorController::publish(uint64_t now, uint32_t aux) {
+    uint32_t seq = _position_seq.load(std::memory_order_relaxed);
+    _position_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _position.dec = _dec_balance;
+    _position.ra = _ra_balance;
+    // balances of idle auxiliary axes do not change
+    for (uint32_t axes = aux; axes != 0; axes &= axes - 1) _position.aux[__builtin_ctz(axes)] = _aux[__builtin_ctz(axes)].balance;
+    _position.aux_active = _aux_active;
+    _position.moving = _dec.pulses_remaining > 0 || _ra.pulses_remaining > 0;
+    _position.segments = _segments.popped();
+    _position.pec_segment = _pec.segment;
+    _position.time_us = now;
+    _position_seq.store(seq + 2, std::memory_order_release);
+}
+
+void MotorController::get_position(position_t& position) const {
+    uint32_t seq_begin, seq_end;
+    do {
+        seq_begin = _position_seq.load(std::memory_order_acquire);
+        position = _position;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        seq_end = _position_seq.load(std::memory_order_relaxed);
+    } while ((seq_begin & 1) || seq_begin != seq_end);
+}
+
+void ENGINE_ATTR MotorController::change_motor_speed(motor_data& data) {
+
+    if (data.ramp == NULL) return;
+
+    // microsteps before and after full steps have the starting speed of the ramp
+    if (data.microstepping) {
+        uint64_t period = micro_period(*data.ramp);
+        data.current_steps_delay = period >> 32;
+        data.delay_fraction = (uint32_t)period;
+        return;
+    }
+
+    // stopping from the current speed takes exactly 'ramp_pos' pulses, slowing down 
+    // to the speed of the junction with the next segment takes fewer of them
+    if (full_remaining(data) + data.exit_pos <= data.ramp_pos) {
+        if (data.ramp_pos > 0) --data.ramp_pos;
+    }
+    else if (data.ramp_pos < data.ramp_top) ++data.ramp_pos;
+
+    data.current_steps_delay = data.ramp->at(data.ramp_pos);
+    data.delay_fraction = 0;
+}
+
+template<class PINS>
+void ENGINE_ATTR MotorController::apply_velocity(motor_data& data, uint64_t period, bool reverse) {
+
+    data.target_period = period;
+    data.target_speed = period == UINT64_MAX ? 0 : 1000000.0f * 4294967296.0f / period;
+    if (reverse) data.target_speed = -data.target_speed;
+    if (data.pulses_remaining > 0 && data.endless) return;
+
+    // the motor stands, so it can start with any speed up to the jump one
+    data.pulses_remaining = 0;
+    data.ramp = NULL;
+    data.slaved = false;
+    data.endless = true;
+    data.micro_head = 0;
+    data.micro_tail = 0;
+    data.speed = 0;
+    data.phase = 0;
+    data.next_pulse_us = 0;
+    change_motor_velocity<PINS>(data);
+}
+
+template<class PINS>
+void ENGINE_ATTR MotorController::change_motor_velocity(motor_data& data) {
+
+    float speed = fabsf(data.speed);
+    float target = fabsf(data.target_speed);
+    bool reverse = data.reverse;
+
+    // standing motor takes the direction before its speed, even the one up to the jump speed
+    if (speed == 0) reverse = data.target_speed < 0;
+
+    // the motor must stop before it turns back
+    if (speed > 0 && target > 0 && (data.target_speed < 0) != reverse) target = 0;
+    if (fabsf(target - speed) <= data.jump) speed = target;
+    else {
+        // a single pulse takes |increment| / speed seconds, the speed above the jump one
+        float dv = data.accel * abs(data.increment) / max(speed, data.jump);
+        speed = target > speed ? min(speed + dv, target) : max(speed - dv, target);
+    }
 
+    // the step is completed before the motor stops or turns back, so the driver is where the balance says
+    if (speed == 0 && data.step_state) speed = min(fabsf(data.speed), data.jump);
+
+    // standing motor can start in any direction at once
+    if (speed == 0) {
+        reverse = data.target_speed < 0;
+        speed = min(fabsf(data.target_speed), data.jump);
+    }
+
+    if (speed == 0) {
+        data.speed = 0;
+        data.pulses_remaining = 0;
+        return;
+    }
+
+    // microstepping is used if the commanded speed is up to the jump one, switches are done only at
+    // full step positions, to microsteps only below the jump speed, so pulses do not get too dense
+    bool microstepping = data.microstepping;
+    bool wanted = fabsf(data.target_speed) <= data.jump || MICROSTEPPING_MUL == 1;
+    if (data.step_phase == 0 && (speed <= data.jump || !wanted)) microstepping = wanted;
+    if (microstepping != data.microstepping || reverse != data.reverse || data.increment == 0) {
+        data.reverse = reverse;
+        PINS::dir::write(reverse != PINS::dir_swap);
+        set_microstepping<PINS>(data, microstepping);
+    }
+
+    data.speed = reverse ? -speed : speed;
+    data.pulses_remaining = UINT32_MAX;
+
+    // the commanded speed has the exact fixed point period, so long runs do not drift
+    uint64_t period;
+    if (speed == fabsf(data.target_speed)) {
+        period = data.target_period * (microstepping ? 1 : MICROSTEPPING_MUL);
+        // tracking of RA is corrected at the time of the pulse which was just done
+        if (PEC_ENABLED && data.axis == 1) period = pec_period(period, data.next_pulse_us);
+    }
+    else period = (uint64_t)(1000000.0f * abs(data.increment) / speed * 4294967296.0f);
+    if ((period >> 32) < MIN_PULSE_DELAY) period = (uint64_t)MIN_PULSE_DELAY << 32;
+    data.current_steps_delay = period >> 32;
+    data.delay_fraction = (uint32_t)period;
+}
+
+template<class PINS>
+int ENGINE_ATTR MotorController::motor_trigger(motor_data& data, uint64_t now) {
+
+    if (data.pulses_remaining == 0 || data.slaved) return 0;
+    if (data.next_pulse_us == 0) data.next_pulse_us = now;
+	if (data.next_pulse_us > now + MIN_ALARM_LEAD) return 0;
+
+    int increment = motor_pulse<PINS>(data);
+    if (data.endless) change_motor_velocity<PINS>(data);
+    else change_motor_speed(data);
+
+    // the next pulse is scheduled relatively to this one, so delays of late pulses do not
+    // accumulate, but we never try to catch up more than one pulse to keep the motor in sync
+    if (data.next_pulse_us + data.current_steps_delay < now) {
+        data.next_pulse_us = now;
+        ++_stats.missed_pulses;
+    }
+    uint32_t phase = data.phase + data.delay_fraction;
+    data.next_pulse_us += data.current_steps_delay + (phase < data.phase);
+    data.phase = phase;
+
+    return increment;
+}
+
+template<class PINS>
+int ENGINE_ATTR MotorController::motor_pulse(motor_data& data) {
+    data.step_state = !data.step_state;
+    PINS::step::write(data.step_state);
+    trace(data.trace_flags | (data.step_state ? STEP_EVENT_LEVEL : 0), data.axis);
+    --data.pulses_remaining;
+    data.step_phase = (data.step_phase + data.increment) & (2 * MICROSTEPPING_MUL - 1);
+    int increment = data.increment;
+
+    // full steps of accelerated movements are done between microsteps of the head and of the tail
+    if (data.micro_head > 0) {
+        if (--data.micro_head == 0) set_microstepping<PINS>(data, false);
+    }
+    else if (data.micro_tail > 0 && data.pulses_remaining == data.micro_tail && !data.microstepping) set_microstepping<PINS>(data, true);
+    return increment;
 }
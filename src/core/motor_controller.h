@@ -2,11 +2,54 @@
 #define MOTORCONTROLLER_H
 
 #include "../config.h"
-#include "./queue.h"
+#include "./spsc_ring.h"
+#include "./fast_pin.h"
+#include "./step_trace.h"
+#include "./histogram.h"
+#include "./motion_config.h"
 #include "stdint.h"
 
+#define RAMP_HEAD (RAMP_TABLE_SIZE / 4)
+
+// the tick path and its tables run from internal RAM, so misses of the flash cache (SPI flash, SD card, ...)
+// do not stall the step engine, helpers of the path are always inlined into it, see iram_report.py
+#ifdef BOARD_ATMEGA
+#define ENGINE_ATTR
+#define ENGINE_DATA
+#else
+#define ENGINE_ATTR IRAM_ATTR
+#define ENGINE_DATA DRAM_ATTR
+#endif
+#define ENGINE_INLINE inline __attribute__((always_inline))
+
 #define TIMER_TOP (F_CPU / (1000000.0 / TMR_RESOLUTION))
 
+// corrections of PEC are in 1/PEC_UNIT of the speed
+#define PEC_ENABLED     (PEC_WORM_REVS_RA != 0)
+#define PEC_UNIT        65536
+#define PEC_LIMIT       ((int32_t)(PEC_MAX_CORRECTION * PEC_UNIT))
+
+// compile time configuration of an auxiliary motor driven by the step engine, see config.h
+template<uint8_t STEP, uint8_t DIR, uint8_t MS, bool DIR_SWAP, uint32_t STEPS_PER_REV, 
+         int ACCEL_STEPS, int ACCEL_DELAY, int DELAY_START, int DELAY_END>
+struct axis_config {
+    typedef driver_pins<STEP, DIR, MS, DIR_SWAP> pins;
+    static const uint32_t steps_per_rev = STEPS_PER_REV;  // 0 if the axis is not wired
+    static const int accel_steps = ACCEL_STEPS;
+    static const int accel_delay = ACCEL_DELAY;
+    static const int delay_start = DELAY_START;
+    static const int delay_end = DELAY_END;
+};
+
+// auxiliary axes run independently of the mount and of each other, AUX_AXES is their count
+enum aux_axis_t : uint8_t { AXIS_FOCUS, AXIS_ROTATOR, AUX_AXES };
+
+template<uint8_t AXIS> struct aux_axis_config;
+template<> struct aux_axis_config<AXIS_FOCUS> : axis_config<STEP_PIN_FOCUS, DIR_PIN_FOCUS, MS_PIN_FOCUS, DIRECTION_FOCUS, STEPS_PER_REV_FOCUS, 
+    ACCEL_STEPS_FOCUS, ACCEL_DELAY_FOCUS, FAST_DELAY_START_FOCUS, FAST_DELAY_END_FOCUS> {};
+template<> struct aux_axis_config<AXIS_ROTATOR> : axis_config<STEP_PIN_ROTATOR, DIR_PIN_ROTATOR, MS_PIN_ROTATOR, DIRECTION_ROTATOR, STEPS_PER_REV_ROTATOR, 
+    ACCEL_STEPS_ROTATOR, ACCEL_DELAY_ROTATOR, FAST_DELAY_START_ROTATOR, FAST_DELAY_END_ROTATOR> {};
+
 class MountController;
 class MotorController {
     
@@ -23,109 +66,772 @@ class MotorController {
         // set PINs and default values
         void initialize();
 
+        // consistent state of motors published by the step engine after every wake up
+        struct position_t {
+            long dec;  // DEC balance (pulses)
+            long ra;  // RA balance (pulses)
+            long aux[AUX_AXES];  // balances of auxiliary axes (pulses)
+            uint32_t aux_active;  // bits of auxiliary axes which have a job
+            bool moving;  // some motor has a job to do
+            uint32_t segments;  // number of segments taken from the ring so far
+            uint16_t pec_segment;  // correction of the PEC table at the RA position
+            uint64_t time_us;  // time of the step timer when the state was published
+        };
+
+        // copies the last published state, never blocks the step engine, just retries 
+        // if the engine is publishing at the same moment
+        void get_position(position_t& position) const;
+
         // returns true if motors have absolutely no job
         inline bool is_ready() { 
-			xSemaphoreTake(_motor_lock, portMAX_DELAY);
-			uint8_t retval = _dec.pulses_remaining == 0 && _ra.pulses_remaining == 0 && _commands.count() == 0; 
-			xSemaphoreGive(_motor_lock);
-			return retval;
+            position_t position;
+            get_position(position);
+            // segments pushed but not yet taken by the engine are a job as well
+			return !position.moving && position.segments == _segments.pushed();
 		}
 
+        // returns true if some pushed command was not taken by the engine yet, e.g. a timed one
+        inline bool is_queued() {
+            position_t position;
+            get_position(position);
+            return position.segments != _segments.pushed();
+        }
 
-        // interrupts all motor movements and clear command queue
+        // clears the command queue and stops motors as fast as their ramps allow, so no steps are lost
         void stop();
 
-        // estimates time (millis) of the complete fast_turn duration
+        // clears the command queue and stops motors at once, steps may be lost at high speeds
+        void emergency_stop();
+
+        // exact time (millis) of the complete fast_turn duration from its first pulse to the last one
+        // if motors start at full step positions
         double estimate_fast_turn_time(double revs_dec, double revs_ra);
         
-        // make a fast turn with subsequent slow turn for compensate the coarse resolution of full step
+        // make a fast turn along ramps, it starts and ends with microsteps, so the resolution is not lost
         void fast_turn(double revs_dec, double revs_ra, boolean queueing);
 
         // make a turn with given motor revolutions per second and with microstepping enabled (implies low speed)
         void slow_turn(double revs_dec, double revs_ra, double speed_dec, double speed_ra, boolean queueing);
 
-        // interrupt service rutine
-        void trigger();
+        // fast movement to the absolute position given by revolutions relative to the starting position, 
+        // a running absolute movement is replanned to the new position without stopping if possible
+        void move_to(double revs_dec, double revs_ra, boolean queueing, uint64_t start_us = 0);
+
+        // runs motors with signed speeds (motor revolutions per second) until another command, speeds change
+        // with accelerations of ramps, the velocity mode goes on without stopping if speeds are changed again
+        void set_velocity(double speed_dec, double speed_ra, boolean queueing, uint64_t start_us = 0);
+
+        // commands with 'start_us' are held by the step engine until that time of the step timer (see time_us), 
+        // queued commands wait for them, the engine keeps doing what it did meanwhile, a command which is 
+        // due while the previous movement still runs starts right after it
+
+        // current time (µs) of the step timer
+        uint64_t time_us() const;
+
+        // sets up the step timer for the calling task, which runs 'run' then
+        void start();
+
+        // body of the motor task, owns the step timer and never returns, nothing called by it may live
+        // in flash (see iram_report.py)
+        void run();
+
+        // body of the power task, sets the CPU frequency by the demand of the step engine (see CPU_FREQ_*)
+        // and never returns, it has a lower priority, so the motor task never waits for the switch
+        void power_run();
+
+        // a wake up of the power task at 'now_ms', returns the time (ms) after which it wants to be woken up
+        // again, 0 if just by a change of the demand, the simulator calls it in place of the task
+        uint32_t set_power(uint32_t now_ms);
+
+        // what the motor task does after every sleep, counts the time of the power state which ends at 'now' (µs)
+        // and publishes the demand of the 'next' pulse, returns true if it changed and the power task was woken up,
+        // the simulator calls it after every trigger
+        bool account_power(uint64_t next, uint64_t now);
+
+        // performs all pulses which are due at 'now' (µs), returns the time of the
+        // next pulse or 0 if there is nothing to do
+        uint64_t trigger(uint64_t now);
+
+        // demand of the step engine on the CPU, see CPU_FREQ_*
+        enum power_state_t : uint8_t { POWER_IDLE, POWER_TRACKING, POWER_SLEWING, POWER_STATES };
+
+        // time and work of the motor task in a power state
+        struct power_t {
+            uint64_t time_us;  // time spent in the state
+            uint64_t busy_us;  // time of the motor task being awake
+            uint64_t mhz_us;  // CPU frequency (MHz) integrated over the time, the average is mhz_us / time_us
+            uint32_t wakeups;
+        };
+
+        // timing of the step engine, always recorded by the motor task
+        struct stats_t {
+            log2_histogram latency;  // delay (µs) between the alarm time and the wake up of the motor task
+            log2_histogram execution;  // duration (CPU cycles) of a single trigger call
+            uint32_t wakeups;  // number of wake ups of the motor task
+            uint32_t late_alarms;  // alarms set too late to fire, their pulses were done right away
+            uint32_t missed_pulses;  // pulses late by more than a whole delay, schedule restarted from them
+            uint32_t cache_stalls;  // alarms which came while the flash cache was disabled, the motor task waited for it
+            uint32_t stalled_missed_pulses;  // missed pulses of wake ups after those alarms
+            log2_histogram stall_latency;  // latency (µs) of wake ups after those alarms
+            power_t power[POWER_STATES];
+            uint32_t frequency_switches;  // changes of the CPU frequency
+            uint32_t lost_events;  // position events which did not fit into the queue
+        };
+
+        // counters are updated in place, so this is not a consistent snapshot
+        inline const stats_t& get_stats() const { return _stats; }
+
+        // asks the motor task to clear statistics at its next wake up
+        inline void reset_stats() { _stats_reset.store(true, std::memory_order_release); }
+
+#ifdef STEP_TRACE
+        // timeline of edges and segments recorded by the step engine
+        inline const step_trace<STEP_TRACE>& get_trace() const { return _trace; }
+#endif
 
         // returns the number of revolutions relative to the starting position
         void get_made_revolutions(double& dec, double& ra) {
-			xSemaphoreTake(_motor_lock, portMAX_DELAY);
-                //log_d("Revolutions");
-                //log_d(" DEC: %d", _dec_balance); 
-                //log_d("  RA: %d", _ra_balance); 
-            dec = (double) _dec_balance / 2.0 / STEPS_PER_REV_DEC / MICROSTEPPING_MUL;
-            ra = (double) _ra_balance / 2.0 / STEPS_PER_REV_RA / MICROSTEPPING_MUL;
-			xSemaphoreGive(_motor_lock);
+            motion_config_t motion = get_motion();
+            position_t position;
+            get_position(position);
+            dec = (double) position.dec / 2.0 / motion.dec.steps_per_rev / MICROSTEPPING_MUL;
+            ra = (double) position.ra / 2.0 / motion.ra.steps_per_rev / MICROSTEPPING_MUL;
+        }
+
+        // auxiliary axes (see aux_axis_t) share the step engine with the mount, but they are not stopped
+        // by stop(), just by emergency_stop(), commands of axes which are not wired are ignored
+
+        // relative fast movement of the axis along its ramp, it starts once the previous movement is done
+        void aux_move(uint8_t axis, double revs);
+
+        // runs the axis with the signed speed (revolutions per second) until another command
+        void aux_velocity(uint8_t axis, double speed);
+
+        // drops waiting commands of the axis and stops it along its ramp or at once if 'emergency'
+        void aux_stop(uint8_t axis, bool emergency);
+
+        // returns true if the axis moves or has a command to do
+        bool aux_busy(uint8_t axis);
+
+        // returns the number of revolutions of the axis relative to its starting position
+        double aux_revolutions(uint8_t axis);
+
+        // speed (revolutions per second) at the top of the ramp of the axis, 0 if it is not wired
+        double aux_max_speed(uint8_t axis);
+
+        // periodic error correction (PEC) modulates the RA speed of the velocity mode by a table of PEC_SEGMENTS
+        // corrections per worm revolution indexed by the RA position, the table starts at its origin and 
+        // corrections are signed parts of the speed in 1/PEC_UNIT, all of this is ignored if PEC is disabled
+
+        // the current RA position becomes the origin of the table, a running recording is cancelled
+        void pec_set_origin();
+
+        // plays the table of PEC_SEGMENTS corrections from now on, a running recording is cancelled
+        void pec_upload(const int16_t* corrections);
+
+        // plays the last table or stops playing it
+        void pec_play(bool enable);
+
+        // records the table during the next whole worm revolution of tracking, it records corrections
+        // which were played and those of guide_ra, the table is played once it is recorded, other 
+        // movements of RA cancel the recording
+        void pec_record();
+
+        // changes the RA speed of the velocity mode by 'rate' (signed part of it) for 'ms' milliseconds
+        void guide_ra(double rate, uint32_t ms);
+
+        struct pec_status_t {
+            bool playing;
+            bool recording;
+            uint16_t segment;  // correction at the RA position
+        };
+
+        // copies the state of PEC and the last played table if 'corrections' is not NULL
+        void get_pec(pec_status_t& status, int16_t* corrections);
+
+        // snapshot of the motion configuration of the mount, the stored one or defaults since initialize
+        inline motion_config_t get_motion() const {
+	        xSemaphoreTake(_motor_lock, portMAX_DELAY);
+            motion_config_t motion = _motion;
+	        xSemaphoreGive(_motor_lock);
+            return motion;
         }
 
+        // builds ramps of 'config' outside of the step engine, which takes them once motors stand before the next
+        // move, steps per revolution apply to following commands at once, so the mount should be synced again,
+        // returns false if 'config' is not valid
+        bool set_motion(const motion_config_t& config);
+
+        // position-compare events, an armed event fires once the balance of its axis (see position_t) gets to its
+        // position or over it, the engine just queues it and the task which calls dispatch_events performs its action
+        struct compare_event_t {
+            uint8_t slot;
+            uint8_t axis;  // 0 for DEC, 1 for RA, auxiliary axes follow
+            uint8_t generation;  // events of slots which were armed again meanwhile are dropped
+            long position;  // where it was armed (pulses), the balance may be a full step over it
+            uint64_t time_us;  // time of the pulse which got there, see time_us()
+        };
+
+        typedef void (*compare_callback_t)(const compare_event_t& event, void* arg);
+
+        // arms the event 'slot' (0 .. COMPARE_EVENTS-1) at 'position' (pulses) of 'axis', it is armed again 'interval' 
+        // pulses further once it fires unless 'interval' is 0, 'callback' gets 'arg', the previous event of the slot is replaced
+        void compare_callback(uint8_t slot, uint8_t axis, long position, long interval, compare_callback_t callback, void* arg);
+
+        // the same, but the event sets 'pin' to 'level'
+        void compare_pin(uint8_t slot, uint8_t axis, long position, long interval, uint8_t pin, bool level);
+
+        void compare_disarm(uint8_t slot);
+
+        // waits up to 'ticks' for fired events and performs their actions, returns the number of them,
+        // it is called by the events task, the engine wakes it up
+        uint32_t dispatch_events(TickType_t ticks);
+
     private:
         MotorController() {}
 
+        // precomputed acceleration ramp of a single motor, the first RAMP_HEAD pulses have their own delays
+        // because the speed changes rapidly there, the rest is split into segments of (1 << shift) pulses
+        struct ramp_t {
+             uint32_t delay[RAMP_TABLE_SIZE];  // delays (µs) between pulses of every ramp segment
+             uint32_t time[RAMP_TABLE_SIZE];  // sum of delays (µs) of all pulses before the segment
+             uint16_t length = 0;  // number of used segments
+             uint8_t shift = 0;  // every segment after the head is (1 << shift) pulses long
+             float accel = 0;  // acceleration (pulses / s^2) along the ramp
+             float jump = 0;  // starting speed (pulses / s), lower speeds can be changed at once
+
+             // segment of the pulse 'pos' of the ramp
+             ENGINE_INLINE uint16_t index(uint32_t pos) const { 
+                 return pos < RAMP_HEAD ? pos : RAMP_HEAD + ((pos - RAMP_HEAD) >> shift); 
+             }
+             // delay after pulse 'pos' of the ramp
+             ENGINE_INLINE uint32_t at(uint32_t pos) const { return delay[index(pos)]; }
+             // sum of delays (µs) of pulses 0 .. pos-1 of the ramp
+             ENGINE_INLINE uint64_t sum(uint32_t pos) const { 
+                 uint16_t i = index(pos);
+                 return time[i] + (uint64_t)(pos - start(i)) * delay[i];
+             }
+             // number of pulses before the segment 'i'
+             ENGINE_INLINE uint32_t start(uint16_t i) const { 
+                 return i < RAMP_HEAD ? i : RAMP_HEAD + ((uint32_t)(i - RAMP_HEAD) << shift); 
+             }
+             // total number of pulses of the ramp
+             inline uint32_t pulses() const { return start(length); }
+        };
+
+        static_assert((MICROSTEPPING_MUL & (MICROSTEPPING_MUL - 1)) == 0, "microstepping must be a power of two");
+
         // structure holding state of motors and movement while executing a command
         struct motor_data {
-             uint32_t steps_total = 0;  // steps to be done during this particular movement
              uint32_t pulses_remaining = 0;  // pulses to be done until the end of this movement
 			 bool reverse = 0;
-             uint32_t pulses_to_accel = 0;  // number of pulses after which is done an ac/deceleration
-             uint32_t start_steps_delay = 0;  // delay between steps at the start of fast movement
-             uint32_t target_steps_delay = 0;  // minimal delay between steps during fast movement
-             uint32_t current_steps_delay = 0;  // current delay between steps
-			 uint32_t ticks_passed = 0;
-			 uint32_t inactive_us = 0;
+             const ramp_t* ramp = NULL;  // acceleration ramp, NULL for movement with constant speed
+             uint32_t ramp_pos = 0;  // pulses done on the ramp, i.e. the current speed
+             uint32_t ramp_top = 0;  // last pulse of the ramp (maximal speed)
+             uint32_t exit_pos = 0;  // ramp position to leave the movement with, the next segment continues from it
+             uint32_t current_steps_delay = 0;  // current delay between pulses (whole µs)
+             uint32_t delay_fraction = 0;  // fraction of the delay in 1/2^32 µs, i.e. 32.32 fixed point
+             uint32_t phase = 0;  // accumulated fractions of delays, every overflow postpones a pulse by 1 µs
+             uint64_t next_pulse_us = 0;  // time of the next pulse, 0 means as soon as possible
+             int8_t increment = 0;  // change of the balance per pulse (microsteps and direction)
+             bool step_state = 0;  // level of the step pin, never read back from the pin
+             bool slaved = 0;  // pulses are driven by the master motor, see coordination_t
+             uint8_t trace_flags = 0;  // STEP_EVENT_* bits of edges of this movement
+             uint8_t axis = 0;  // 0 for DEC, 1 for RA, auxiliary axes follow
+
+             // accelerated movements switch microstepping only at full step positions, i.e. if 'step_phase'
+             // is 0, they start with microsteps up to such a position and end with microsteps of the rest
+             uint32_t step_phase = 0;  // balance modulo 2 * MICROSTEPPING_MUL
+             uint32_t micro_head = 0;  // microsteps before full steps
+             uint32_t micro_tail = 0;  // microsteps after full steps, they are included in 'pulses_remaining'
+             uint32_t carry = 0;  // microsteps of the tail left to the blended segment which follows, see look_ahead
+
+             // velocity mode, speeds are signed and in microsteps (changes of the balance) per second
+             bool endless = 0;  // runs with 'target_speed' until another command
+             bool microstepping = 0;
+             float speed = 0;  // current speed
+             float target_speed = 0;  // commanded speed
+             uint64_t target_period = 0;  // 32.32 fixed point delay (µs) between microsteps of the commanded speed
+             float accel = 0;  // acceleration limit of the motor (microsteps / s^2)
+             float jump = 0;  // speeds up to this are changed at once (microsteps / s)
+        };
+
+        // Bresenham coordination of accelerated movements, the motor with fewer pulses is slaved
+        // to the other one, its pulses are done together with pulses of the master, so both motors
+        // follow a straight line in motor coordinates and finish at the same time
+        struct coordination_t {
+            motor_data* master = NULL;  // NULL if motors move independently (slow movements)
+            uint32_t master_pulses = 0;
+            uint32_t slave_pulses = 0;
+            uint32_t error = 0;  // accumulated error, the slave pulses on its overflow
+        };
+
+        // steps and ramps of the mount are not compile time ones, see motion_profile_t
+        typedef driver_pins<STEP_PIN_DEC, DIR_PIN_DEC, MS_PIN_DEC, DIRECTION_DEC> dec_pins;
+        typedef driver_pins<STEP_PIN_RA,  DIR_PIN_RA,  MS_PIN_RA,  DIRECTION_RA>  ra_pins;
+
+        // movement planned by the mount side, the step engine just copies it into motor_data
+        struct segment_t {
+            uint32_t pulses_dec;  // pulses to be done (microsteps if accelerated) - DEC
+            uint32_t pulses_ra;  // pulses to be done (microsteps if accelerated) - RA
+            uint64_t period_dec;  // 32.32 fixed point delay (µs) between pulses of slow movement - DEC
+            uint64_t period_ra;  // 32.32 fixed point delay (µs) between pulses of slow movement - RA
+            bool reverse_dec;
+            bool reverse_ra;
+            bool accelerate;  // fast movement along the ramps
+            bool microstepping;  // whether microstepping is enabled
+            bool velocity;  // velocity mode, periods and directions are the commanded speeds
+            bool absolute;  // fast movement to the absolute position 'goal_dec', 'goal_ra'
+            long goal_dec;  // balance of DEC at the end of the absolute movement
+            long goal_ra;  // balance of RA at the end of the absolute movement
+            uint8_t epoch;  // segments of an older epoch were cancelled
+            uint32_t join;  // highest ramp position of the master at the junction with the previous segment
+            uint64_t start_us;  // time of the step timer when the segment starts, 0 at once
         };
 
         // structre holding a command for motors
         struct command_t {
             double revs_dec;  // desired number of revolutions of DEC
             double revs_ra;  // desired number of revolutions of RA
-            unsigned long delay_start_dec;  // starting delay between steps - DEC
-            unsigned long delay_start_ra;  // starting delay between steps - RA
-            unsigned long delay_end_dec;  // minimal delay between steps - DEC
-            unsigned long delay_end_ra;  // minimal delay between steps - RA
-            bool microstepping;  // whether enable microstepping
+            double speed_dec;  // revolutions per second of slow movement - DEC
+            double speed_ra;  // revolutions per second of slow movement - RA
+            bool microstepping;  // whether enable microstepping (slow movement), accelerate otherwise
+        };
+
+        // fills the ramp with a constant acceleration (or jerk limited) profile from the speed given by 'delay_start' 
+        // to 'delay_end', acceleration matches the old stair profile given by 'accel_each' and 'accel_amount'
+        static void build_ramp(ramp_t& ramp, int accel_each, int accel_amount, int delay_start, int delay_end);
+
+        // position (pulses) on a ramp of the given 'duration' (s) after 't' seconds 
+        static double ramp_position(double t, double v_start, double v_end, double duration);
+
+        // exact time (µs) between the first and the last full step pulse of an accelerated movement of a single motor
+        static uint64_t ramp_duration(uint32_t pulses, const ramp_t& ramp);
+
+        // exact time (µs) between the first and the last pulse of an accelerated movement by 'pulses' microsteps
+        // of a single motor which starts at a full step position
+        static uint64_t accelerated_duration(uint32_t pulses, const ramp_t& ramp);
+
+        // 32.32 fixed point delay (µs) between microsteps with the starting speed of the ramp
+        static ENGINE_INLINE uint64_t micro_period(const ramp_t& ramp) {
+            return max(((uint64_t)ramp.at(0) << 32) / MICROSTEPPING_MUL, (uint64_t)MIN_PULSE_DELAY << 32);
+        }
+
+        // command of an auxiliary axis
+        struct aux_command_t {
+            uint32_t pulses;  // pulses of the fast movement
+            uint64_t period;  // 32.32 fixed point delay (µs) between microsteps of the velocity mode
+            bool reverse;
+            bool velocity;  // velocity mode, 'pulses' are ignored
+            uint8_t epoch;  // commands of an older epoch were cancelled by aux_stop
+        };
+
+        // state of an auxiliary axis, it has its own commands and epochs, so it never waits for the mount
+        struct aux_data {
+            motor_data motor;
+            ramp_t ramp;
+            spsc_ring<aux_command_t, 4> commands;
+            std::atomic<uint8_t> epoch {0};
+            std::atomic<bool> emergency {false};  // the new epoch stops the axis at once
+            uint8_t engine_epoch = 0;
+            uint32_t steps_per_rev = 0;  // copy of the configuration, 0 if not wired
+            long balance = 0;
+        };
+
+        // commands of PEC, see pec_set_origin
+        enum pec_op_t : uint8_t { PEC_ORIGIN, PEC_PLAY, PEC_STOP, PEC_RECORD, PEC_GUIDE };
+
+        struct pec_command_t {
+            pec_op_t op;
+            uint8_t table;  // table to be played or recorded, PEC_TABLES plays the last one
+            int32_t rate;  // correction (1/PEC_UNIT of the speed) of guiding
+            uint32_t duration;  // µs of guiding
+        };
+
+        // one table is played, one recorded and the third one can be uploaded meanwhile
+        static const uint8_t PEC_TABLES = 3;
+
+        // periodic error correction, engine side except for 'tables', 'commands' and 'state'
+        struct pec_data {
+            int16_t tables[PEC_TABLES][PEC_SEGMENTS];  // producers write only tables which the engine neither plays nor records
+            spsc_ring<pec_command_t, 4> commands;
+            std::atomic<uint8_t> state {PEC_TABLES | PEC_TABLES << 2};  // 'table', 'record' and 'playing', see pec_publish
+            uint8_t table = PEC_TABLES;  // last played table, PEC_TABLES if none
+            uint8_t record = PEC_TABLES;  // recorded table, PEC_TABLES if none
+            bool playing = false;
+            uint32_t position = 0;  // RA balance since the origin modulo pulses of the worm revolution
+            uint16_t segment = 0;
+            int32_t guide = 0;  // correction of guiding (1/PEC_UNIT of the speed)
+            uint64_t guide_end_us = 0;
+            int32_t correction = 0;  // played and guiding ones together
+            int64_t sum = 0;  // corrections of pulses in the recorded segment
+            uint32_t count = 0;  // pulses in the recorded segment
+            int16_t recorded = 0;  // segments recorded so far, -1 until the first one begins
+        };
+
+        enum compare_op_t : uint8_t { COMPARE_ARM, COMPARE_DISARM };
+
+        struct compare_command_t {
+            compare_op_t op;
+            uint8_t slot;
+            uint8_t axis;
+            uint8_t generation;
+            long position;
+            long interval;
+        };
+
+        // action of the slot, producers write it before the slot is armed, the dispatcher reads it
+        struct compare_action_t {
+            compare_callback_t callback;  // NULL for the pin action
+            void* arg;
+            uint8_t pin;
+            bool level;
+            uint8_t generation;
         };
 
-        // estimates time (millis) of the complete fast_turn duration of a single motor
-        double estimate_motor_fast_turn_time(double steps, int accel_each, int accel_amount, int dalay_start, int dalay_end);
+        // armed event, engine side
+        struct compare_slot_t {
+            bool armed;
+            uint8_t axis;
+            uint8_t generation;
+            long position;
+            long interval;
+        };
+
+        // positions between the nearest events below and above the balance of an axis, the balance is there 
+        // while (uint32_t)(balance - base) < span, which is the only check the engine does per pulse
+        struct compare_window_t {
+            long base = -0x7FFFFFFE;
+            uint32_t span = 0xFFFFFFFD;
+        };
+
+        // position events, engine side except for 'actions' and 'commands'
+        struct compare_data {
+            spsc_ring<compare_command_t, 8> commands;
+            spsc_ring<compare_event_t, 16> events;
+            compare_action_t actions[COMPARE_EVENTS] = {};
+            compare_slot_t slots[COMPARE_EVENTS] = {};
+            compare_window_t windows[2 + AUX_AXES];
+            std::atomic<TaskHandle_t> dispatcher {NULL};
+        };
+
+        // ramps and constants of the step engine derived from motion_config_t
+        struct motion_profile_t {
+            ramp_t dec_ramp;
+            ramp_t ra_ramp;
+            uint32_t pec_worm_pulses;  // changes of the RA balance per worm revolution
+            uint64_t pec_scale;  // 32.32 fixed point factor which turns the position within the worm revolution into the segment
+        };
+
+        // '_profile_pending' is the index of the profile handed to the engine or one of these
+        static const uint8_t PROFILE_NONE = 2;
+        static const uint8_t PROFILE_WRITING = 3;  // a producer rebuilds the pending one, the engine must not take it
+
+        static void build_profile(motion_profile_t& profile, const motion_config_t& config);
+
+        // the engine switches to the pending profile
+        inline void take_profile();
 
         // make a turn of specified angles, speed (starting, ending) and command queueing
         void turn_internal(command_t cmd, bool queueing);
 
-        // set job to move specified number of steps with delays between them
-        void step_micros(motor_data* data, int steps, unsigned long micros_between_steps, bool rev);
+        // pushes the segment under '_motor_lock', lookahead finds the speed which both segments can share at their junction,
+        // the caller wakes the engine then
+        void push_segment(segment_t& segment, bool queueing);
+
+        // highest ramp position of the master which 'next' can continue from after 'prev' without 
+        // stopping, 0 if they cannot be blended, see segment_t::join
+        uint32_t join_position(const segment_t& prev, const segment_t& next) const;
+
+        // set job to move specified number of steps with delays between them, sets direction and microstepping pins
+        template<class PINS>
+        inline void step_micros(motor_data& data, uint32_t pulses, uint64_t period, bool rev, bool microstepping, const ramp_t* ramp);
+
+        // splits an accelerated movement by 'pulses' microsteps into microsteps up to a full step position, 
+        // pulses of full steps along the ramp and microsteps of the rest, full steps are never split, so they 
+        // end at a full step position, a motor which runs full steps goes on with them
+        static inline void split_accelerated(const motor_data& data, uint32_t pulses, bool reverse, uint32_t& head, uint32_t& full, uint32_t& tail);
+
+        // set job of the accelerated movement by 'pulses' microsteps, see split_accelerated
+        template<class PINS>
+        inline void step_accelerated(motor_data& data, uint32_t pulses, bool reverse, const ramp_t* ramp);
+
+        // pulses of full steps remaining to the tail of microsteps
+        static ENGINE_INLINE uint32_t full_remaining(const motor_data& data) { 
+            return data.microstepping ? 0 : data.pulses_remaining - data.micro_tail; 
+        }
+
+        // pulses of a movement cut down to 'pulses', one more (or less if there are no more) if the movement
+        // would end between the edges of a step, so the driver which moves at rising edges is where the balance
+        // says and full steps end at a full step position
+        static ENGINE_INLINE uint32_t cut_pulses(const motor_data& data, uint32_t pulses) {
+            if ((pulses & 1) == data.step_state || data.pulses_remaining == 0) return pulses;
+            return pulses < data.pulses_remaining ? pulses + 1 : pulses - 1;
+        }
+
+        // switches the microstepping pin, called only at full step positions
+        template<class PINS>
+        inline void set_microstepping(motor_data& data, bool microstepping);
+
+        // takes the next valid segment from the ring if both motors are done
+        inline void next_segment(uint64_t now);
+
+        // the oldest segment if it can be taken at 'now', a segment which starts later holds all
+        // following ones and its start is kept in '_held_us', segments of older epochs are never held
+        ENGINE_INLINE const segment_t* due_segment(uint64_t now, uint8_t epoch) {
+            const segment_t* next = _segments.peek();
+            _held_us = next != NULL && next->epoch == epoch && next->start_us > now ? next->start_us : 0;
+            return _held_us == 0 ? next : NULL;
+        }
+
+        // cuts running movements down to their deceleration (or stops them at once if 'emergency')
+        inline void halt(bool emergency);
+
+        // loads the movement to the goal from the current balances and the speed of the running master,
+        // which goes on if it can, otherwise it slows down or stops first and this is called again once
+        // it gets there, returns false if the goal is reached
+        bool plan_goal();
+
+        // highest ramp position up to 'pos' with the delay at least 'delay' (µs)
+        static uint32_t ramp_index(const ramp_t& ramp, double delay, uint32_t pos);
+
+        // slaves the motor with fewer pulses of the accelerated movement to the other one
+        inline void coordinate_motors();
+
+        // cuts the coordinated movement down to 'pulses' of the master which end at the ramp 
+        // position 'exit_pos', the slave keeps the ratio of pulses so motors stay on the line
+        inline void shorten(uint32_t pulses, uint32_t exit_pos);
+
+        // lets the master of the running segment know how fast it may enter the following one
+        inline void look_ahead();
+
+        // moves along the ramp, accelerates until 'ramp_top' and decelerates to stop at the end
+        inline void change_motor_speed(motor_data& data);
+
+        // commands the speed of the velocity mode, starts the motor if it stands
+        template<class PINS>
+        inline void apply_velocity(motor_data& data, uint64_t period, bool reverse);
+
+        // approaches the commanded speed of the velocity mode by a single pulse, directions and
+        // microstepping are switched only at speeds which can be changed at once
+        template<class PINS>
+        inline void change_motor_velocity(motor_data& data);
+
+        // subrutine of the trigger, returns microsteps which were done
+        template<class PINS>
+        inline int motor_trigger(motor_data& data, uint64_t now);
+
+        // sets pins and the ramp of the auxiliary axis if it is wired
+        template<uint8_t AXIS>
+        void aux_initialize();
+
+        // pushes the command of the auxiliary axis and lets the engine know
+        void aux_push(uint8_t axis, aux_command_t& command);
+
+        // takes commands of the auxiliary axis as long as they can start, the running movement
+        // is finished first, the velocity mode stops first
+        template<class PINS>
+        inline void aux_commands(aux_data& axis);
+
+        // performs commands and the pulse of the auxiliary axis, returns false once it has no job
+        template<uint8_t AXIS>
+        bool aux_trigger(uint64_t now);
 
-        // performs acceleration or decceleration 'amount' if 'change_steps' passed
-        inline void change_motor_speed(motor_data& data, unsigned int change_steps, int amount);
+        // aux_trigger of every auxiliary axis, the engine calls just those of active axes
+        typedef bool (MotorController::*aux_trigger_t)(uint64_t now);
+        static const aux_trigger_t _aux_triggers[AUX_AXES];
 
-        // subrutine of the interrupt service rutine, returns microsteps which were done
-        inline int motor_trigger(motor_data& data, byte pin, byte dir, bool dir_swap, byte ms);
+        // pushes the command of PEC and lets the engine know, the caller holds '_motor_lock'
+        void pec_push(const pec_command_t& command);
 
-        // returns true if 'value' is defferent from current value (1 or 0) and changes pin appropriately 
-        inline bool change_pin(byte pin, byte value);
+        // table which the engine neither plays nor records, waits for commands to be taken first, 
+        // the caller holds '_motor_lock'
+        uint8_t pec_free_table();
 
+        // takes commands of PEC
+        inline void pec_commands(uint64_t now);
+
+        // follows RA by its change of the balance and records the table
+        inline void pec_advance(int ra);
+
+        // sums the played correction and the one of guiding
+        inline void pec_correct();
+
+        // publishes the state of tables, so producers know which one is free
+        ENGINE_INLINE void pec_publish() {
+            _pec.state.store(_pec.table | _pec.record << 2 | (_pec.playing ? 1 : 0) << 4, std::memory_order_release);
+        }
+
+        // 32.32 fixed point delay (µs) between RA pulses of the velocity mode with PEC at the time 'now',
+        // integers only, it is called for every pulse
+        inline uint64_t pec_period(uint64_t period, uint64_t now);
+
+        // stores the action of the slot and pushes the command which arms it
+        void compare_arm(uint8_t slot, uint8_t axis, long position, long interval, compare_action_t action);
+
+        // pushes the command of position events and lets the engine know, the caller holds '_motor_lock'
+        void compare_push(const compare_command_t& command);
+
+        // takes commands of position events
+        inline void compare_commands(uint64_t now);
+
+        // the balance of 'axis' left its window, fires events which it got to or over
+        void compare_hit(uint8_t axis, long balance, uint64_t now);
+
+        // fires events at the balance and finds the window of the axis around it
+        void compare_window(uint8_t axis, long balance, uint64_t now);
+
+        // queues the event of the slot and arms it again if it repeats
+        inline void compare_fire(uint8_t slot, uint64_t now);
+
+        // checks the window of the axis, a single comparison unless the balance got to some event
+        ENGINE_INLINE void compare_check(uint8_t axis, long balance, uint64_t now) {
+            const compare_window_t& window = _compare.windows[axis];
+            if ((uint32_t)(balance - window.base) >= window.span) compare_hit(axis, balance, now);
+        }
+
+        inline long compare_balance(uint8_t axis) const {
+            return axis == 0 ? _dec_balance : axis == 1 ? _ra_balance : _aux[axis - 2].balance;
+        }
+
+        // STEP_EVENT_* bits of edges of the motor
+        static ENGINE_INLINE uint8_t trace_flags(const motor_data& data) {
+            return (data.axis == 1 ? STEP_EVENT_RA : data.axis > 1 ? STEP_EVENT_AUX : 0) | 
+                   (data.reverse ? STEP_EVENT_REVERSE : 0) | (data.microstepping ? STEP_EVENT_MICROSTEP : 0);
+        }
+
+        // toggles the step pin, returns microsteps which were done
+        template<class PINS>
+        inline int motor_pulse(motor_data& data);
+
+        // called after every pulse of the master, returns true if the slave should pulse as well
+        ENGINE_INLINE bool coordinate() {
+            _coordination.error += _coordination.slave_pulses;
+            if (_coordination.error < _coordination.master_pulses) return false;
+            _coordination.error -= _coordination.master_pulses;
+            return true;
+        }
+
+        // returns the earlier of two pulse times where 0 means no pulse at all
+        static ENGINE_INLINE uint64_t earliest(uint64_t a, uint64_t b) { return (a == 0 || (b != 0 && b < a)) ? b : a; }
+
+        // wakes up the motor task so it can reschedule the step timer
+        void wake();
+
+        // motor moves along its ramp or faster than its speed can be changed at once
+        static ENGINE_INLINE bool is_fast(const motor_data& data) {
+            return data.pulses_remaining > 0 && (data.ramp != NULL || fabsf(data.speed) > data.jump);
+        }
+
+        // demand of the engine with the 'next' pulse (0 if none) which the motor task sleeps to
+        power_state_t power_state(uint64_t next) const;
+
+        // records an event of the step engine if the tracing is enabled
+        ENGINE_INLINE void trace(uint8_t flags, uint16_t data) {
+#ifdef STEP_TRACE
+            // the cycle counter wraps around within tens of seconds, so the decoder gets the length of longer gaps
+            uint64_t gap = _trace_now_us - _trace_last_us;
+            if (gap >= STEP_TRACE_GAP_US) _trace.record(STEP_EVENT_GAP, _engine_epoch, min((gap + 500000) / 1000000, (uint64_t)UINT16_MAX));
+            _trace_last_us = _trace_now_us;
+            _trace.record(flags, _engine_epoch, data);
+#endif
+        }
+
+        // seqlock writer of '_position', called only by the step engine, 'aux' are bits
+        // of auxiliary axes whose balances might have changed
+        inline void publish(uint64_t now, uint32_t aux);
+
+        // conversions by steps per revolution of '_motion', they are called under '_motor_lock'
         inline void revs_to_steps(int* steps_dec, int* steps_ra, double revs_dec, double revs_ra, bool microstepping) {
-            *steps_dec = abs(revs_dec) * STEPS_PER_REV_DEC * (microstepping ? MICROSTEPPING_MUL : 1);
-            *steps_ra  = abs(revs_ra)  * STEPS_PER_REV_RA  * (microstepping ? MICROSTEPPING_MUL : 1);
+            *steps_dec = abs(revs_dec) * _motion.dec.steps_per_rev * (microstepping ? MICROSTEPPING_MUL : 1);
+            *steps_ra  = abs(revs_ra)  * _motion.ra.steps_per_rev  * (microstepping ? MICROSTEPPING_MUL : 1);
+        }
+
+        // converts revolutions per second of microstepping motor into 32.32 fixed point delay (µs) between pulses
+        static inline uint64_t revs_per_sec_to_period(double speed, uint32_t steps_per_rev) {
+            double pulses_per_sec = fabs(speed) * steps_per_rev * MICROSTEPPING_MUL * 2.0;
+            if (pulses_per_sec < 1000000.0 / 4294967295.0) return UINT64_MAX;
+            return 1000000.0 * 4294967296.0 / pulses_per_sec;
         }
 
         inline void steps_to_revs(double* revs_dec, double* revs_ra, double steps_dec, double steps_ra, bool microstepping) {
-            *revs_dec = steps_dec / STEPS_PER_REV_DEC / (microstepping ? MICROSTEPPING_MUL : 1);
-            *revs_ra  = steps_ra  / STEPS_PER_REV_RA  / (microstepping ? MICROSTEPPING_MUL : 1);
+            *revs_dec = steps_dec / _motion.dec.steps_per_rev / (microstepping ? MICROSTEPPING_MUL : 1);
+            *revs_ra  = steps_ra  / _motion.ra.steps_per_rev  / (microstepping ? MICROSTEPPING_MUL : 1);
         }
 
         // some motor state variables
         motor_data _dec;
         motor_data _ra;
-        queue<command_t> _commands;
+        // the engine runs along '_profile', producers rebuild the other one, see set_motion
+        motion_profile_t _profiles[2];
+        const motion_profile_t* _profile = &_profiles[0];  // engine side
+        std::atomic<uint8_t> _profile_pending {PROFILE_NONE};
+        uint8_t _profile_latest = 0;  // last built profile, producer side
+        motion_config_t _motion = motion_config_t::defaults();  // producer side
+        coordination_t _coordination;
+        spsc_ring<segment_t, 16> _segments;
+        segment_t _last_segment = {};  // last pushed segment, producer side
+        uint32_t _lookahead = 0;  // number of pushed segments seen by look_ahead, engine side
+        bool _velocity_mode = false;  // the engine runs a velocity segment, engine side
+        uint64_t _held_us = 0;  // start of the segment held at the head of the ring, 0 if none, engine side
+        bool _goal_valid = false;  // the engine moves to '_goal_*', engine side
+        long _goal_dec = 0;
+        long _goal_ra = 0;
+
+        // every stop or non-queued command starts a new epoch, the step engine
+        // aborts movements and skips segments of older epochs
+        std::atomic<uint8_t> _epoch {0};
+        std::atomic<bool> _emergency {false};  // the new epoch stops motors at once
+        uint8_t _engine_epoch = 0;
 
         long _dec_balance;
         long _ra_balance;
+
+        aux_data _aux[AUX_AXES];
+        std::atomic<uint32_t> _aux_pending {0};  // bits of auxiliary axes with new commands or stops
+        uint32_t _aux_active = 0;  // bits of auxiliary axes which have a job, engine side
+
+        pec_data _pec;
+        compare_data _compare;
+
+        // odd '_position_seq' means that the engine is just writing '_position'
+        position_t _position = {};
+        std::atomic<uint32_t> _position_seq {0};
+
+        // the ring has a single producer, so commands from different tasks must be serialized
 		SemaphoreHandle_t _motor_lock = NULL;
+
+#ifdef STEP_TRACE
+        step_trace<STEP_TRACE> _trace;
+        uint64_t _trace_now_us = 0;  // time of the running trigger call
+        uint64_t _trace_last_us = 0;  // time of the last recorded event
+#endif
+
+        stats_t _stats = {};
+        std::atomic<bool> _stats_reset {false};
+
+        TaskHandle_t _task = NULL;
+#ifndef BOARD_ATMEGA
+        uint64_t _alarm_us = 0;  // time of the armed alarm, 0 if disarmed
+        power_state_t _power_state = POWER_IDLE;  // state since the motor task fell asleep last time
+        uint64_t _power_us = 0;  // time when '_power_state' was set
+        uint32_t _cpu_mhz = 0;  // frequency seen by the motor task
+        TaskHandle_t _power_task = NULL;
+        std::atomic<uint8_t> _power_demand {POWER_IDLE};  // power state published to the power task
+        std::atomic<uint32_t> _power_mhz {0};  // frequency set by the power task
+        bool _power_holding = false;  // the power task waits with a lower frequency, see CPU_FREQ_HOLD
+        uint32_t _power_hold_ms = 0;  // time when it started to wait
+        int64_t _time_offset_us = 0;  // esp_timer time when the step timer started
+#endif
 };
 
 #ifdef BOARD_ATMEGA
 #ifndef FROM_LIB
-ISR(TIMER5_COMPA_vect) { MotorController::instance().trigger(); }
+// ATmega keeps the fixed tick, pulses are just aligned to multiples of TMR_RESOLUTION
+ISR(TIMER5_COMPA_vect) { 
+    static uint64_t now = 0;
+    MotorController::instance().trigger(now += TMR_RESOLUTION);
+}
 #endif
 #endif
 
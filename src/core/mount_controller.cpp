@@ -1,7 +1,6 @@
 #define FROM_LIB
 
 #include <Arduino.h>
-#include <float.h>
 
 #include "mount_controller.h"
 
@@ -14,6 +13,11 @@ void MountController::initialize() {
     #endif
 
     _is_tracking = false;
+    _tracking_velocity = false;
+    _tracking_update = 0;
+    _tracking_rate = 1;
+    _rate_us = 0;
+    _rate_pending = false;
     
     _mount_orientation = {0, 0};
     set_mount_pole(coord_t {DEFAULT_POLE_DEC, DEFAULT_POLE_RA}, DEFUALT_RA_OFFSET);
@@ -68,8 +72,6 @@ MountController::coord_t MountController::get_local_mount_orientation() {
 void MountController::all_star_alignment(coord_t kernel[], coord_t image[], uint8_t points_num) {
 
     // Should work similarly to Celestron All-star alignment
-    // Simple evolutionary strategy for optimization, which is slow :(
-    // TODO: better analytical solution
 
     #ifdef DEBUG_OUTPUT_MOUNT
         Serial.println(F("All start alignment:"));
@@ -87,82 +89,117 @@ void MountController::all_star_alignment(coord_t kernel[], coord_t image[], uint
         }
     #endif
 
-    static const long rnd_max = 1000000;
-
     cartesian_t x[CAL_BUFFER_SIZE];
     cartesian_t y[CAL_BUFFER_SIZE];
 
+    points_num = min(points_num, (uint8_t)CAL_BUFFER_SIZE);
     for (int i = 0; i < points_num; ++i) {
         x[i] = polar_to_cartesian(kernel[i]);
         y[i] = polar_to_cartesian(image[i]);
     }
 
-    deg_t solution[3];
-    solution[0] = random(0, 360 * rnd_max) / (double)rnd_max;
-    solution[1] = random(-90 * rnd_max, 90 * rnd_max) / (double)rnd_max;
-    solution[2] = random(0, 360 * rnd_max) / (double)rnd_max;
-  
-    double best_fitness = 0;
-    double sigma = OPT_SIGMA;
+    matrix_t A = fit_rotation(x, y, points_num);
+
+    // the last row of make_transition_matrix is the pole (cos dec cos ra, cos dec sin ra, sin dec) and
+    // the last column is (-cos dec cos offset, cos dec sin offset, sin dec)
+    coord_t pole;
+    deg_t ra_offset;
+    double cos_dec = sqrt(A.data[2][0] * A.data[2][0] + A.data[2][1] * A.data[2][1]);
+    pole.dec = to_deg(atan2(A.data[2][2], cos_dec));
+    if (cos_dec > 1e-9) {
+        pole.ra = to_deg(atan2(A.data[2][1], A.data[2][0]));
+        ra_offset = to_deg(atan2(A.data[1][2], -A.data[0][2]));
+    } else {
+        // the pole is the celestial one, just the sum of its RA and the offset matters
+        pole.ra = 0;
+        ra_offset = to_deg(atan2(A.data[0][1], A.data[0][0] * A.data[2][2]));
+    }
 
-    for (int s = 0; s < OPT_GENERAITONS; ++s) {
+    if (pole.ra < 0) pole.ra += 360;
+    if (ra_offset < 0) ra_offset += 360;
 
-        deg_t best_offspring[3];
+    #ifdef DEBUG_OUTPUT_MOUNT
+        Serial.print(F("RA: "));     Serial.print(pole.ra, 7);
+        Serial.print(F(" | DEC: ")); Serial.print(pole.dec, 7);
+        Serial.print(F(" | Off: ")); Serial.println(ra_offset, 7);
+    #endif
 
-        for (size_t i = 0; i < OPT_POPULATION_SIZE; i++) {
+    set_mount_pole(pole, ra_offset);
+}
 
-            deg_t offspring[3];
-            offspring[0] = solution[0] + random_normal() * sigma;
-            offspring[1] = solution[1] + random_normal() * sigma;
-            offspring[2] = solution[2] + random_normal() * sigma;
+MountController::matrix_t MountController::fit_rotation(const cartesian_t x[], const cartesian_t y[], uint8_t points_num) {
 
-            matrix_t A = make_transition_matrix({offspring[1], offspring[0]}, offspring[2]);
+    // correlation of the point sets, s[a][b] is the sum of x.a * y.b
+    double s[3][3] = {};
+    for (uint8_t i = 0; i < points_num; ++i) {
+        const double xi[3] = { x[i].x, x[i].y, x[i].z };
+        const double yi[3] = { y[i].x, y[i].y, y[i].z };
+        for (int a = 0; a < 3; ++a)
+            for (int b = 0; b < 3; ++b) s[a][b] += xi[a] * yi[b];
+    }
 
-            double objective = 0;
-            for (uint8_t i = 0; i < points_num; ++i) {           
-                cartesian_t p = A * x[i];
-                double d_x = (p.x - y[i].x);
-                double d_y = (p.y - y[i].y); 
-                double d_z = (p.z - y[i].z); 
-                objective += d_x * d_x + d_y * d_y + d_z * d_z;
-            }
+    // the unit quaternion of the best rotation maximizes q^T N q, so it is the eigenvector
+    // of the largest eigenvalue of the symmetric matrix N
+    double n[4][4] = {
+        { s[0][0] + s[1][1] + s[2][2], s[1][2] - s[2][1],            s[2][0] - s[0][2],            s[0][1] - s[1][0]            },
+        { s[1][2] - s[2][1],           s[0][0] - s[1][1] - s[2][2],  s[0][1] + s[1][0],            s[2][0] + s[0][2]            },
+        { s[2][0] - s[0][2],           s[0][1] + s[1][0],            -s[0][0] + s[1][1] - s[2][2], s[1][2] + s[2][1]            },
+        { s[0][1] - s[1][0],           s[2][0] + s[0][2],            s[1][2] + s[2][1],            -s[0][0] - s[1][1] + s[2][2] }
+    };
+    double q[4];
+    largest_eigenvector(n, q);
+    double w = q[0], i = q[1], j = q[2], k = q[3];
 
-            double fitness = 1.0 / (objective + 1.0);
+    return matrix_t {
+        {{ w * w + i * i - j * j - k * k, 2 * (i * j - w * k),           2 * (i * k + w * j)           },
+         { 2 * (i * j + w * k),           w * w - i * i + j * j - k * k, 2 * (j * k - w * i)           },
+         { 2 * (i * k - w * j),           2 * (j * k + w * i),           w * w - i * i - j * j + k * k }}
+    };
+}
 
-            if (best_fitness < fitness) {
-                best_fitness = fitness;
-                best_offspring[0] = offspring[0];
-                best_offspring[1] = offspring[1];
-                best_offspring[2] = offspring[2];
+void MountController::largest_eigenvector(double a[4][4], double vector[4]) {
+
+    // cyclic Jacobi rotations zero off-diagonal elements, 'v' collects them, so its columns
+    // are eigenvectors and the diagonal of 'a' eigenvalues once it converges
+    double v[4][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}};
+    for (int sweep = 0; sweep < 50; ++sweep) {
+        double off = 0;
+        for (int p = 0; p < 4; ++p)
+            for (int q = p + 1; q < 4; ++q) off += a[p][q] * a[p][q];
+        if (off < 1e-30) break;
+
+        for (int p = 0; p < 4; ++p) {
+            for (int q = p + 1; q < 4; ++q) {
+                if (a[p][q] == 0) continue;
+                double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1);
+                double s = t * c;
+                for (int k = 0; k < 4; ++k) {
+                    double akp = a[k][p], akq = a[k][q];
+                    a[k][p] = c * akp - s * akq;
+                    a[k][q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < 4; ++k) {
+                    double apk = a[p][k], aqk = a[q][k];
+                    a[p][k] = c * apk - s * aqk;
+                    a[q][k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < 4; ++k) {
+                    double vkp = v[k][p], vkq = v[k][q];
+                    v[k][p] = c * vkp - s * vkq;
+                    v[k][q] = s * vkp + c * vkq;
+                }
             }
         }
-
-        solution[0] = best_offspring[0];
-        solution[1] = best_offspring[1];
-        solution[2] = best_offspring[2];
-        
-        #ifdef DEBUG_OUTPUT_MOUNT
-            if (s % 25 == 0) {
-                Serial.print(F("("));  Serial.print(s);
-                Serial.print(F(") | Fitness: "));    Serial.print(best_fitness, 12);
-                Serial.print(F(" | RA: "));     Serial.print(solution[0], 7);
-                Serial.print(F(" | DEC: "));    Serial.print(solution[1], 7);
-                Serial.print(F(" | Off: "));    Serial.println(solution[2], 7);
-            }
-        #endif
-
-        if (best_fitness > OPT_PRECISION) break;
-        sigma *= OPT_SIGMA_DECAY;
     }
 
-    solution[0] = fmod(solution[0], 360);
-    solution[1] = fmod(solution[1], 90);
-    solution[2] = fmod(solution[2], 360);
-
-    if (solution[0] < 0) solution[0] += 360;
-    if (solution[2] < 0) solution[2] += 360;
-
-    set_mount_pole(coord_t {solution[1], solution[0]}, solution[2]);
+    int best = 0;
+    for (int i = 1; i < 4; ++i) if (a[i][i] > a[best][best]) best = i;
+    double norm = 0;
+    for (int i = 0; i < 4; ++i) norm += v[i][best] * v[i][best];
+    norm = sqrt(norm);
+    for (int i = 0; i < 4; ++i) vector[i] = v[i][best] / norm;
 }
 
 void MountController::move_absolute_J2000(deg_t angle_dec, deg_t angle_ra) {
@@ -193,25 +230,26 @@ void MountController::move_absolute_J2000(deg_t angle_dec, deg_t angle_ra) {
     move_absolute(to_deg(d_c), to_deg(r_c));
 }
 
-void MountController::move_absolute(deg_t angle_dec, deg_t angle_ra) {
+void MountController::move_absolute(deg_t angle_dec, deg_t angle_ra, uint64_t start_us) {
 
     if (angle_dec < -90 || angle_dec > 90 || angle_ra < 0 || angle_ra >= 360) {
 		log_e("##### Invalid angle! dec %f, ra %f", angle_dec, angle_ra);
 		return;
 	}
-    _motors.stop(); 
+    // a running goto is not stopped, motors are just replanned to the new target
+    _current_target = {angle_dec, angle_ra};
+    _tracking_velocity = false;
     
 	log_d("trying to get data");
-    coord_t target = polar_to_polar({angle_dec, to_time_global_ra(angle_ra)}, _transition);
+    // the target moves until the scheduled start as well
     coord_t o = get_local_mount_orientation();
-	log_d("Angle to res");
-    
-    coord_t revs = angle_to_revolutions({target.dec - o.dec, target.ra  - o.ra});
-    double travel_time = _motors.estimate_fast_turn_time(revs.dec, revs.ra) / 1000.0 / 3600.0;
-
-	log_d("polar to polar");
-    target = polar_to_polar({angle_dec, to_future_global_ra(angle_ra, travel_time)}, _transition);
-    revs = angle_to_revolutions({target.dec - o.dec, target.ra  - o.ra});
+    uint64_t now = _motors.time_us();
+    double delay = start_us > now ? (start_us - now) / 1000.0 : 0;
+    double travel_time;
+    coord_t target;
+    // the goal is absolute, so just the target of the intercept is needed, not the revolutions to it
+    intercept(o, {angle_dec, to_time_global_ra(angle_ra)}, target, travel_time, delay);
+	log_d("intercept after %f ms", travel_time + delay);
 
     //#ifdef DEBUG_OUTPUT_MOUNT
         log_d("Turning at high speed by:");
@@ -219,12 +257,31 @@ void MountController::move_absolute(deg_t angle_dec, deg_t angle_ra) {
         log_d("       RA:   %f", target.ra  - o.ra);
         log_d("  tran DEC:  %f --> %f", angle_dec, target.dec);
         log_d("  tran RA:   %f --> %f", angle_ra, target.ra);
-        log_d("  revs DEC:  %f",revs.dec);
-        log_d("  revs RA:   %f",revs.ra);
 		log_d("from DEC %f RA %f to DEC %f RA %f", o.dec, o.ra, target.dec, target.ra);
     //#endif
 
-    _motors.fast_turn(revs.dec, revs.ra, false);
+    coord_t goal = angle_to_revolutions(target);
+    _motors.move_to(goal.dec, goal.ra, true, start_us);
+}
+
+MountController::coord_t MountController::intercept(coord_t local, coord_t global, coord_t& target, double& travel_time, double delay) {
+
+    // the duration of the movement depends on the target which moves during the movement, 
+    // so this is a fixed point iteration, durations are exact so it converges in a few steps
+    travel_time = 0;
+    coord_t revs = {0, 0};
+    for (uint8_t i = 0; i < INTERCEPT_ITERATIONS; ++i) {
+        // RA in the time global coordinates grows with the sidereal rate (arcsec / s)
+        coord_t future = {global.dec, fmod(global.ra + (delay + travel_time) / 1000.0 * RATE_SIDEREAL / 3600.0, 360)};
+        target = polar_to_polar(future, _transition);
+        revs = angle_to_revolutions({target.dec - local.dec, target.ra - local.ra});
+
+        double duration = _motors.estimate_fast_turn_time(revs.dec, revs.ra);
+        bool converged = fabs(duration - travel_time) < INTERCEPT_PRECISION;
+        travel_time = duration;
+        if (converged) break;
+    }
+    return revs;
 }
 
 void MountController::move_relative_local(deg_t angle_dec, deg_t angle_ra) {
@@ -279,14 +336,9 @@ void MountController::move_relative_global(deg_t angle_dec, deg_t angle_ra) {
     curr_global.ra = fmod(curr_global.ra + angle_ra, 360);
     if (curr_global.ra < 0) curr_global.ra += 360;
 
-    coord_t new_pos = polar_to_polar(curr_global, _transition);
-    coord_t revs = angle_to_revolutions({new_pos.dec - curr_pos.dec, new_pos.ra - curr_pos.ra});
-    
-    double travel_time = _motors.estimate_fast_turn_time(revs.dec, revs.ra) / 1000.0 * 15.0 / 3600.0; 
-    curr_global.ra = fmod(curr_global.ra + travel_time, 360);
-
-    new_pos = polar_to_polar(curr_global, _transition);
-    revs = angle_to_revolutions({new_pos.dec - curr_pos.dec, new_pos.ra - curr_pos.ra});
+    double travel_time;
+    coord_t new_pos;
+    coord_t revs = intercept(curr_pos, curr_global, new_pos, travel_time);
 
     #ifdef DEBUG_OUTPUT_MOUNT
         Serial.println(F("Turning at high speed by:"));
@@ -300,37 +352,21 @@ void MountController::move_relative_global(deg_t angle_dec, deg_t angle_ra) {
 }
 
 void MountController::set_tracking() {
-
     _is_tracking = true;
-	return;
-    // TODO: it would be nice to change the speed dynamically after some time, based on the time
-    // ellapsed from the start of the movement. Unfortunately it would require a schedule 
-    // of steppers speed and a clever correction (we are doing a conversion of a complex
-    // sin/cos/sqrt function into a simple stair function) and it is hard.
+    _tracking_velocity = false;
+    _rate_us = _motors.time_us();
+}
 
-    double w = 15.0;
-    
-    coord_t target = get_global_mount_orientation();
-    coord_t speed = get_ra_speed_transform(w, 0.0, target, _mount_pole, _mount_ra_offset);
-
-    log_d("Tracking:");
-    log_d("  target DEC: %f", target.dec);
-    log_d("  target RA:  %f", target.ra);
-    log_d("  speed DEC (dps): %f", speed.dec / 3600.0);  // 0.0 
-    log_d("  speed RA (dps):  %f", speed.ra  / 3600.0);  // 0.0041667
-
-    speed = angle_to_revolutions(speed);
-	//TODO: determine why we need 2* here. Is is an error on my side?
-    _motors.slow_turn(speed.dec, speed.ra, 2* speed.dec / 3600.0, 2*speed.ra / 3600.0, true);
-    
+void MountController::set_tracking_rate(double rate, uint64_t start_us) {
+    // tracking updates push speeds of the new rate ahead of its start
+    _next_rate = rate;
+    _next_rate_us = max(start_us, _motors.time_us());
+    _rate_pending = true;
 }
 
 void MountController::set_parking() {
 
-    double dec_revs_done, ra_revs_done;
-    _motors.get_made_revolutions(dec_revs_done, ra_revs_done);
-    
-    _motors.fast_turn(-dec_revs_done, -ra_revs_done, false);
+    _motors.move_to(0, 0, false);
 }
 
 MountController::coord_t MountController::get_ra_speed_transform(deg_t ra_speed, double t, coord_t point, coord_t pole, deg_t ra_offset) {
@@ -435,48 +471,57 @@ MountController::matrix_t MountController::get_ra_transition_inverse(deg_t ra) {
     };
 }
 
-double MountController::random_normal() {
-
-    static const long rnd_max = 1000000;
-
-    static double z1;
-    static bool generate;
-    generate = !generate;
-
-    if (!generate) return z1;
-
-    double u1, u2;
-    do {
-        u1 = random(0, rnd_max) / (double)rnd_max;
-        u2 = random(0, rnd_max) / (double)rnd_max;
-    }
-	// TODO: do we need to change this, if the compiler only supports 32bit float?
-    while (u1 <= DBL_MIN);
-
-    double z0;
-    double s = sqrt(-2.0 * log(u1));
-    z0 = s * cos(2.0 * 3.14159265358 * u2);
-    z1 = s * sin(2.0 * 3.14159265358 * u2);
-
-    return z0;
-}
-
-void MountController::set_target_ra(double ra) {
+void MountController::set_target_ra(double ra, uint64_t start_us) {
 	this->_current_target.ra = ra;
 	heap_caps_check_integrity_all(true);
-	this->move_absolute(this->_current_target.dec, this->_current_target.ra);
+	this->move_absolute(this->_current_target.dec, this->_current_target.ra, start_us);
 	this->set_tracking();
 }
 
-void MountController::set_target_dec(double dec) {
+void MountController::set_target_dec(double dec, uint64_t start_us) {
 	this->_current_target.dec = dec;
 	heap_caps_check_integrity_all(true);
-	this->move_absolute(this->_current_target.dec, this->_current_target.ra);
+	this->move_absolute(this->_current_target.dec, this->_current_target.ra, start_us);
 	this->set_tracking();
 }
 
 void MountController::update_tracking() {
-	if(_is_tracking && !this->is_moving()) {
-		this->move_absolute(this->_current_target.dec, this->_current_target.ra);
+
+	if (!_is_tracking) return;
+
+	// the goto must finish first, then the velocity mode goes on without stopping,
+	// speeds which wait for their start are not replaced either
+	if (!_tracking_velocity && is_moving()) return;
+	if (_motors.is_queued()) return;
+	uint64_t now = _motors.time_us();
+	bool rate_due = _rate_pending && _next_rate_us < now + TRACKING_PERIOD * 1000ULL;
+	if (_tracking_velocity && !rate_due && millis() - _tracking_update < TRACKING_PERIOD) return;
+	_tracking_update = millis();
+
+	// the target moves against stars unless the rate is sidereal
+	if (now > _rate_us) _current_target.ra = fmod(_current_target.ra + 360 + (1 - _tracking_rate) * (now - _rate_us) / 1e6 * RATE_SIDEREAL / 3600.0, 360);
+	_rate_us = max(now, _rate_us);
+
+	// scheduled rate starts with speeds aimed from the position where the current ones get the mount
+	double lead = rate_due && _next_rate_us > now ? (_next_rate_us - now) / 1e6 : 0;
+	double rate = rate_due ? _next_rate : _tracking_rate;
+
+	// speeds include both the motion of the target and the correction of the current error
+	double horizon = TRACKING_HORIZON / 1000.0;
+	coord_t o = get_local_mount_orientation();
+	double ra = to_time_global_ra(_current_target.ra) + _tracking_rate * lead * RATE_SIDEREAL / 3600.0;
+	if (rate_due) o = polar_to_polar({_current_target.dec, fmod(ra, 360)}, _transition);
+	coord_t future = {_current_target.dec, fmod(ra + horizon * rate * RATE_SIDEREAL / 3600.0, 360)};
+	coord_t target = polar_to_polar(future, _transition);
+	coord_t revs = angle_to_revolutions({target.dec - o.dec, to_180_range(target.ra - o.ra)});
+
+	_motors.set_velocity(revs.dec / horizon, revs.ra / horizon, true, rate_due ? _next_rate_us : 0);
+	_tracking_velocity = true;
+
+	if (rate_due) {
+		_current_target.ra = fmod(_current_target.ra + 360 + (1 - _tracking_rate) * lead * RATE_SIDEREAL / 3600.0, 360);
+		_rate_us = _next_rate_us;
+		_tracking_rate = rate;
+		_rate_pending = false;
 	}
 }
@@ -39,14 +39,16 @@ class MountController {
     // orientation of mount in its coordinate system (does not take into account LST)
     coord_t get_local_mount_orientation();
 
-    // calibration of mount pole
+    // calibration of mount pole, 'kernel' are stars in the time global coordinates (see to_time_global_ra) and
+    // 'image' local orientations of the mount pointing at them, the pole and the RA offset are fitted by least squares
     void all_star_alignment(coord_t kernel[], coord_t image[], uint8_t points_num);
 
     // same as move_absolute method but with JToDate correction of J2000 cordinates
     void move_absolute_J2000(deg_t angle_dec, deg_t angle_ra);
 
-    // moves the mount in order to point at the target in absolute coordinates (at max speed)
-    void move_absolute(deg_t angle_dec, deg_t angle_ra);
+    // moves the mount in order to point at the target in absolute coordinates (at max speed), 
+    // the movement starts at 'start_us' of the step timer if given, see MotorController::time_us
+    void move_absolute(deg_t angle_dec, deg_t angle_ra, uint64_t start_us = 0);
 
     // moves a bit relatively to the current mount orientation (at max speed in mount coord. sys.)
     void move_relative_local(deg_t angle_dec, deg_t angle_ra);
@@ -54,23 +56,34 @@ class MountController {
     // moves a bit relatively to the current mount orientation (at max speed in equatorial coord. sys.)
     void move_relative_global(deg_t angle_dec, deg_t angle_ra);
 
-    // starts tracking the object for an hour given the current mount orientation, also adapts
-    // the speed of motors in RA and DEC according to starting position (so it should  a little but 
-    // compensate improperly calibrated mount), however this SPEED MIGHT BE IRRELEVANT ONCE THE TRACKING
-    // IS RUNNING FOR A LONG TIME AND/OR THE MOUNT IS VERY POORLY CALIBRATED (i.e. its pole is at 45 DEC)
+    // starts tracking the last target of move_absolute, once the mount gets there motors 
+    // run in the velocity mode and update_tracking adjusts their speeds
     void set_tracking();
 	
-	void set_target_ra(double ra);
-	void set_target_dec(double dec);
+	void set_target_ra(double ra, uint64_t start_us = 0);
+	void set_target_dec(double dec, uint64_t start_us = 0);
 	coord_t get_target() { return this->_current_target;}
+
+	// follows the target by speeds of motors, should be called often, speeds are changed 
+	// every TRACKING_PERIOD so the mount gets where the target will be in TRACKING_HORIZON
 	void update_tracking();
 
+	// tracking follows the target moving with 'rate' times the sidereal rate from 'start_us' of 
+	// the step timer (at once if 0), speeds of motors change exactly then
+	void set_tracking_rate(double rate, uint64_t start_us = 0);
+
+	// rate of tracking (multiple of the sidereal rate), the scheduled one once it starts
+	double get_tracking_rate() { return _tracking_rate; }
+
     // moves the mount to 0, 0 in local coordinates
     void set_parking();
 
-    // stops all motors immediately
+    // stops all motors along their deceleration ramps, so the position is kept
     void stop_all() { _motors.stop(); _is_tracking = false; }
 
+    // stops all motors immediately, steps might be lost at high speeds
+    void emergency_stop() { _motors.emergency_stop(); _is_tracking = false; }
+
     // stops motors just is tracking
     void stop_tracking();
 
@@ -92,6 +105,11 @@ class MountController {
 
   private:
 
+    // finds revolutions which turn the mount from 'local' orientation to the 'global' target (time global 
+    // coordinates at the moment of the call) at the moment of arrival, 'target' gets the local coordinates
+    // of the target and 'travel_time' the duration (millis) of the movement which starts after 'delay' (millis)
+    coord_t intercept(coord_t local, coord_t global, coord_t& target, double& travel_time, double delay = 0);
+
     struct matrix_t {
 
         double data[3][3];
@@ -182,10 +200,21 @@ class MountController {
     // TRANSFORMS NEARBY THE REAL GLOBAL POLE.
     coord_t get_ra_speed_transform(deg_t ra_speed, double t, coord_t point, coord_t pole, deg_t ra_offset);
 
-    // returns a number from standard normal distribution using transform from uniform distribution
-    double random_normal();
+    // rotation which turns points 'x' into points 'y' with the least sum of squared distances,
+    // Horn's closed-form solution by the unit quaternion
+    matrix_t fit_rotation(const cartesian_t x[], const cartesian_t y[], uint8_t points_num);
+
+    // unit eigenvector of the largest eigenvalue of the symmetric matrix 'a', which is destroyed
+    static void largest_eigenvector(double a[4][4], double vector[4]);
 
     boolean _is_tracking;
+    boolean _tracking_velocity;  // motors already follow the target by their speeds
+    unsigned long _tracking_update;  // millis of the last change of tracking speeds
+    double _tracking_rate;  // motion of the target (multiple of the sidereal rate) 
+    uint64_t _rate_us;  // time of the step timer up to which the target moved with the rate
+    double _next_rate;  // rate scheduled by set_tracking_rate
+    uint64_t _next_rate_us;
+    boolean _rate_pending;
 
 	// sets the current target. allows to easily set ra and dec separately
 	// in J2000
@@ -0,0 +1,60 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Wait-free ring buffer for exactly one producer and one consumer task. Indices
+// grow freely and wrap naturally, only the slot index is masked by the capacity.
+// Methods are always inlined, so a consumer running from IRAM never calls into flash.
+template<class T, uint32_t N>
+class spsc_ring {
+
+    static_assert((N & (N - 1)) == 0, "capacity of the ring must be a power of two");
+
+    public:
+
+        // producer side, returns false if the ring is full
+        inline __attribute__((always_inline)) bool push(const T& item) {
+            uint32_t head = _head.load(std::memory_order_relaxed);
+            if (head - _tail.load(std::memory_order_acquire) == N) return false;
+            _items[head & (N - 1)] = item;
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        // consumer side, returns false if the ring is empty
+        inline __attribute__((always_inline)) bool pop(T& item) {
+            uint32_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail == _head.load(std::memory_order_acquire)) return false;
+            item = _items[tail & (N - 1)];
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // consumer side, returns the oldest item without removing it or NULL if the ring is empty
+        inline __attribute__((always_inline)) const T* peek() const {
+            uint32_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail == _head.load(std::memory_order_acquire)) return NULL;
+            return &_items[tail & (N - 1)];
+        }
+
+        // safe from both sides, but it is just a snapshot
+        inline __attribute__((always_inline)) uint32_t count() const {
+            return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+        }
+
+        inline __attribute__((always_inline)) bool empty() const { return count() == 0; }
+
+        // total numbers of items ever pushed and popped, these just wrap around
+        inline __attribute__((always_inline)) uint32_t pushed() const { return _head.load(std::memory_order_acquire); }
+        inline __attribute__((always_inline)) uint32_t popped() const { return _tail.load(std::memory_order_acquire); }
+
+    private:
+
+        T _items[N];
+        std::atomic<uint32_t> _head {0};
+        std::atomic<uint32_t> _tail {0};
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef STEP_TIMER_H
+#define STEP_TIMER_H
+
+#include <stdint.h>
+#include "../config.h"
+
+// Access of the step engine to the hardware timer TIMER (Arduino number) in its tick path. timerRead,
+// timerAlarmWrite and timerAlarmEnable of Arduino live in flash and can be stalled by a miss of the flash
+// cache, so the engine touches registers of the timer group directly, always inlined into its IRAM code.
+// The timer is still set up by timerBegin. The HOST_BUILD backend calls the timer shim of the simulator.
+
+#if defined(HOST_BUILD)
+
+#include "esp32-hal-timer.h"
+
+template<uint8_t TIMER>
+struct step_timer {
+    static inline uint64_t read() { return timerRead(NULL); }
+    static inline void alarm(uint64_t us) { timerAlarmWrite(NULL, us, false); timerAlarmEnable(NULL); }
+    static inline void disarm() { timerAlarmDisable(NULL); }
+};
+
+#elif !defined(BOARD_ATMEGA)
+
+#include <soc/soc.h>
+#include <soc/timer_group_reg.h>
+
+// Arduino timers 0 .. 3 are timers TIMER % 2 of groups TIMER / 2, registers of the timer 1 of a group
+// follow those of the timer 0
+template<uint8_t TIMER>
+struct step_timer {
+    static inline __attribute__((always_inline)) uint64_t read() {
+        // any write latches the counter into the LO and HI registers
+        REG_WRITE(reg(TIMG_T0UPDATE_REG(GROUP)), 1);
+        return ((uint64_t)REG_READ(reg(TIMG_T0HI_REG(GROUP))) << 32) | REG_READ(reg(TIMG_T0LO_REG(GROUP)));
+    }
+    // the alarm is one-shot (timerBegin disables the auto reload), the hardware clears the enable bit when it fires
+    static inline __attribute__((always_inline)) void alarm(uint64_t us) {
+        REG_WRITE(reg(TIMG_T0ALARMHI_REG(GROUP)), (uint32_t)(us >> 32));
+        REG_WRITE(reg(TIMG_T0ALARMLO_REG(GROUP)), (uint32_t)us);
+        REG_SET_BIT(reg(TIMG_T0CONFIG_REG(GROUP)), TIMG_T0_ALARM_EN);
+    }
+    static inline __attribute__((always_inline)) void disarm() {
+        REG_CLR_BIT(reg(TIMG_T0CONFIG_REG(GROUP)), TIMG_T0_ALARM_EN);
+    }
+
+    private:
+        static const uint8_t GROUP = TIMER / 2;
+        static inline __attribute__((always_inline)) uint32_t reg(uint32_t timer0) {
+            return timer0 + (TIMER % 2) * (TIMG_T1CONFIG_REG(0) - TIMG_T0CONFIG_REG(0));
+        }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef STEP_TRACE_H
+#define STEP_TRACE_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Timeline of everything the step engine did, i.e. every edge of step pins and every segment
+// taken from the ring. The engine is the only writer and never waits, old events are just
+// overwritten. Readers copy events out and drop those which were overwritten meanwhile.
+
+#define STEP_EVENT_RA           0x01  // axis of the edge, DEC otherwise
+#define STEP_EVENT_SEGMENT      0x02  // a segment was taken from the ring, not an edge
+#define STEP_EVENT_REVERSE      0x04  // direction pin of the axis (edge)
+#define STEP_EVENT_MICROSTEP    0x08  // microstepping of the axis (edge) or of the segment
+#define STEP_EVENT_LEVEL        0x10  // level of the step pin after the edge
+#define STEP_EVENT_ACCELERATE   0x20  // segment of the fast movement along ramps
+#define STEP_EVENT_AUX          0x40  // edge of an auxiliary axis, see MotorController::aux_move
+#define STEP_EVENT_GAP          0x80  // alone, the engine recorded nothing for 'data' seconds (rounded), the counter may have wrapped
+#define STEP_EVENT_END          0xFF  // terminates the exported stream
+
+#define STEP_TRACE_MAGIC        0x43525453  // "STRC"
+#define STEP_TRACE_VERSION      3
+#define STEP_TRACE_GAP_US       1000000  // gaps between events from which STEP_EVENT_GAP is recorded
+
+struct step_event_t {
+    uint32_t cycles;  // CPU cycle counter (µs on other platforms), it wraps around
+    uint8_t flags;  // STEP_EVENT_* bits
+    uint8_t epoch;  // epoch of the engine, see MotorController::stop
+    uint16_t data;  // low bits of the number of segments taken so far (segment), index of the axis (edge)
+};
+
+// exported stream starts with this header followed by events and STEP_EVENT_END event
+struct step_trace_header_t {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t event_size;
+    uint16_t microstepping;  // balance change of a full step pulse, see MICROSTEPPING_MUL
+    uint32_t cycles_per_us;
+    uint32_t steps_per_rev_dec;
+    uint32_t steps_per_rev_ra;
+};
+
+static inline uint32_t cpu_cycles() {
+#if defined(HOST_BUILD) || defined(BOARD_ATMEGA)
+    return micros();
+#else
+    uint32_t ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+#endif
+}
+
+template<uint32_t N>
+class step_trace {
+
+    static_assert((N & (N - 1)) == 0, "size of the trace must be a power of two");
+
+    public:
+
+        // engine side, just a few stores always inlined into the engine in IRAM
+        inline __attribute__((always_inline)) void record(uint8_t flags, uint8_t epoch, uint16_t data) {
+            uint32_t head = _head.load(std::memory_order_relaxed);
+            step_event_t& event = _events[head & (N - 1)];
+            event.cycles = cpu_cycles();
+            event.flags = flags;
+            event.epoch = epoch;
+            event.data = data;
+            _head.store(head + 1, std::memory_order_release);
+        }
+
+        // number of events ever recorded, it wraps around
+        inline uint32_t recorded() const { return _head.load(std::memory_order_acquire); }
+
+        // copies at most 'n' events starting with the event number 'from', which is moved
+        // forward if the oldest events are gone, returns the number of copied events
+        uint32_t read(uint32_t& from, step_event_t* out, uint32_t n) const {
+            uint32_t head = _head.load(std::memory_order_acquire);
+            if (head - from > N) from = head - N;
+            if (n > head - from) n = head - from;
+            for (uint32_t i = 0; i < n; ++i) out[i] = _events[(from + i) & (N - 1)];
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // the engine might have overwritten some of them, including the one being written now
+            uint32_t oldest = _head.load(std::memory_order_relaxed) - N + 1;
+            uint32_t lost = (int32_t)(oldest - from) > 0 ? oldest - from : 0;
+            if (lost > n) lost = n;
+            for (uint32_t i = lost; i < n; ++i) out[i - lost] = out[i];
+            from += lost;
+            return n - lost;
+        }
+
+    private:
+
+        step_event_t _events[N];
+        std::atomic<uint32_t> _head {0};
+};
+
+#endif
@@ -7,9 +7,11 @@ static int tcp_server = -1;
 
 #define MAX_TCP_CLIENTS 5
 #define TCP_BUF_LEN 1500
+#define TCP_REPLY_RETRIES 100 // waits of 10 ms for a client which does not read the reply
 static uint8_t packetBuffer[TCP_BUF_LEN];
 
 static int tcpClients[MAX_TCP_CLIENTS];
+static int tcpReplyClient = -1; // client whose message is being handled by the callback of tcp_update
 
 void tcp_init() {
 	if ((tcp_server=socket(AF_INET, SOCK_STREAM, 0)) == -1){
@@ -43,7 +45,7 @@ void tcp_init() {
 
 void IRAM_ATTR tcp_send_packet(uint8_t* buf, uint32_t size) {
 	if(tcp_server < 0) return;
-	log_i("Sending packet with size %d msg: %s", size, buf);
+	log_i("Sending packet with size %d msg: %.*s", size, (int)size, buf);
 	if (buf != NULL && size != 0) {
 		for(int i = 0; i < MAX_TCP_CLIENTS; ++i) {
 			if(tcpClients[i] >= 0) {
@@ -53,6 +55,26 @@ void IRAM_ATTR tcp_send_packet(uint8_t* buf, uint32_t size) {
 	}
 }
 
+bool tcp_reply(const uint8_t* buf, uint32_t size) {
+	if(tcpReplyClient < 0) return false;
+	uint32_t sent = 0;
+	int retries = 0;
+	while(sent < size) {
+		int len = ::send(tcpReplyClient, buf + sent, size - sent, 0);
+		if(len > 0) {
+			sent += len;
+			retries = 0;
+		} else if(len < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && ++retries < TCP_REPLY_RETRIES) {
+			// the socket does not block, so wait until the client reads
+			vTaskDelay(10 / portTICK_PERIOD_MS);
+		} else {
+			log_w("tcp reply cut after %u of %u bytes, error %d", sent, size, errno);
+			return false;
+		}
+	}
+	return true;
+}
+
 void IRAM_ATTR tcp_update(void (*callback)(uint8_t* buf, uint32_t size)) {
 	if(tcp_server < 0) return;
 	// check for new connections
@@ -92,7 +114,9 @@ void IRAM_ATTR tcp_update(void (*callback)(uint8_t* buf, uint32_t size)) {
 			} else { // got new data
 				packetBuffer[len] = 0;
 				log_i("Got tcp msg with len %d msg: %s", len, packetBuffer);
+				tcpReplyClient = tcpClients[i];
 				callback(packetBuffer, len);
+				tcpReplyClient = -1;
 			}
 		}
 	}
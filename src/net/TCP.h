@@ -5,6 +5,9 @@
 #include <stdint.h>
 
 void IRAM_ATTR tcp_send_packet(uint8_t* buf, uint32_t size);
+// sends binary data just to the client whose message is being handled, the data is not logged,
+// returns false if there is no such client or it did not take all of the data
+bool tcp_reply(const uint8_t* buf, uint32_t size);
 void tcp_init();
 void IRAM_ATTR tcp_update(void (*callback)(uint8_t* buf, uint32_t size));
 
@@ -0,0 +1,192 @@
+#include <Arduino.h>
+#include <chrono>
+
+#include "../config.h"
+#include "../core/motor_controller.h"
+#include "../core/mount_controller.h"
+
+// Benchmark of the all-star alignment, the closed-form fit of MountController against the evolutionary
+// strategy it replaced. Every trial takes a random pole and RA offset, a few random stars and the mount
+// orientations pointing at them with a random error, both solvers fit the pole from the same pairs.
+//
+//     align_bench [trials] [pointing error (arcsec)] [stars]
+
+typedef MountController::coord_t coord_t;
+typedef MountController::cartesian_t cartesian_t;
+
+struct rotation_t { double m[3][3]; };
+
+// parameters of the replaced evolutionary strategy
+static const double OPT_PRECISION = 5000000;
+static const int OPT_POPULATION_SIZE = 4;
+static const int OPT_GENERATIONS = 1250;
+static const double OPT_SIGMA = 1.0;
+static const double OPT_SIGMA_DECAY = 0.997;
+
+static cartesian_t to_cartesian(coord_t polar) {
+    double dec = polar.dec * DEG_TO_RAD, ra = polar.ra * DEG_TO_RAD;
+    return { cos(dec) * cos(ra), cos(dec) * sin(ra), sin(dec) };
+}
+
+static cartesian_t rotate(const rotation_t& r, cartesian_t p) {
+    return { r.m[0][0] * p.x + r.m[0][1] * p.y + r.m[0][2] * p.z,
+             r.m[1][0] * p.x + r.m[1][1] * p.y + r.m[1][2] * p.z,
+             r.m[2][0] * p.x + r.m[2][1] * p.y + r.m[2][2] * p.z };
+}
+
+static rotation_t multiply(const rotation_t& a, const rotation_t& b) {
+    rotation_t product = {};
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            for (int k = 0; k < 3; ++k) product.m[i][j] += a.m[i][k] * b.m[k][j];
+    return product;
+}
+
+// the same as MountController::make_transition_matrix
+static rotation_t transition(coord_t pole, double ra_offset) {
+    double co = cos(ra_offset * DEG_TO_RAD), so = sin(ra_offset * DEG_TO_RAD);
+    double cd = cos(pole.dec * DEG_TO_RAD), sd = sin(pole.dec * DEG_TO_RAD);
+    double cr = cos(pole.ra * DEG_TO_RAD), sr = sin(pole.ra * DEG_TO_RAD);
+    rotation_t offset = {{{ co, so, 0 }, { -so, co, 0 }, { 0, 0, 1 }}};
+    rotation_t dec = {{{ sd, 0, -cd }, { 0, 1, 0 }, { cd, 0, sd }}};
+    rotation_t ra = {{{ cr, sr, 0 }, { -sr, cr, 0 }, { 0, 0, 1 }}};
+    return multiply(multiply(offset, dec), ra);
+}
+
+static double angle(cartesian_t a, cartesian_t b) {
+    double dot = a.x * b.x + a.y * b.y + a.z * b.z;
+    double cx = a.y * b.z - a.z * b.y, cy = a.z * b.x - a.x * b.z, cz = a.x * b.y - a.y * b.x;
+    return atan2(sqrt(cx * cx + cy * cy + cz * cz), dot) * RAD_TO_DEG * 3600;
+}
+
+static double uniform() { return (rand() + 0.5) / ((double)RAND_MAX + 1); }
+
+static double random_normal() {
+    return sqrt(-2.0 * log(uniform())) * cos(2 * M_PI * uniform());
+}
+
+// the replaced solver, returns {pole RA, pole DEC, offset}
+static void evolutionary_alignment(const cartesian_t x[], const cartesian_t y[], uint8_t points_num, double solution[3]) {
+    solution[0] = uniform() * 360;
+    solution[1] = uniform() * 180 - 90;
+    solution[2] = uniform() * 360;
+    double best_fitness = 0;
+    double sigma = OPT_SIGMA;
+    for (int s = 0; s < OPT_GENERATIONS; ++s) {
+        double best_offspring[3] = { solution[0], solution[1], solution[2] };
+        for (int i = 0; i < OPT_POPULATION_SIZE; ++i) {
+            double offspring[3];
+            for (int k = 0; k < 3; ++k) offspring[k] = solution[k] + random_normal() * sigma;
+            rotation_t A = transition({offspring[1], offspring[0]}, offspring[2]);
+            double objective = 0;
+            for (uint8_t j = 0; j < points_num; ++j) {
+                cartesian_t p = rotate(A, x[j]);
+                objective += (p.x - y[j].x) * (p.x - y[j].x) + (p.y - y[j].y) * (p.y - y[j].y) + (p.z - y[j].z) * (p.z - y[j].z);
+            }
+            double fitness = 1.0 / (objective + 1.0);
+            if (best_fitness < fitness) {
+                best_fitness = fitness;
+                memcpy(best_offspring, offspring, sizeof(offspring));
+            }
+        }
+        memcpy(solution, best_offspring, sizeof(best_offspring));
+        if (best_fitness > OPT_PRECISION) break;
+        sigma *= OPT_SIGMA_DECAY;
+    }
+}
+
+// RMS of angles (arcsec) between stars turned by the fitted rotation and orientations of the mount
+static double residual(const rotation_t& fit, const cartesian_t x[], const cartesian_t y[], uint8_t points_num) {
+    double sum = 0;
+    for (uint8_t i = 0; i < points_num; ++i) {
+        double a = angle(rotate(fit, x[i]), y[i]);
+        sum += a * a;
+    }
+    return sqrt(sum / points_num);
+}
+
+struct result_t {
+    const char* name;
+    double total_us = 0;
+    double worst_us = 0;
+    double residual = 0;
+    double worst_residual = 0;
+    double error = 0;  // angle between the fitted and the true pole
+    double worst_error = 0;
+
+    void add(double us, double r, double e) {
+        total_us += us;
+        worst_us = max(worst_us, us);
+        residual += r;
+        worst_residual = max(worst_residual, r);
+        error += e;
+        worst_error = max(worst_error, e);
+    }
+
+    void print(int trials) const {
+        printf("%-14s %-12.1f %-12.1f %-15.2f %-15.2f %-15.2f %.2f\n", name, total_us / trials, worst_us,
+               residual / trials, worst_residual, error / trials, worst_error);
+    }
+};
+
+int main(int argc, char** argv) {
+    int trials = argc > 1 ? atoi(argv[1]) : 200;
+    double noise = argc > 2 ? atof(argv[2]) : 30;
+    int stars = argc > 3 ? constrain(atoi(argv[3]), 3, CAL_BUFFER_SIZE) : 4;
+    srand(42);
+
+    MountController mount(MotorController::instance());
+    result_t closed, evolved;
+    closed.name = "closed form";
+    evolved.name = "evolutionary";
+
+    for (int t = 0; t < trials; ++t) {
+        // a mount roughly aligned or not at all
+        coord_t pole = t % 2 ? coord_t { 90 - uniform() * 10, uniform() * 360 } : coord_t { uniform() * 180 - 90, uniform() * 360 };
+        double ra_offset = uniform() * 360;
+        rotation_t truth = transition(pole, ra_offset);
+
+        coord_t kernel[CAL_BUFFER_SIZE], image[CAL_BUFFER_SIZE];
+        cartesian_t x[CAL_BUFFER_SIZE], y[CAL_BUFFER_SIZE];
+        for (int i = 0; i < stars; ++i) {
+            kernel[i] = { asin(uniform() * 2 - 1) * RAD_TO_DEG, uniform() * 360 };
+            x[i] = to_cartesian(kernel[i]);
+            cartesian_t p = rotate(truth, x[i]);
+            // the mount points off by a random error
+            double e = noise / 3600 * DEG_TO_RAD;
+            p = { p.x + random_normal() * e, p.y + random_normal() * e, p.z + random_normal() * e };
+            double norm = sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+            y[i] = { p.x / norm, p.y / norm, p.z / norm };
+            image[i] = { asin(y[i].z) * RAD_TO_DEG, fmod(atan2(y[i].y, y[i].x) * RAD_TO_DEG + 360, 360) };
+        }
+        cartesian_t true_pole = to_cartesian(pole);
+
+        auto start = std::chrono::steady_clock::now();
+        mount.all_star_alignment(kernel, image, stars);
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        coord_t fitted;
+        double fitted_offset;
+        mount.get_mount_pole(fitted, fitted_offset);
+        closed.add(us, residual(transition(fitted, fitted_offset), x, y, stars), angle(to_cartesian(fitted), true_pole));
+
+        double solution[3];
+        start = std::chrono::steady_clock::now();
+        evolutionary_alignment(x, y, stars, solution);
+        us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        // the strategy does not keep DEC of the pole within -90..90, the rotation is the same with the other one
+        double dec = fmod(solution[1] + 540, 360) - 180;
+        if (fabs(dec) > 90) {
+            dec = (dec > 0 ? 180 : -180) - dec;
+            solution[0] += 180;
+            solution[2] += 180;
+        }
+        fitted = { dec, fmod(solution[0], 360) };
+        evolved.add(us, residual(transition(fitted, solution[2]), x, y, stars), angle(to_cartesian(fitted), true_pole));
+    }
+
+    printf("%d trials, %d stars, pointing error %.1f arcsec\n\n", trials, stars, noise);
+    printf("solver         mean (us)    max (us)     residual (\")   worst res. (\")  pole error (\")  worst pole (\")\n");
+    closed.print(trials);
+    evolved.print(trials);
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <Arduino.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "../config.h"
+#include "../core/histogram.h"
+#include "../core/motor_controller.h"
+
+// Benchmark of reading positions while the step engine runs, the seqlock snapshot of get_position
+// against the lock which the engine used to hold for the whole tick and position readers took as
+// well. The engine ticks every TMR_RESOLUTION µs of the host clock in a thread and slews, readers
+// poll the position in other threads as fast as they can, like LX200, the UI and tracking did.
+//
+//     position_bench [seconds] [readers]
+
+typedef std::chrono::steady_clock host_clock;
+
+static std::atomic<bool> running {false};
+
+static uint64_t elapsed_ns(host_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(host_clock::now() - since).count();
+}
+
+// value below which 'fraction' of values of the histogram lie (upper bound of the bucket)
+static uint32_t percentile(const log2_histogram& h, double fraction) {
+    uint64_t total = 0, seen = 0;
+    for (uint8_t i = 0; i < log2_histogram::BUCKETS; ++i) total += h.counts[i];
+    for (uint8_t i = 0; i < log2_histogram::BUCKETS; ++i) {
+        seen += h.counts[i];
+        if (seen >= fraction * total) return i + 1 < log2_histogram::BUCKETS ? log2_histogram::bucket_min(i + 1) : h.max;
+    }
+    return h.max;
+}
+
+static uint64_t total(const log2_histogram& h) {
+    uint64_t sum = 0;
+    for (uint8_t i = 0; i < log2_histogram::BUCKETS; ++i) sum += h.counts[i];
+    return sum;
+}
+
+struct run_t {
+    log2_histogram engine_wait;  // time (ns) the engine waited before it could tick
+    uint64_t ticks;
+};
+
+static void engine(std::mutex* lock, run_t& run) {
+    MotorController& motors = MotorController::instance();
+    host_clock::time_point start = host_clock::now();
+    host_clock::time_point tick = start;
+    while (running.load(std::memory_order_relaxed)) {
+        tick += std::chrono::microseconds(TMR_RESOLUTION);
+        std::this_thread::sleep_until(tick);
+        host_clock::time_point woken = host_clock::now();
+        if (lock != NULL) lock->lock();
+        run.engine_wait.add(elapsed_ns(woken));
+        motors.trigger(elapsed_ns(start) / 1000);
+        if (lock != NULL) lock->unlock();
+        ++run.ticks;
+    }
+}
+
+// 'reads' gets the duration (ns) of every read, 'last_dec' keeps the read position
+static void reader(std::mutex* lock, log2_histogram& reads, long& last_dec) {
+    MotorController& motors = MotorController::instance();
+    MotorController::position_t position;
+    while (running.load(std::memory_order_relaxed)) {
+        host_clock::time_point start = host_clock::now();
+        if (lock != NULL) lock->lock();
+        motors.get_position(position);
+        if (lock != NULL) lock->unlock();
+        reads.add(elapsed_ns(start));
+        last_dec = position.dec;
+    }
+}
+
+static void measure(const char* name, bool locked, double seconds, int readers) {
+    MotorController& motors = MotorController::instance();
+    std::mutex lock;
+    run_t run = {};
+    log2_histogram reads[8] = {};
+    long last[8] = {};
+
+    // a slew keeps the engine publishing new positions
+    motors.set_velocity(5, -5, false);
+    running = true;
+    std::thread engine_thread(engine, locked ? &lock : NULL, std::ref(run));
+    std::thread reader_threads[8];
+    for (int i = 0; i < readers; ++i) reader_threads[i] = std::thread(reader, locked ? &lock : NULL, std::ref(reads[i]), std::ref(last[i]));
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running = false;
+    engine_thread.join();
+    for (int i = 0; i < readers; ++i) reader_threads[i].join();
+    motors.emergency_stop();
+    motors.trigger(0);
+
+    log2_histogram all = {};
+    for (int i = 0; i < readers; ++i) {
+        for (uint8_t b = 0; b < log2_histogram::BUCKETS; ++b) all.counts[b] += reads[i].counts[b];
+        all.max = max(all.max, reads[i].max);
+    }
+    printf("%-9s  %-10.0f  %-6u  %-6u  %-9u  %-10.0f  %-6u  %-6u  %u\n", name, total(all) / seconds, percentile(all, 0.5), percentile(all, 0.99),
+           all.max, run.ticks / seconds, percentile(run.engine_wait, 0.5), percentile(run.engine_wait, 0.99), run.engine_wait.max);
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+    int readers = argc > 2 ? constrain(atoi(argv[2]), 1, 8) : 2;
+
+    MotorController::instance().initialize();
+
+    printf("%d readers, %.1f s each, %u host CPUs\n\n", readers, seconds, std::thread::hardware_concurrency());
+    printf("           reads of the position (ns)         ticks of the engine, wait before them (ns)\n");
+    printf("position   reads/s     p50 <   p99 <   max        ticks/s     p50 <   p99 <   max\n");
+    measure("locked", true, seconds, readers);
+    measure("seqlock", false, seconds, readers);
+    return 0;
+}
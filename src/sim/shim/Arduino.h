@@ -0,0 +1,74 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+// Host stand-in of the Arduino core for the simulator (HOST_BUILD), time is the virtual
+// time of the simulator, so everything which waits or measures time follows it
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp32-hal-timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+namespace sim {
+    // virtual time (µs) of the simulator
+    uint64_t now();
+    // lets the virtual time pass, the step engine runs meanwhile
+    void sleep(uint64_t us);
+    // CPU frequency (MHz) set by the power task
+    uint32_t& cpu_mhz();
+}
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH    1
+#define LOW     0
+#define OUTPUT  1
+#define INPUT   0
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+#ifndef PI
+#define PI      3.1415926535897932384626433832795
+#endif
+
+using std::min;
+using std::max;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+inline unsigned long millis() { return sim::now() / 1000; }
+inline unsigned long micros() { return sim::now(); }
+inline void delay(unsigned long ms) { sim::sleep(ms * 1000ULL); }
+inline long random(long low, long high) { return high > low ? low + rand() % (high - low) : low; }
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return 0; }
+
+inline uint32_t getCpuFrequencyMhz() { return sim::cpu_mhz(); }
+inline bool setCpuFrequencyMhz(uint32_t mhz) { sim::cpu_mhz() = mhz; return true; }
+inline bool heap_caps_check_integrity_all(bool) { return true; }
+
+#ifdef SIM_LOG
+#define log_e(format, ...) printf("E " format "\n", ##__VA_ARGS__)
+#define log_w(format, ...) printf("W " format "\n", ##__VA_ARGS__)
+#define log_i(format, ...) printf("I " format "\n", ##__VA_ARGS__)
+#define log_d(format, ...) printf("D " format "\n", ##__VA_ARGS__)
+#define log_v(format, ...) printf("V " format "\n", ##__VA_ARGS__)
+#else
+#define log_e(format, ...) do {} while (0)
+#define log_w(format, ...) do {} while (0)
+#define log_i(format, ...) do {} while (0)
+#define log_d(format, ...) do {} while (0)
+#define log_v(format, ...) do {} while (0)
+#endif
+
+#endif
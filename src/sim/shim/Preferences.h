@@ -0,0 +1,46 @@
+#ifndef SIM_PREFERENCES_H
+#define SIM_PREFERENCES_H
+
+#include <stddef.h>
+#include <string.h>
+#include <map>
+#include <string>
+
+// NVS of the simulator lives as long as the process, keys are prefixed by their namespace
+class Preferences {
+
+    public:
+
+        bool begin(const char* name, bool read_only = false) {
+            _name = name;
+            _read_only = read_only;
+            return true;
+        }
+
+        void end() {}
+
+        size_t getBytes(const char* key, void* buf, size_t max_len) {
+            std::map<std::string, std::string>::const_iterator it = store().find(_name + "/" + key);
+            if (it == store().end() || it->second.size() > max_len) return 0;
+            memcpy(buf, it->second.data(), it->second.size());
+            return it->second.size();
+        }
+
+        size_t putBytes(const char* key, const void* value, size_t len) {
+            if (_read_only) return 0;
+            store()[_name + "/" + key].assign((const char*)value, len);
+            return len;
+        }
+
+    private:
+
+        static std::map<std::string, std::string>& store() {
+            static std::map<std::string, std::string> values;
+            return values;
+        }
+
+        std::string _name;
+        bool _read_only = false;
+};
+
+#endif
@@ -0,0 +1,18 @@
+#include <Arduino.h>
+#include <RTClib.h>
+
+uint32_t RTC_Millis::lastUnix;
+uint32_t RTC_Millis::lastMillis;
+
+void RTC_Millis::adjust(const DateTime& dt) {
+    lastMillis = millis();
+    lastUnix = dt.unixtime();
+}
+
+// whole seconds are moved to the unix time, the rest stays in milliseconds like in RTClib
+DateTime RTC_Millis::now() {
+    uint32_t elapsed = (millis() - lastMillis) / 1000;
+    lastMillis += elapsed * 1000;
+    lastUnix += elapsed;
+    return DateTime(lastUnix);
+}
@@ -0,0 +1,95 @@
+#ifndef SIM_RTCLIB_H
+#define SIM_RTCLIB_H
+
+// Host stand-in of the parts of RTClib used by the clock, calendar math is the real one
+// because the local sidereal time depends on it, RTC_Millis follows the virtual time
+
+#include <stdint.h>
+
+#define SECONDS_FROM_1970_TO_2000 946684800
+
+class TimeSpan {
+    public:
+        TimeSpan(int32_t seconds = 0) : _seconds(seconds) {}
+        TimeSpan(int16_t days, int8_t hours, int8_t minutes, int8_t seconds)
+            : _seconds((int32_t)days * 86400L + (int32_t)hours * 3600 + (int32_t)minutes * 60 + seconds) {}
+
+        int16_t days() const { return _seconds / 86400L; }
+        int8_t hours() const { return _seconds / 3600 % 24; }
+        int8_t minutes() const { return _seconds / 60 % 60; }
+        int8_t seconds() const { return _seconds % 60; }
+        int32_t totalseconds() const { return _seconds; }
+
+        TimeSpan operator+(const TimeSpan& right) const { return TimeSpan(_seconds + right._seconds); }
+        TimeSpan operator-(const TimeSpan& right) const { return TimeSpan(_seconds - right._seconds); }
+
+    private:
+        int32_t _seconds;
+};
+
+class DateTime {
+    public:
+        DateTime(uint32_t t = SECONDS_FROM_1970_TO_2000) {
+            uint32_t days = t / 86400L;
+            uint32_t rest = t % 86400L;
+            _hh = rest / 3600;
+            _mm = rest / 60 % 60;
+            _ss = rest % 60;
+            civil_from_days(days, _y, _m, _d);
+        }
+
+        DateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour = 0, uint8_t min = 0, uint8_t sec = 0)
+            : _y(year < 100 ? year + 2000 : year), _m(month), _d(day), _hh(hour), _mm(min), _ss(sec) {}
+
+        uint16_t year() const { return _y; }
+        uint8_t month() const { return _m; }
+        uint8_t day() const { return _d; }
+        uint8_t hour() const { return _hh; }
+        uint8_t minute() const { return _mm; }
+        uint8_t second() const { return _ss; }
+
+        uint32_t unixtime() const { return days_from_civil(_y, _m, _d) * 86400L + _hh * 3600L + _mm * 60L + _ss; }
+        uint32_t secondstime() const { return unixtime() - SECONDS_FROM_1970_TO_2000; }
+
+        DateTime operator+(const TimeSpan& span) const { return DateTime(unixtime() + span.totalseconds()); }
+        DateTime operator-(const TimeSpan& span) const { return DateTime(unixtime() - span.totalseconds()); }
+        TimeSpan operator-(const DateTime& right) const { return TimeSpan(unixtime() - right.unixtime()); }
+
+    private:
+        // days since 1970-01-01 of the proleptic Gregorian calendar, see H. Hinnant's algorithms
+        static uint32_t days_from_civil(int32_t y, uint32_t m, uint32_t d) {
+            y -= m <= 2;
+            int32_t era = y / 400;
+            uint32_t yoe = y - era * 400;
+            uint32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+            uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+            return era * 146097 + doe - 719468;
+        }
+
+        static void civil_from_days(uint32_t days, uint16_t& y, uint8_t& m, uint8_t& d) {
+            uint32_t z = days + 719468;
+            uint32_t era = z / 146097;
+            uint32_t doe = z - era * 146097;
+            uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+            uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+            uint32_t mp = (5 * doy + 2) / 153;
+            d = doy - (153 * mp + 2) / 5 + 1;
+            m = mp < 10 ? mp + 3 : mp - 9;
+            y = yoe + era * 400 + (m <= 2);
+        }
+
+        uint16_t _y;
+        uint8_t _m, _d, _hh, _mm, _ss;
+};
+
+class RTC_Millis {
+    public:
+        static void adjust(const DateTime& dt);
+        static DateTime now();
+
+    protected:
+        static uint32_t lastUnix;
+        static uint32_t lastMillis;
+};
+
+#endif
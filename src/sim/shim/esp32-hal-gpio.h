@@ -0,0 +1,6 @@
+#ifndef SIM_ESP32_HAL_GPIO_H
+#define SIM_ESP32_HAL_GPIO_H
+
+// pins of stepper drivers are mocked by fast_pin.h (HOST_BUILD), see Arduino.h for the rest
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef SIM_ESP32_HAL_TIMER_H
+#define SIM_ESP32_HAL_TIMER_H
+
+#include <stdint.h>
+
+// the simulator calls MotorController::trigger by itself, so the step timer is never used
+typedef struct hw_timer_s hw_timer_t;
+
+inline hw_timer_t* timerBegin(uint8_t, uint16_t, bool) { return NULL; }
+inline void timerAttachInterrupt(hw_timer_t*, void (*)(), bool) {}
+inline void timerAlarmWrite(hw_timer_t*, uint64_t, bool) {}
+inline void timerAlarmEnable(hw_timer_t*) {}
+inline void timerAlarmDisable(hw_timer_t*) {}
+inline uint64_t timerRead(hw_timer_t*) { return 0; }
+
+#endif
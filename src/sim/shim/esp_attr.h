@@ -0,0 +1,8 @@
+#ifndef SIM_ESP_ATTR_H
+#define SIM_ESP_ATTR_H
+
+// memory placement means nothing on the host
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef SIM_ESP_SPI_FLASH_H
+#define SIM_ESP_SPI_FLASH_H
+
+// there is no flash cache on the host, so the step engine is never stalled by it
+inline bool spi_flash_cache_enabled() { return true; }
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef SIM_ESP_TIMER_H
+#define SIM_ESP_TIMER_H
+
+#include <stdint.h>
+
+namespace sim { uint64_t now(); }
+
+inline int64_t esp_timer_get_time() { return sim::now(); }
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef SIM_FREERTOS_H
+#define SIM_FREERTOS_H
+
+#include <stdint.h>
+#include "portmacro.h"
+
+#endif
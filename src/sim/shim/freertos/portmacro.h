@@ -0,0 +1,15 @@
+#ifndef SIM_PORTMACRO_H
+#define SIM_PORTMACRO_H
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE                 0
+#define pdTRUE                  1
+#define portMAX_DELAY           0xFFFFFFFF
+#define portTICK_PERIOD_MS      1
+#define portYIELD_FROM_ISR()
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIM_PROJDEFS_H
+#define SIM_PROJDEFS_H
+
+#include "portmacro.h"
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef SIM_TASK_H
+#define SIM_TASK_H
+
+#include <stdint.h>
+#include "portmacro.h"
+
+namespace sim { void sleep(uint64_t us); }
+
+// there is just the task of the simulator, the step engine is called by it, so notifications
+// are not needed and waiting lets the virtual time pass while the engine runs
+typedef void* TaskHandle_t;
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return NULL; }
+inline void xTaskNotifyGive(TaskHandle_t) {}
+inline void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*) {}
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 1; }
+inline void vTaskDelay(TickType_t ticks) { sim::sleep(ticks * portTICK_PERIOD_MS * 1000ULL); }
+
+#endif
@@ -0,0 +1,199 @@
+#include <Arduino.h>
+#include <chrono>
+
+#include "../config.h"
+#include "../core/clock.h"
+#include "../core/motor_controller.h"
+#include "../core/mount_controller.h"
+#include "simulator.h"
+
+// Benchmark of scripted gotos on the simulator, reports the host cost of trigger calls and
+// the pointing error once the mount gets to the target and after it tracked the target.
+// The script has a goto per line, "DEC RA [seconds of tracking]", no tracking if omitted.
+// Slews of DEC along its ramp table are compared with the stair ramp which it replaced.
+//
+//     sim_bench [script] [max latency of wake ups (µs)]
+
+using namespace sim;
+
+struct goto_t { double dec; double ra; double track; };
+
+// info_task of Star_Tracker.cpp goes there and back without tracking, the rest is tracked
+static const goto_t DEFAULT_SCRIPT[] = {
+    { 90, 0, 0 }, { -20, 0, 0 }, { 90, 0, 0 }, { -20, 0, 0 },
+    { 41.27, 10.68, 60 }, { 22.01, 83.63, 60 }, { -5.39, 83.82, 60 }, { 45.99, 79.17, 60 },
+    { 7.41, 88.79, 60 }, { 38.78, 279.23, 60 }, { 89.26, 37.95, 60 }, { -16.72, 101.29, 60 },
+};
+
+// DEC revolutions of slews compared with the stairs
+static const double RAMP_SLEWS[] = { 0.05, 0.25, 1, 4, 16 };
+
+// the replaced stair ramp, a model of the old motor_trigger and change_motor_speed without the lock and pins,
+// they ran every TMR_RESOLUTION µs, the delay changed by ACCEL_DELAY_DEC every ACCEL_STEPS_DEC steps
+struct stairs_t {
+    uint32_t pulses_remaining;
+    uint32_t steps_total;
+    uint32_t pulses_to_accel = 0;
+    uint32_t inactive_us = 0;
+    uint32_t current_delay = FAST_DELAY_START_DEC;
+
+    stairs_t(uint32_t steps) : pulses_remaining(steps * 2), steps_total(steps) {}
+
+    // returns true if the tick did a pulse
+    bool tick() {
+        bool pulse = false;
+        if (pulses_remaining > 0) {
+            inactive_us += TMR_RESOLUTION;
+            if (inactive_us >= current_delay) {
+                ++pulses_to_accel;
+                --pulses_remaining;
+                inactive_us = 0;
+                pulse = true;
+            }
+        }
+        if (pulses_to_accel >= ACCEL_STEPS_DEC * 2) {
+            if (pulses_remaining > steps_total) {
+                if (current_delay > FAST_DELAY_END_DEC) current_delay -= ACCEL_DELAY_DEC;
+            }
+            else if ((FAST_DELAY_START_DEC - current_delay) / ACCEL_DELAY_DEC >= pulses_remaining / (ACCEL_STEPS_DEC * 2)) {
+                if (current_delay < FAST_DELAY_START_DEC) current_delay += ACCEL_DELAY_DEC;
+            }
+            pulses_to_accel = 0;
+        }
+        return pulse;
+    }
+};
+
+// time (µs) from the first pulse to the last one and cost of ticks of a slew by the stairs
+static double stairs_slew(double revs, uint64_t& ticks, double& ns) {
+    stairs_t stairs(revs * STEPS_PER_REV_DEC);
+    uint64_t first = 0, last = 0;
+    ticks = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (stairs.pulses_remaining > 0) {
+        ++ticks;
+        if (!stairs.tick()) continue;
+        if (first == 0) first = ticks;
+        last = ticks;
+    }
+    ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return (double)(last - first) * TMR_RESOLUTION;
+}
+
+static void compare_ramps(Simulator& s, MotorController& motors) {
+    printf("\nDEC slews, stairs ticked every %d us (a model without the lock and pins) against ramp tables\n", TMR_RESOLUTION);
+    printf("revs    stairs (s)  ticks     ns/tick  tables (s)  ticks     ns/tick  faster\n");
+    for (double revs : RAMP_SLEWS) {
+        uint64_t stairs_ticks;
+        double stairs_ns;
+        double stairs_us = stairs_slew(revs, stairs_ticks, stairs_ns);
+
+        s.record_edges(true);
+        s.reset_tick_cost();
+        motors.fast_turn(revs, 0, false);
+        s.run_idle(600000000ULL);
+        const std::vector<edge_t>& edges = s.edges();
+        double tables_us = edges.empty() ? 0 : edges.back().time_us - edges.front().time_us;
+
+        printf("%-6.2f  %-10.3f  %-8llu  %-7.1f  %-10.3f  %-8llu  %-7.1f  %.2fx\n", revs, stairs_us / 1e6, (unsigned long long)stairs_ticks,
+               stairs_ns / stairs_ticks, tables_us / 1e6, (unsigned long long)s.ticks(), s.ticks() ? (double)s.tick_total_ns() / s.ticks() : 0.0,
+               tables_us > 0 ? stairs_us / tables_us : 0.0);
+    }
+    s.record_edges(false);
+}
+
+static uint8_t load_script(const char* path, goto_t* script, uint8_t capacity) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return 0;
+    uint8_t n = 0;
+    char line[128];
+    while (n < capacity && fgets(line, sizeof(line), f) != NULL) {
+        goto_t g = { 0, 0, 0 };
+        if (sscanf(line, "%lf %lf %lf", &g.dec, &g.ra, &g.track) >= 2) script[n++] = g;
+    }
+    fclose(f);
+    return n;
+}
+
+int main(int argc, char** argv) {
+    goto_t script[64];
+    uint8_t steps = argc > 1 ? load_script(argv[1], script, 64) : 0;
+    if (steps == 0) {
+        steps = sizeof(DEFAULT_SCRIPT) / sizeof(goto_t);
+        memcpy(script, DEFAULT_SCRIPT, sizeof(DEFAULT_SCRIPT));
+    }
+
+    Simulator& s = Simulator::instance();
+    s.initialize();
+    if (argc > 2) s.set_latency(atoi(argv[2]));
+    srand(42);
+
+    SubSecondRTC::adjust(2024, 3, 20, 20, 0, 0);
+    Clock::recalc_LST_offset(LONGITUDE);
+
+    MotorController& motors = MotorController::instance();
+    MountController mount(motors);
+    mount.initialize();
+
+    double worst_goto = 0, worst_tracked = 0;
+    uint64_t planning_ns = 0;
+
+    auto wall = std::chrono::steady_clock::now();
+    printf("target DEC  target RA   goto (s)  ticks     ns/tick  error after goto (arcsec)  error tracked (arcsec)\n");
+    for (uint8_t i = 0; i < steps; ++i) {
+        const goto_t& g = script[i];
+        uint64_t start = s.now();
+        uint64_t ticks = s.ticks(), ticks_ns = s.tick_total_ns();
+
+        // planning of the goto runs in the producer, the main loop polls the tracking meanwhile
+        auto planned = std::chrono::steady_clock::now();
+        mount.move_absolute(g.dec, g.ra);
+        planning_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - planned).count();
+        if (g.track > 0) mount.set_tracking();
+
+        while (mount.is_moving()) {
+            mount.update_tracking();
+            s.run_for(TRACKING_POLL * 1000ULL);
+        }
+        double goto_time = (s.now() - start) / 1e6;
+        double goto_error = separation(mount.get_global_mount_orientation(), {g.dec, g.ra});
+        uint64_t goto_ticks = s.ticks() - ticks;
+        double goto_ns = goto_ticks ? (double)(s.tick_total_ns() - ticks_ns) / goto_ticks : 0;
+
+        double tracked_error = 0;
+        if (g.track > 0) {
+            uint64_t end = s.now() + (uint64_t)(g.track * 1e6);
+            while (s.now() < end) {
+                mount.update_tracking();
+                s.run_for(TRACKING_POLL * 1000ULL);
+            }
+            tracked_error = separation(mount.get_global_mount_orientation(), {g.dec, g.ra});
+            mount.stop_tracking();
+            s.run_idle(60000000ULL);
+        }
+
+        worst_goto = max(worst_goto, goto_error);
+        worst_tracked = max(worst_tracked, tracked_error);
+
+        printf("%-10.2f  %-10.2f  %-8.2f  %-8llu  %-7.0f  %-25.1f  ", g.dec, g.ra, goto_time, (unsigned long long)goto_ticks, goto_ns, goto_error);
+        if (g.track > 0) printf("%.1f\n", tracked_error);
+        else printf("-\n");
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+
+    const log2_histogram& cost = s.tick_cost();
+    printf("\nticks      ns/tick (mean)  p50 <  p99 <  max ns  histogram of ns per tick\n");
+    printf("%-9llu  %-14.1f  %-5u  %-5u  %-6u ", (unsigned long long)s.ticks(), s.ticks() ? (double)s.tick_total_ns() / s.ticks() : 0.0,
+           s.tick_percentile(0.5), s.tick_percentile(0.99), cost.max);
+    for (uint8_t b = 0; b < log2_histogram::BUCKETS; ++b) {
+        if (cost.counts[b] != 0) printf(" %u+:%u", log2_histogram::bucket_min(b), cost.counts[b]);
+    }
+    printf("\n\n");
+    s.print_axes(stdout);
+    printf("\nplanning of a goto %.1f us, worst error after goto %.1f arcsec, worst tracked error %.1f arcsec\n",
+           planning_ns / 1e3 / steps, worst_goto, worst_tracked);
+    printf("simulated %.1f s in %.2f s\n", s.now() / 1e6, elapsed);
+
+    compare_ramps(s, motors);
+    return 0;
+}
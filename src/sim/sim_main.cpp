@@ -0,0 +1,79 @@
+#include <Arduino.h>
+#include <chrono>
+
+#include "../config.h"
+#include "../core/clock.h"
+#include "../core/motor_controller.h"
+#include "../core/mount_controller.h"
+#include "simulator.h"
+
+// Simulated night of the mount, gotos to random targets which are tracked for a while and
+// the focuser moving meanwhile, prints what drivers did and how the mount pointed.
+//
+//     sim [hours] [edges.csv]
+
+using namespace sim;
+
+static const double TRACK_MINUTES = 20;
+
+int main(int argc, char** argv) {
+    double hours = argc > 1 ? atof(argv[1]) : 8;
+    FILE* csv = argc > 2 ? fopen(argv[2], "w") : NULL;
+
+    Simulator& s = Simulator::instance();
+    s.initialize(csv);
+    srand(42);
+
+    SubSecondRTC::adjust(2024, 3, 20, 20, 0, 0);
+    Clock::recalc_LST_offset(LONGITUDE);
+
+    MotorController& motors = MotorController::instance();
+    MountController mount(motors);
+    mount.initialize();
+
+    auto wall = std::chrono::steady_clock::now();
+    uint64_t end = (uint64_t)(hours * 3600e6);
+    uint32_t gotos = 0;
+    double worst = 0;
+
+    printf("time (s)   target DEC  target RA   goto (s)  error after goto (arcsec)  error tracked (arcsec)\n");
+    while (s.now() < end) {
+        MountController::coord_t target = { (double)random(-20, 80), random(0, 3600) / 10.0 };
+        uint64_t start = s.now();
+        mount.move_absolute(target.dec, target.ra);
+        mount.set_tracking();
+        motors.aux_move(AXIS_FOCUS, random(-50, 50) / 10.0);
+
+        // the main loop of the firmware polls the tracking like this
+        while (mount.is_moving() && s.now() < end) {
+            mount.update_tracking();
+            s.run_for(TRACKING_POLL * 1000ULL);
+        }
+        double goto_error = separation(mount.get_global_mount_orientation(), target);
+        double goto_time = (s.now() - start) / 1e6;
+
+        uint64_t track_end = min(s.now() + (uint64_t)(TRACK_MINUTES * 60e6), end);
+        while (s.now() < track_end) {
+            mount.update_tracking();
+            s.run_for(TRACKING_POLL * 1000ULL);
+        }
+        double tracked_error = separation(mount.get_global_mount_orientation(), target);
+        worst = max(worst, tracked_error);
+        ++gotos;
+
+        printf("%-9.1f  %-10.2f  %-10.2f  %-8.2f  %-25.1f  %.1f\n", start / 1e6, target.dec, target.ra, goto_time, goto_error, tracked_error);
+    }
+
+    mount.stop_all();
+    s.run_idle(60000000ULL);
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+    printf("\n");
+    s.print_axes(stdout);
+    printf("\n%u gotos, worst tracking error %.1f arcsec\n", gotos, worst);
+    printf("simulated %.2f h in %.2f s (%.0fx real time), %llu ticks, %.0f ns per tick\n", s.now() / 3600e6, elapsed,
+           s.now() / 1e6 / elapsed, (unsigned long long)s.ticks(), s.ticks() ? (double)s.tick_total_ns() / s.ticks() : 0.0);
+
+    if (csv != NULL) fclose(csv);
+    return 0;
+}
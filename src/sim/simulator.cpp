@@ -0,0 +1,179 @@
+#include <Arduino.h>
+#include <chrono>
+
+#include "simulator.h"
+
+namespace sim {
+
+uint64_t now() { return Simulator::instance().now(); }
+
+void sleep(uint64_t us) { Simulator::instance().run_for(us); }
+
+uint32_t& cpu_mhz() {
+    static uint32_t mhz = 240;
+    return mhz;
+}
+
+void Simulator::initialize(FILE* csv) {
+    _now = 0;
+    _next = 0;
+    _power_wake = 0;
+    _csv = csv;
+    cpu_mhz() = 240;
+    record_edges(false);
+    reset_tick_cost();
+
+    const axis_record_t axes[SIM_AXES] = {
+        { "dec", STEP_PIN_DEC, DIR_PIN_DEC, MS_PIN_DEC, DIRECTION_DEC, STEPS_PER_REV_DEC },
+        { "ra", STEP_PIN_RA, DIR_PIN_RA, MS_PIN_RA, DIRECTION_RA, STEPS_PER_REV_RA },
+        { "focus", STEP_PIN_FOCUS, DIR_PIN_FOCUS, MS_PIN_FOCUS, DIRECTION_FOCUS, STEPS_PER_REV_FOCUS },
+        { "rotator", STEP_PIN_ROTATOR, DIR_PIN_ROTATOR, MS_PIN_ROTATOR, DIRECTION_ROTATOR, STEPS_PER_REV_ROTATOR },
+    };
+    memset(_pins, -1, sizeof(_pins));
+    for (uint8_t i = 0; i < SIM_AXES; ++i) {
+        _axes[i] = axes[i];
+        _axes[i].min_interval_us = UINT32_MAX;
+        if (_axes[i].steps_per_rev == 0) continue;
+        _pins[_axes[i].step_pin] = i;
+        _pins[_axes[i].dir_pin] = i;
+        _pins[_axes[i].ms_pin] = i;
+    }
+
+    mock_gpio::on_change() = &Simulator::on_change;
+    // the power task starts with the frequency it finds
+    MotorController::instance().start();
+    power_task();
+    if (_csv != NULL) fprintf(_csv, "time_us,axis,level,microsteps\n");
+}
+
+void Simulator::on_change(uint8_t pin, uint8_t level) {
+    Simulator& s = instance();
+    if (s._pins[pin] < 0) return;
+    axis_record_t& axis = s._axes[s._pins[pin]];
+
+    if (pin == axis.dir_pin) {
+        ++axis.reversals;
+        return;
+    }
+    // the driver gets out of step if the mode changes between full step positions
+    if (pin == axis.ms_pin) {
+        ++axis.ms_switches;
+        if (axis.balance % (2 * MICROSTEPPING_MUL) != 0) ++axis.ms_off_grid;
+        return;
+    }
+    if (pin != axis.step_pin) return;
+
+    // like the engine, the balance changes at every edge and the driver moves at rising ones
+    const uint8_t* levels = mock_gpio::levels();
+    long increment = (MICROSTEPPING_MUL == 1 || levels[axis.ms_pin]) ? 1 : MICROSTEPPING_MUL;
+    if (levels[axis.dir_pin] != axis.dir_swap) increment = -increment;
+    axis.balance += increment;
+    if (level) axis.microsteps += increment;
+
+    if (axis.edges > 0 && s._now - axis.last_edge_us < axis.min_interval_us) {
+        axis.min_interval_us = s._now - axis.last_edge_us;
+    }
+    axis.last_edge_us = s._now;
+    ++axis.edges;
+    if (s._record_edges) s._edges.push_back({s._now, (uint8_t)(&axis - s._axes), level, axis.balance});
+
+    if (s._csv != NULL) fprintf(s._csv, "%llu,%s,%d,%ld\n", (unsigned long long)s._now, axis.name, level, axis.microsteps);
+}
+
+inline uint64_t Simulator::trigger(uint64_t now) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t next = MotorController::instance().trigger(now);
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    _tick_cost.add(min(ns, (uint64_t)UINT32_MAX));
+    _tick_total_ns += ns;
+    ++_ticks;
+    return next;
+}
+
+void Simulator::power_task() {
+    uint32_t wait_ms = MotorController::instance().set_power(_now / 1000);
+    _power_wake = wait_ms == 0 ? 0 : _now + wait_ms * 1000ULL;
+}
+
+void Simulator::motor_task() {
+    MotorController& motors = MotorController::instance();
+    _next = trigger(_now);
+    if (motors.account_power(_next, _now)) power_task();
+}
+
+void Simulator::run_until(uint64_t until) {
+    if (until < _now) return;
+
+    // producers might have pushed commands since the last run, so the engine wakes up like they woke it
+    motor_task();
+
+    while (_next != 0 || _power_wake != 0) {
+        uint64_t wake = _next == 0 ? UINT64_MAX : max(_next, _now);
+        if (_next != 0 && _latency_us != 0) wake += random(0, _latency_us + 1);
+        // the power task waits for the end of its hold meanwhile
+        if (_power_wake != 0 && _power_wake < wake) {
+            if (_power_wake > until) break;
+            _now = _power_wake;
+            power_task();
+            continue;
+        }
+        if (wake > until) break;
+        _now = wake;
+        motor_task();
+    }
+    _now = until;
+}
+
+bool Simulator::run_idle(uint64_t limit) {
+    MotorController& motors = MotorController::instance();
+    uint64_t end = _now + limit;
+    while (42) {
+        MotorController::position_t position;
+        motors.get_position(position);
+        if (motors.is_ready() && position.aux_active == 0) return true;
+        if (_now >= end) return false;
+        // polled like producers do, the engine might also wait for a timed segment
+        run_until(min(_now + IDLE_POLL_US, end));
+    }
+}
+
+double Simulator::revolutions(uint8_t i) const {
+    const axis_record_t& axis = _axes[i];
+    if (axis.steps_per_rev == 0) return 0;
+    return (double)axis.microsteps / axis.steps_per_rev / MICROSTEPPING_MUL;
+}
+
+long Simulator::balance_error(uint8_t i) const {
+    MotorController::position_t position;
+    MotorController::instance().get_position(position);
+    long balance = i == SIM_DEC ? position.dec : i == SIM_RA ? position.ra : position.aux[i - 2];
+    return balance - _axes[i].balance;
+}
+
+uint32_t Simulator::tick_percentile(double fraction) const {
+    uint64_t seen = 0;
+    for (uint8_t i = 0; i < log2_histogram::BUCKETS; ++i) {
+        seen += _tick_cost.counts[i];
+        if (seen >= fraction * _ticks) return i + 1 < log2_histogram::BUCKETS ? log2_histogram::bucket_min(i + 1) : _tick_cost.max;
+    }
+    return _tick_cost.max;
+}
+
+void Simulator::reset_tick_cost() {
+    _tick_cost.clear();
+    _ticks = 0;
+    _tick_total_ns = 0;
+}
+
+void Simulator::print_axes(FILE* out) const {
+    fprintf(out, "axis      edges      revs         reversals  min interval (us)  balance error\n");
+    for (uint8_t i = 0; i < SIM_AXES; ++i) {
+        const axis_record_t& axis = _axes[i];
+        if (axis.steps_per_rev == 0) continue;
+        fprintf(out, "%-8s  %-9u  %-11.5f  %-9u  %-17u  %ld\n", axis.name, axis.edges, revolutions(i), axis.reversals,
+                axis.edges > 1 ? axis.min_interval_us : 0, balance_error(i));
+    }
+}
+
+}
@@ -0,0 +1,142 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <vector>
+
+#include "../config.h"
+#include "../core/histogram.h"
+#include "../core/motor_controller.h"
+#include "../core/mount_controller.h"
+
+// Host simulator of the step engine (HOST_BUILD, see the native env in platformio.ini). The time
+// is virtual, the engine is triggered exactly when it asks for it, so hours of slews and tracking
+// take seconds. Pins are mocked by fast_pin.h, every edge of a step pin is recorded as a pulse
+// of a driver which follows its direction and microstepping pins.
+
+namespace sim {
+
+// angle (arcsec) between two points of the sky, e.g. the target and the orientation of the mount
+inline double separation(MountController::coord_t a, MountController::coord_t b) {
+    double d_dec = (a.dec - b.dec) * DEG_TO_RAD;
+    double d_ra = (a.ra - b.ra) * DEG_TO_RAD;
+    double h = sin(d_dec / 2) * sin(d_dec / 2) + cos(a.dec * DEG_TO_RAD) * cos(b.dec * DEG_TO_RAD) * sin(d_ra / 2) * sin(d_ra / 2);
+    return 2 * asin(sqrt(min(h, 1.0))) * RAD_TO_DEG * 3600;
+}
+
+// what a driver did according to its pins
+struct axis_record_t {
+    const char* name;
+    uint8_t step_pin, dir_pin, ms_pin;
+    bool dir_swap;
+    uint32_t steps_per_rev;  // 0 if the axis is not wired
+    uint32_t edges;  // edges of the step pin, i.e. pulses of the engine
+    long balance;  // balance of edges counted like the engine does (pulses)
+    long microsteps;  // position of the driver, it moves at rising edges
+    uint32_t reversals;  // changes of the direction pin
+    uint64_t last_edge_us;
+    uint32_t min_interval_us;  // shortest time between two edges of the step pin
+    uint32_t ms_switches;  // changes of the microstepping pin
+    uint32_t ms_off_grid;  // those of them done out of full step positions of the driver
+};
+
+// an edge of a step pin
+struct edge_t {
+    uint64_t time_us;
+    uint8_t axis;
+    uint8_t level;
+    long balance;  // balance of the axis after the edge (pulses)
+};
+
+// driver axes in the order of MotorController::position_t, i.e. DEC, RA and auxiliary axes
+enum : uint8_t { SIM_DEC, SIM_RA, SIM_AXES = 2 + AUX_AXES };
+
+class Simulator {
+
+    public:
+
+        static Simulator& instance() {
+            static Simulator instance;
+            return instance;
+        }
+
+        // resets the virtual time and records, edges are written to 'csv' if given
+        void initialize(FILE* csv = NULL);
+
+        inline uint64_t now() const { return _now; }
+
+        // the engine wakes up later by up to 'max_us' (random), zero models a perfect timer
+        inline void set_latency(uint32_t max_us) { _latency_us = max_us; }
+
+        // lets the engine run until the virtual time 'until' (µs)
+        void run_until(uint64_t until);
+
+        inline void run_for(uint64_t us) { run_until(_now + us); }
+
+        // runs until all axes are done or until 'limit' passed, returns false on timeout,
+        // it checks that every IDLE_POLL_US
+        bool run_idle(uint64_t limit);
+
+        inline const axis_record_t& axis(uint8_t i) const { return _axes[i]; }
+
+        // edges of all step pins are kept from now on if 'enable', e.g. to check their timing
+        inline void record_edges(bool enable) {
+            _record_edges = enable;
+            _edges.clear();
+        }
+
+        inline const std::vector<edge_t>& edges() const { return _edges; }
+
+        // revolutions of the driver of the axis 'i' since the initialization
+        double revolutions(uint8_t i) const;
+
+        // difference between the balance published by the engine and pulses seen at pins (pulses)
+        long balance_error(uint8_t i) const;
+
+        // host time (ns) of a single trigger call, it includes recording of edges
+        inline const log2_histogram& tick_cost() const { return _tick_cost; }
+        inline uint64_t ticks() const { return _ticks; }
+        inline uint64_t tick_total_ns() const { return _tick_total_ns; }
+
+        // value below which 'fraction' of recorded tick costs lie (upper bound of the bucket)
+        uint32_t tick_percentile(double fraction) const;
+
+        void reset_tick_cost();
+
+        // prints records of all wired axes
+        void print_axes(FILE* out) const;
+
+    private:
+
+        static const uint64_t IDLE_POLL_US = 10000;
+
+        Simulator() {}
+
+        static void on_change(uint8_t pin, uint8_t level);
+
+        inline uint64_t trigger(uint64_t now);
+
+        // a wake up of the motor task, the power task runs after it like on the ESP32, where it has a lower priority
+        void motor_task();
+        void power_task();
+
+        uint64_t _now = 0;
+        uint64_t _next = 0;  // time of the next pulse asked for by the engine, 0 if idle
+        uint64_t _power_wake = 0;  // time when the power task wants to be woken up, 0 if it waits for a change of the demand
+        uint32_t _latency_us = 0;
+        FILE* _csv = NULL;
+        bool _record_edges = false;
+        std::vector<edge_t> _edges;
+
+        axis_record_t _axes[SIM_AXES];
+        int8_t _pins[64];  // axis of the pin or -1
+
+        log2_histogram _tick_cost;
+        uint64_t _ticks = 0;
+        uint64_t _tick_total_ns = 0;
+};
+
+}
+
+#endif
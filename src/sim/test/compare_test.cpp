@@ -0,0 +1,148 @@
+#include <Arduino.h>
+#include <vector>
+
+#include "../../config.h"
+#include "../../core/motor_controller.h"
+#include "../../core/canon_eos1000d.h"
+#include "../simulator.h"
+#include "test.h"
+
+// Position-compare events, the engine fires them at the pulse which gets the balance of their axis to
+// their position or over it, dispatch_events performs their actions.
+
+using namespace sim;
+
+static std::vector<MotorController::compare_event_t> fired;
+
+static void on_event(const MotorController::compare_event_t& event, void*) {
+    fired.push_back(event);
+}
+
+// performs fired events like the events task does, returns their number
+static uint32_t dispatch() {
+    fired.clear();
+    uint32_t performed = 0, n;
+    while ((n = MotorController::instance().dispatch_events(0)) > 0) performed += n;
+    return performed;
+}
+
+// fast turn of RA by 'pulses' to its end, a full step moves the balance by MICROSTEPPING_MUL
+static void turn_ra(long pulses) {
+    MotorController::instance().fast_turn(0, pulses / (2.0 * STEPS_PER_REV_RA * MICROSTEPPING_MUL), false);
+    CHECK(Simulator::instance().run_idle(60000000ULL), "the turn by %ld pulses did not end", pulses);
+}
+
+// time of the first recorded edge of the axis which got its balance to 'position' from below or from above
+static uint64_t reached(uint8_t axis, long position, bool up) {
+    for (const edge_t& edge : Simulator::instance().edges()) {
+        if (edge.axis == axis && (up ? edge.balance >= position : edge.balance <= position)) return edge.time_us;
+    }
+    return 0;
+}
+
+TEST(compare_crossing_both_directions) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    const long P = 1000L * MICROSTEPPING_MUL;
+
+    // forward over the position, the event carries the time of the pulse which got there
+    motors.compare_callback(0, SIM_RA, P, 0, &on_event, NULL);
+    s.record_edges(true);
+    turn_ra(3 * P);
+    CHECK(dispatch() == 1, "%zu events forward", fired.size());
+    if (fired.size() == 1) {
+        CHECK(fired[0].slot == 0 && fired[0].axis == SIM_RA && fired[0].position == P, "event of slot %u axis %u at %ld",
+              fired[0].slot, fired[0].axis, fired[0].position);
+        CHECK(fired[0].time_us == reached(SIM_RA, P, true), "fired at %llu us, RA got there at %llu us",
+              (unsigned long long)fired[0].time_us, (unsigned long long)reached(SIM_RA, P, true));
+    }
+    // it is not armed anymore
+    turn_ra(-3 * P);
+    turn_ra(3 * P);
+    CHECK(dispatch() == 0, "%zu events of the disarmed slot", fired.size());
+
+    // backward over the position
+    motors.compare_callback(1, SIM_RA, P, 0, &on_event, NULL);
+    s.record_edges(true);
+    turn_ra(-3 * P);
+    CHECK(dispatch() == 1, "%zu events backward", fired.size());
+    if (fired.size() == 1) {
+        CHECK(fired[0].slot == 1 && fired[0].time_us == reached(SIM_RA, P, false), "slot %u fired at %llu us, RA got there at %llu us",
+              fired[0].slot, (unsigned long long)fired[0].time_us, (unsigned long long)reached(SIM_RA, P, false));
+    }
+}
+
+TEST(compare_repeats_within_a_move) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    const long STEP = 200L * MICROSTEPPING_MUL;
+
+    // every STEP pulses from STEP / 2 on, both ways
+    motors.compare_callback(2, SIM_RA, STEP / 2, STEP, &on_event, NULL);
+    s.record_edges(true);
+    turn_ra(10 * STEP);
+    CHECK(dispatch() == 10, "%zu events of 10 forward", fired.size());
+    for (size_t i = 0; i < fired.size(); ++i) {
+        long position = STEP / 2 + i * STEP;
+        CHECK(fired[i].position == position, "event %zu at %ld instead of %ld", i, fired[i].position, position);
+        CHECK(fired[i].time_us == reached(SIM_RA, position, true), "event %zu fired at %llu us, RA got there at %llu us", i,
+              (unsigned long long)fired[i].time_us, (unsigned long long)reached(SIM_RA, position, true));
+    }
+
+    // a negative interval goes on backwards
+    motors.compare_callback(2, SIM_RA, 10 * STEP - STEP / 2, -STEP, &on_event, NULL);
+    turn_ra(-10 * STEP);
+    CHECK(dispatch() == 10, "%zu events of 10 backward", fired.size());
+    CHECK(!fired.empty() && fired.back().position == STEP / 2, "the last event at %ld", fired.empty() ? 0 : fired.back().position);
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+TEST(compare_at_current_balance) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    const long P = 500L * MICROSTEPPING_MUL;
+
+    // armed right where the axis stands, it fires without any pulse
+    turn_ra(P);
+    uint32_t edges = s.axis(SIM_RA).edges;
+    motors.compare_callback(3, SIM_RA, P, 0, &on_event, NULL);
+    s.run_for(1000ULL);
+    CHECK(dispatch() == 1 && fired[0].position == P, "%zu events at the balance", fired.size());
+    CHECK(s.axis(SIM_RA).edges == edges, "RA moved by %u edges", s.axis(SIM_RA).edges - edges);
+
+    // the other axis is not affected by it
+    motors.compare_callback(4, SIM_DEC, P, 0, &on_event, NULL);
+    s.run_for(1000ULL);
+    CHECK(dispatch() == 0, "%zu events of DEC at 0", fired.size());
+
+    // events of a slot which was armed again before they were dispatched are dropped
+    motors.compare_callback(3, SIM_RA, P, 0, &on_event, NULL);
+    s.run_for(1000ULL);
+    motors.compare_callback(3, SIM_RA, 2 * P, 0, &on_event, NULL);
+    s.run_for(1000ULL);
+    CHECK(dispatch() == 0, "%zu events of the rearmed slot", fired.size());
+}
+
+TEST(compare_camera_shots_and_disarm) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    const long STEP = 300L * MICROSTEPPING_MUL;
+
+    // :XCS arms shots every STEP pulses, the camera shoots at its next update, :XCC disarms them
+    CanonEOS1000D camera;
+    camera.shoot_at(SIM_RA, STEP, STEP, 1);
+    turn_ra(STEP + STEP / 2);
+    CHECK(motors.dispatch_events(0) == 1, "the first shot did not fire");
+    CHECK(camera.update(), "the camera does not shoot");
+
+    camera.stop_shooting_at();
+    s.run_for(3000000ULL);
+    CHECK(!camera.update(), "the camera still shoots");
+    turn_ra(5 * STEP);
+    CHECK(motors.dispatch_events(0) == 0, "shots fired after they were disarmed");
+    CHECK(!camera.update(), "the camera shoots after it was disarmed");
+}
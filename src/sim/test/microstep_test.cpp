@@ -0,0 +1,110 @@
+#include <Arduino.h>
+
+#include "../../config.h"
+#include "../../core/motor_controller.h"
+#include "../simulator.h"
+#include "test.h"
+
+// Movements with microsteps at both ends and full steps between them, the MS pin may be switched only
+// at full step positions of the driver, otherwise it gets out of step and the balance of the engine
+// does not match where the driver really is. Meaningful with MICROSTEPPING_MUL above 1 (native_test_micro).
+
+using namespace sim;
+
+// the driver moves at rising edges, movements never end between the edges of a step, so once motors stand
+// the driver is exactly where the balance says
+static void check_driver(const char* after) {
+    Simulator& s = Simulator::instance();
+    for (uint8_t i = SIM_DEC; i <= SIM_RA; ++i) {
+        const axis_record_t& axis = s.axis(i);
+        CHECK(axis.ms_off_grid == 0, "%s: %s switched MS %u times out of full step positions", after, axis.name, axis.ms_off_grid);
+        CHECK(axis.balance == 2 * axis.microsteps, "%s: %s balance %ld, the driver at %ld microsteps", after, axis.name,
+              axis.balance, axis.microsteps);
+        CHECK(s.balance_error(i) == 0, "%s: %s balance error %ld", after, axis.name, s.balance_error(i));
+    }
+}
+
+// revolutions which end between full steps
+static double off_grid(double revs, uint32_t steps_per_rev) {
+    return revs + 3.0 / MICROSTEPPING_MUL / steps_per_rev / 2;
+}
+
+TEST(microstep_gotos_and_turns) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // fast turns starting and ending between full steps, in both directions
+    motors.fast_turn(off_grid(0.4, STEPS_PER_REV_DEC), off_grid(-0.1, STEPS_PER_REV_RA), false);
+    CHECK(s.run_idle(60000000ULL), "the fast turn did not end");
+    check_driver("fast turn");
+    motors.fast_turn(off_grid(-1.3, STEPS_PER_REV_DEC), 0.7, false);
+    CHECK(s.run_idle(60000000ULL), "the fast turn did not end");
+    check_driver("fast turn back");
+
+    // slow turns are microsteps only
+    motors.slow_turn(0.01, -0.02, 0.02 / MICROSTEPPING_MUL, 0.03 / MICROSTEPPING_MUL, false);
+    CHECK(s.run_idle(60000000ULL), "the slow turn did not end");
+    check_driver("slow turn");
+
+    // gotos to positions between full steps and back to the start
+    motors.move_to(off_grid(2, STEPS_PER_REV_DEC), off_grid(-0.6, STEPS_PER_REV_RA), true);
+    CHECK(s.run_idle(60000000ULL), "the goto did not end");
+    check_driver("goto");
+    motors.move_to(0, 0, true);
+    CHECK(s.run_idle(60000000ULL), "the goto did not end");
+    check_driver("goto back");
+    CHECK(s.axis(SIM_DEC).balance == 0 && s.axis(SIM_RA).balance == 0, "not back at 0, at %ld %ld", s.axis(SIM_DEC).balance,
+          s.axis(SIM_RA).balance);
+    CHECK(MICROSTEPPING_MUL == 1 || s.axis(SIM_DEC).ms_switches > 0, "DEC never switched microstepping");
+}
+
+TEST(microstep_blends_and_retargets) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // queued segments ending between full steps blend, the master leaves its tail to the next one
+    for (int i = 0; i < 3; ++i) motors.fast_turn(off_grid(0.3, STEPS_PER_REV_DEC), off_grid(0.1, STEPS_PER_REV_RA), true);
+    CHECK(s.run_idle(60000000ULL), "queued turns did not end");
+    check_driver("queued turns");
+
+    // retargets to another ratio, another master and the opposite direction
+    static const double TARGETS[][4] = { { 1, 2, 0.2, 4 }, { 2, 1, -1, 1.2 }, { -0.5, 0.1, 0.4, 0.1 } };
+    for (const double* target : TARGETS) {
+        motors.move_to(off_grid(target[0], STEPS_PER_REV_DEC), off_grid(target[1], STEPS_PER_REV_RA), true);
+        s.run_for(200000ULL);
+        motors.move_to(off_grid(target[2], STEPS_PER_REV_DEC), off_grid(target[3], STEPS_PER_REV_RA), true);
+        CHECK(s.run_idle(60000000ULL), "the retargeted goto did not end");
+        check_driver("retarget");
+    }
+}
+
+TEST(microstep_velocity_and_stops) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // from microsteps below the jump speed to full steps above it, a reversal and back to microsteps
+    motors.set_velocity(0.01 / MICROSTEPPING_MUL, -0.01 / MICROSTEPPING_MUL, false);
+    s.run_for(1234567ULL);
+    motors.set_velocity(2.0 / MICROSTEPPING_MUL, 1.0 / MICROSTEPPING_MUL, false);
+    s.run_for(3000000ULL);
+    motors.set_velocity(-1.0 / MICROSTEPPING_MUL, 0.02 / MICROSTEPPING_MUL, false);
+    s.run_for(3000000ULL);
+    motors.stop();
+    CHECK(s.run_idle(10000000ULL), "the velocity mode did not stop");
+    check_driver("velocity");
+
+    // stops cut fast movements in the middle of their ramps
+    motors.fast_turn(off_grid(5, STEPS_PER_REV_DEC), off_grid(-3, STEPS_PER_REV_RA), false);
+    s.run_for(700000ULL);
+    motors.stop();
+    CHECK(s.run_idle(60000000ULL), "the stopped turn did not end");
+    check_driver("stopped turn");
+    motors.move_to(off_grid(1, STEPS_PER_REV_DEC), 1, true);
+    s.run_for(345678ULL);
+    motors.stop();
+    CHECK(s.run_idle(60000000ULL), "the stopped goto did not end");
+    check_driver("stopped goto");
+}
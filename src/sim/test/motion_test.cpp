@@ -0,0 +1,175 @@
+#include <Arduino.h>
+
+#include "../../config.h"
+#include "../../core/motor_controller.h"
+#include "../simulator.h"
+#include "test.h"
+
+// Accelerated movements of the mount, their durations and what they leave behind.
+
+using namespace sim;
+
+// time (µs) from the first recorded edge to the last one
+static uint64_t edge_span() {
+    const std::vector<edge_t>& edges = Simulator::instance().edges();
+    return edges.empty() ? 0 : edges.back().time_us - edges.front().time_us;
+}
+
+// revolutions of whole full steps, so movements start and end at full step positions
+static double full_steps(double revs, uint32_t steps_per_rev) {
+    return round(revs * steps_per_rev) / steps_per_rev;
+}
+
+// runs the fast turn to its end, returns the time (µs) from its first edge to the last one
+static uint64_t timed_fast_turn(double revs_dec, double revs_ra) {
+    Simulator& s = Simulator::instance();
+    s.record_edges(true);
+    MotorController::instance().fast_turn(revs_dec, revs_ra, false);
+    CHECK(s.run_idle(600000000ULL), "the turn by %f %f revs did not end", revs_dec, revs_ra);
+    uint64_t span = edge_span();
+    s.record_edges(false);
+    return span;
+}
+
+TEST(motion_fast_turn_duration_is_exact) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // single pulses, triangles, ramps to the top, either motor as the master, both directions
+    static const double TURNS[][2] = {
+        { 1.0 / STEPS_PER_REV_DEC, 0 }, { 0.01, 0 }, { 0.1, -0.03 }, { -0.4, 0.2 }, { 0.05, 1.3 },
+        { 2, 2 }, { -7, 1 }, { 0.3, -3.3 }, { 16, 0.7 },
+    };
+    for (const double* turn : TURNS) {
+        double revs_dec = full_steps(turn[0], STEPS_PER_REV_DEC);
+        double revs_ra = full_steps(turn[1], STEPS_PER_REV_RA);
+        double estimate = motors.estimate_fast_turn_time(revs_dec, revs_ra);
+        uint64_t span = timed_fast_turn(revs_dec, revs_ra);
+        CHECK(fabs(span - estimate * 1000) < 1, "turn by %f %f revs took %llu us, estimated %.3f us", revs_dec, revs_ra,
+              (unsigned long long)span, estimate * 1000);
+    }
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+TEST(motion_queued_segments_blend) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    uint64_t single = timed_fast_turn(0.9, 0.3);
+
+    // three queued thirds run as the single movement, the master never slows down at junctions
+    s.record_edges(true);
+    for (int i = 0; i < 3; ++i) motors.fast_turn(0.3, 0.1, true);
+    CHECK(s.run_idle(60000000ULL), "queued turns did not end");
+    uint64_t blended = edge_span();
+    printf("  0.9/0.3 revs %.3f ms, three queued 0.3/0.1 revs %.3f ms\n", single / 1e3, blended / 1e3);
+    CHECK(blended <= single + MIN_PULSE_DELAY, "queued turns took %llu us, the single one %llu us", (unsigned long long)blended,
+          (unsigned long long)single);
+    CHECK(s.axis(SIM_DEC).microsteps == lround(1.8 * STEPS_PER_REV_DEC * MICROSTEPPING_MUL), "DEC at %ld microsteps", s.axis(SIM_DEC).microsteps);
+    CHECK(s.axis(SIM_RA).microsteps == lround(0.6 * STEPS_PER_REV_RA * MICROSTEPPING_MUL), "RA at %ld microsteps", s.axis(SIM_RA).microsteps);
+
+    // the master reverses, so the junction is a stop and the total is the sum of both
+    uint64_t forth = timed_fast_turn(0.3, 0.1);
+    uint64_t back = timed_fast_turn(-0.3, 0.1);
+    s.record_edges(true);
+    motors.fast_turn(0.3, 0.1, true);
+    motors.fast_turn(-0.3, 0.1, true);
+    CHECK(s.run_idle(60000000ULL), "queued turns did not end");
+    CHECK(edge_span() >= forth + back, "reversal took %llu us, turns alone %llu us", (unsigned long long)edge_span(),
+          (unsigned long long)(forth + back));
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+// absolute movement from the current position, queued like those of the mount, so 'after_us' later it is
+// retargeted in flight when 'after_us' is not 0, returns the time (µs) from its first edge to the last one
+static uint64_t timed_move_to(double revs_dec, double revs_ra, double retarget_dec, double retarget_ra, uint64_t after_us) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    s.record_edges(true);
+    motors.move_to(revs_dec, revs_ra, true);
+    if (after_us > 0) {
+        s.run_for(after_us);
+        motors.move_to(retarget_dec, retarget_ra, true);
+    }
+    CHECK(s.run_idle(600000000ULL), "the move to %f %f revs did not end", revs_dec, revs_ra);
+    uint64_t span = edge_span();
+    s.record_edges(false);
+    return span;
+}
+
+TEST(motion_retarget_in_flight) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // the retarget keeps the ratio, so the master keeps its speed and the total is the straight move
+    uint64_t straight = timed_move_to(3, 1.5, 0, 0, 0);
+    CHECK(s.axis(SIM_DEC).microsteps == 3L * STEPS_PER_REV_DEC * MICROSTEPPING_MUL, "DEC at %ld microsteps", s.axis(SIM_DEC).microsteps);
+    timed_move_to(0, 0, 0, 0, 0);
+    CHECK(s.axis(SIM_DEC).microsteps == 0 && s.axis(SIM_RA).microsteps == 0, "not back at %ld %ld microsteps",
+          s.axis(SIM_DEC).microsteps, s.axis(SIM_RA).microsteps);
+    uint64_t retargeted = timed_move_to(1, 0.5, 3, 1.5, 300000);
+    printf("  straight 3/1.5 revs %.3f ms, retargeted from 1/0.5 revs at 300 ms %.3f ms\n", straight / 1e3, retargeted / 1e3);
+    CHECK(retargeted <= straight + MIN_PULSE_DELAY, "retargeted move took %llu us, the straight one %llu us",
+          (unsigned long long)retargeted, (unsigned long long)straight);
+    CHECK(s.axis(SIM_DEC).microsteps == 3L * STEPS_PER_REV_DEC * MICROSTEPPING_MUL, "DEC at %ld microsteps", s.axis(SIM_DEC).microsteps);
+    CHECK(s.axis(SIM_RA).microsteps == lround(1.5 * STEPS_PER_REV_RA * MICROSTEPPING_MUL), "RA at %ld microsteps", s.axis(SIM_RA).microsteps);
+
+    // new ratios, a new master and a reversal end exactly at their targets as well
+    static const double TARGETS[][4] = {
+        { 1, 2, 0.2, 4 }, { 2, 1, -1, 1.2 }, { -0.5, 0.1, 0.4, 0.1 }, { 0.3, -2, 0.30005, -2.0001 },
+    };
+    for (const double* target : TARGETS) {
+        timed_move_to(target[0], target[1], target[2], target[3], 200000);
+        long dec = lround(target[2] * STEPS_PER_REV_DEC * MICROSTEPPING_MUL) * 2;
+        long ra = lround(target[3] * STEPS_PER_REV_RA * MICROSTEPPING_MUL) * 2;
+        CHECK(s.axis(SIM_DEC).balance == dec, "DEC at %ld pulses instead of %ld", s.axis(SIM_DEC).balance, dec);
+        CHECK(s.axis(SIM_RA).balance == ra, "RA at %ld pulses instead of %ld", s.axis(SIM_RA).balance, ra);
+    }
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+TEST(motion_profile_changes_between_moves) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // twice the steps per revolution and a lower top speed
+    motion_config_t old_config = motors.get_motion();
+    motion_config_t new_config = old_config;
+    new_config.dec.steps_per_rev *= 2;
+    new_config.ra.steps_per_rev *= 2;
+    new_config.dec.delay_end *= 2;
+    new_config.ra.delay_end *= 2;
+
+    // the running move keeps its pulses and ramps
+    double estimate = motors.estimate_fast_turn_time(2, 1);
+    s.record_edges(true);
+    motors.fast_turn(2, 1, false);
+    s.run_for(200000ULL);
+    CHECK(motors.set_motion(new_config), "the new configuration is not valid");
+    CHECK(s.run_idle(60000000ULL), "the turn did not end");
+    CHECK(fabs(edge_span() - estimate * 1000) < 1, "the turn took %llu us, estimated %.3f us with the old profile",
+          (unsigned long long)edge_span(), estimate * 1000);
+    long dec = s.axis(SIM_DEC).balance, ra = s.axis(SIM_RA).balance;
+    CHECK(dec == 4L * old_config.dec.steps_per_rev * MICROSTEPPING_MUL, "DEC at %ld pulses", dec);
+    CHECK(ra == 2L * old_config.ra.steps_per_rev * MICROSTEPPING_MUL, "RA at %ld pulses", ra);
+
+    // the next one is converted by the new steps per revolution and runs along the new ramps
+    double new_estimate = motors.estimate_fast_turn_time(2, 1);
+    CHECK(new_estimate > estimate, "the new profile is estimated to take %.3f ms, the old one %.3f ms", new_estimate, estimate);
+    uint64_t span = timed_fast_turn(2, 1);
+    CHECK(fabs(span - new_estimate * 1000) < 1, "the turn took %llu us, estimated %.3f us with the new profile",
+          (unsigned long long)span, new_estimate * 1000);
+    CHECK(s.axis(SIM_DEC).balance - dec == 4L * new_config.dec.steps_per_rev * MICROSTEPPING_MUL, "DEC moved by %ld pulses",
+          s.axis(SIM_DEC).balance - dec);
+    CHECK(s.axis(SIM_RA).balance - ra == 2L * new_config.ra.steps_per_rev * MICROSTEPPING_MUL, "RA moved by %ld pulses",
+          s.axis(SIM_RA).balance - ra);
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
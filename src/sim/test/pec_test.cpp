@@ -0,0 +1,113 @@
+#include <Arduino.h>
+
+#include "../../config.h"
+#include "../../core/motor_controller.h"
+#include "../simulator.h"
+#include "test.h"
+
+// Periodic error correction of RA tracking, the table modulates the RA speed of the velocity mode by the
+// segment of the worm revolution, recordings take played corrections and those of guiding.
+
+using namespace sim;
+
+#if PEC_WORM_REVS_RA != 0
+
+// 100 times the sidereal rate, a worm revolution takes minutes of the virtual time
+static const double SPEED = RATE_SIDEREAL / 3600.0 / 360.0 * DEG_PER_MOUNT_REV_RA * 100;
+
+static uint32_t worm_pulses() {
+    return (uint32_t)(2.0 * STEPS_PER_REV_RA * MICROSTEPPING_MUL * PEC_WORM_REVS_RA);
+}
+
+// segment of the RA balance since the origin, like the engine computes it
+static uint16_t segment_of(long balance) {
+    uint32_t worm = worm_pulses();
+    uint64_t scale = ((uint64_t)PEC_SEGMENTS << 32) / worm + 1;
+    uint32_t position = ((balance % (long)worm) + worm) % worm;
+    return min((uint32_t)(((uint64_t)position * scale) >> 32), (uint32_t)PEC_SEGMENTS - 1);
+}
+
+TEST(pec_playback_modulates_ra_rate) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    static int16_t table[PEC_SEGMENTS];
+    for (uint16_t i = 0; i < PEC_SEGMENTS; ++i) table[i] = ((i * 37) % 61 - 30) * PEC_LIMIT / 30;
+    motors.pec_set_origin();
+    motors.pec_upload(table);
+    motors.set_velocity(0, SPEED, false);
+    s.run_for(10000000ULL);
+
+    // a whole worm revolution, the first intervals of a segment may still run at the correction of the previous one
+    s.record_edges(true);
+    s.run_for((uint64_t)(worm_pulses() / (SPEED * STEPS_PER_REV_RA * MICROSTEPPING_MUL * 2.0) * 1e6) + 10000000ULL);
+    double period = 1e6 / (SPEED * STEPS_PER_REV_RA * MICROSTEPPING_MUL * 2.0);
+    double sums[PEC_SEGMENTS] = {};
+    uint32_t counts[PEC_SEGMENTS] = {};
+    const std::vector<edge_t>& edges = s.edges();
+    for (size_t i = 2; i < edges.size(); ++i) {
+        uint16_t segment = segment_of(edges[i - 1].balance);
+        if (segment_of(edges[i - 2].balance) != segment) continue;
+        sums[segment] += edges[i].time_us - edges[i - 1].time_us;
+        ++counts[segment];
+    }
+
+    uint16_t checked = 0;
+    double worst = 0;
+    for (uint16_t i = 0; i < PEC_SEGMENTS; ++i) {
+        if (counts[i] == 0) continue;
+        double expected = period / (1 + table[i] / (double)PEC_UNIT);
+        double error = sums[i] / counts[i] - expected;
+        worst = max(worst, fabs(error));
+        CHECK(fabs(error) < 1, "segment %u with correction %d: %.3f us between pulses instead of %.3f us", i, table[i],
+              sums[i] / counts[i], expected);
+        ++checked;
+    }
+    printf("  %u segments, the worst mean interval %.3f us off\n", checked, worst);
+    CHECK(checked == PEC_SEGMENTS, "just %u segments of the worm revolution were checked", checked);
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+TEST(pec_records_guiding) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    motors.pec_set_origin();
+    motors.set_velocity(0, SPEED, false);
+    s.run_for(10000000ULL);
+
+    // the recording begins with the next segment, guiding pushes RA forward for a half of the worm revolution
+    // and holds it back for the other half
+    MotorController::pec_status_t status;
+    motors.get_pec(status, NULL);
+    uint16_t first = (status.segment + 1) % PEC_SEGMENTS;
+    uint16_t half = (first + PEC_SEGMENTS / 2) % PEC_SEGMENTS;
+    motors.pec_record();
+    motors.guide_ra(0.04, 3600000);
+    do {
+        s.run_for(1000ULL);
+        motors.get_pec(status, NULL);
+    } while (status.segment != half);
+    motors.guide_ra(-0.03, 3600000);
+
+    uint64_t limit = s.now() + 3600000000ULL;
+    do {
+        s.run_for(100000ULL);
+        motors.get_pec(status, NULL);
+    } while (status.recording && s.now() < limit);
+    CHECK(!status.recording, "the recording did not end");
+    CHECK(status.playing, "the recorded table is not played");
+
+    static int16_t table[PEC_SEGMENTS];
+    motors.get_pec(status, table);
+    int16_t forward = lround(0.04 * PEC_UNIT), back = lround(-0.03 * PEC_UNIT);
+    for (uint16_t i = 0; i < PEC_SEGMENTS; ++i) {
+        bool first_half = (i - first + PEC_SEGMENTS) % PEC_SEGMENTS < PEC_SEGMENTS / 2;
+        int16_t expected = first_half ? forward : back;
+        CHECK(table[i] == expected, "segment %u recorded %d instead of %d", i, table[i], expected);
+    }
+}
+
+#endif
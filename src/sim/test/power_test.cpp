@@ -0,0 +1,58 @@
+#include <Arduino.h>
+
+#include "../../config.h"
+#include "../../core/motor_controller.h"
+#include "../simulator.h"
+#include "test.h"
+
+// CPU frequency set by the power task by the demand of the step engine, see CPU_FREQ_*. The frequency
+// stays as it is if STEP_TRACE is defined, so there is nothing to test then.
+
+#ifndef STEP_TRACE
+
+using namespace sim;
+
+// runs a fast turn to its end, it is longer than CPU_FREQ_HOLD
+static void slew(double revs_dec, double revs_ra) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    CHECK(motors.estimate_fast_turn_time(revs_dec, revs_ra) > CPU_FREQ_HOLD, "the turn by %f %f revs is too short", revs_dec, revs_ra);
+    motors.fast_turn(revs_dec, revs_ra, false);
+    s.run_for(100000ULL);
+    CHECK(getCpuFrequencyMhz() == CPU_FREQ_SLEWING, "%u MHz while slewing", getCpuFrequencyMhz());
+    CHECK(s.run_idle(600000000ULL), "the turn by %f %f revs did not end", revs_dec, revs_ra);
+}
+
+TEST(power_hold_over_pauses) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // the idle engine lowers the frequency once the hold passed
+    s.run_for(CPU_FREQ_HOLD * 1000ULL - 100000);
+    CHECK(getCpuFrequencyMhz() == 240, "lowered to %u MHz before the hold passed", getCpuFrequencyMhz());
+    s.run_for(200000ULL);
+    CHECK(getCpuFrequencyMhz() == CPU_FREQ_IDLE, "%u MHz after the hold", getCpuFrequencyMhz());
+
+    // the hold starts with the pause, not with the last change of the frequency
+    slew(16, 2);
+    uint32_t switches = motors.get_stats().frequency_switches;
+    s.run_for(CPU_FREQ_HOLD * 1000ULL / 2);
+    CHECK(getCpuFrequencyMhz() == CPU_FREQ_SLEWING, "%u MHz in the pause after the slew", getCpuFrequencyMhz());
+    slew(-16, -2);
+    CHECK(motors.get_stats().frequency_switches == switches, "the frequency switched %u times in the pause",
+          motors.get_stats().frequency_switches - switches);
+
+    // tracking after the hold
+    double sidereal = RATE_SIDEREAL / 3600.0 / 360.0 * DEG_PER_MOUNT_REV_RA;
+    motors.set_velocity(0, sidereal, false);
+    s.run_for(CPU_FREQ_HOLD * 1000ULL - 100000);
+    CHECK(getCpuFrequencyMhz() == CPU_FREQ_SLEWING, "lowered to %u MHz before the hold passed", getCpuFrequencyMhz());
+    s.run_for(200000ULL);
+    CHECK(getCpuFrequencyMhz() == CPU_FREQ_TRACKING, "%u MHz while tracking", getCpuFrequencyMhz());
+    s.run_for(10000000ULL);
+    CHECK(motors.get_stats().frequency_switches == switches + 1, "the frequency switched %u times while tracking",
+          motors.get_stats().frequency_switches - switches);
+}
+
+#endif
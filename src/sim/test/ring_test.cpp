@@ -0,0 +1,73 @@
+#include <Arduino.h>
+#include <thread>
+
+#include "../../core/spsc_ring.h"
+#include "test.h"
+
+// The ring between producers and the step engine, a producer and a consumer thread run at full
+// speed, so the ring wraps around all the time and both of them find it full and empty often.
+
+static const uint32_t RING_ITEMS = 2000000;
+
+// larger than a word, so a torn copy of a slot is seen
+struct ring_item_t {
+    uint32_t seq;
+    uint32_t check[3];
+};
+
+static ring_item_t ring_item(uint32_t seq) {
+    return { seq, { seq * 2654435761u, ~seq, seq ^ 0x5A5A5A5A } };
+}
+
+template<uint32_t N>
+static void ring_stress() {
+    static spsc_ring<ring_item_t, N> ring;
+    uint32_t full = 0;
+
+    std::thread producer([&full]() {
+        for (uint32_t seq = 0; seq < RING_ITEMS; ++seq) {
+            ring_item_t item = ring_item(seq);
+            while (!ring.push(item)) {
+                ++full;
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    // the engine peeks before it pops, both must see the same oldest item
+    uint32_t expected = 0, empty = 0, torn = 0, out_of_order = 0, peeked_other = 0, too_many = 0;
+    while (expected < RING_ITEMS) {
+        const ring_item_t* peeked = ring.peek();
+        if (peeked == NULL) {
+            ++empty;
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t peeked_seq = peeked->seq;
+        if (ring.count() > N) ++too_many;
+        ring_item_t item;
+        if (!ring.pop(item)) break;
+        if (item.seq != peeked_seq) ++peeked_other;
+        ring_item_t reference = ring_item(item.seq);
+        if (memcmp(&item, &reference, sizeof(item)) != 0) ++torn;
+        if (item.seq != expected) ++out_of_order;
+        expected = item.seq + 1;
+    }
+    producer.join();
+
+    CHECK(expected == RING_ITEMS, "the last item was %u of %u", expected, RING_ITEMS);
+    CHECK(out_of_order == 0, "%u items lost, duplicated or out of order", out_of_order);
+    CHECK(torn == 0, "%u torn items", torn);
+    CHECK(peeked_other == 0, "%u popped items differ from peeked ones", peeked_other);
+    CHECK(too_many == 0, "count over the capacity %u times", too_many);
+    CHECK(ring.empty() && ring.pushed() == RING_ITEMS && ring.popped() == RING_ITEMS, "pushed %u, popped %u", ring.pushed(), ring.popped());
+    printf("  capacity %u: ring found full %u times, empty %u times\n", N, full, empty);
+}
+
+TEST(ring_two_threads_small) {
+    ring_stress<4>();
+}
+
+TEST(ring_two_threads_large) {
+    ring_stress<1024>();
+}
@@ -0,0 +1,87 @@
+#include <Arduino.h>
+
+#include "../../config.h"
+#include "../../core/clock.h"
+#include "../../core/motor_controller.h"
+#include "../simulator.h"
+#include "test.h"
+
+// Timed segments, the engine holds them until their time of the step timer, :XSU and :XSL schedule them.
+
+using namespace sim;
+
+// time of the first recorded edge, 0 if there is none
+static uint64_t first_edge() {
+    const std::vector<edge_t>& edges = Simulator::instance().edges();
+    return edges.empty() ? 0 : edges.front().time_us;
+}
+
+TEST(schedule_segments_start_in_time) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    s.run_for(1000000ULL);
+
+    // a goto and a rate change start at their time, not sooner and not later than the alarm lead
+    uint64_t start = motors.time_us() + 2345678;
+    s.record_edges(true);
+    motors.move_to(0.5, -0.25, true, start);
+    CHECK(s.run_idle(60000000ULL), "the timed goto did not end");
+    CHECK(first_edge() >= start && first_edge() <= start + MIN_ALARM_LEAD, "the goto due at %llu us started at %llu us",
+          (unsigned long long)start, (unsigned long long)first_edge());
+
+    start = motors.time_us() + 3456789;
+    s.record_edges(true);
+    motors.set_velocity(0, 0.01, true, start);
+    s.run_for(5000000ULL);
+    CHECK(first_edge() >= start && first_edge() <= start + MIN_ALARM_LEAD, "the velocity due at %llu us started at %llu us",
+          (unsigned long long)start, (unsigned long long)first_edge());
+    motors.stop();
+    CHECK(s.run_idle(60000000ULL), "the velocity mode did not stop");
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+TEST(schedule_stop_cancels_held_segment) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // the stop comes while the goto is held, it never starts and the engine takes following commands
+    s.record_edges(true);
+    motors.move_to(1, 1, true, motors.time_us() + 5000000);
+    s.run_for(1000000ULL);
+    motors.stop();
+    s.run_for(10000000ULL);
+    CHECK(s.edges().empty(), "the held goto did %zu edges after the stop", s.edges().size());
+    CHECK(motors.is_ready(), "the engine still holds the goto");
+
+    motors.fast_turn(0.1, 0.1, false);
+    CHECK(s.run_idle(60000000ULL), "the turn after the stop did not end");
+    CHECK(s.axis(SIM_DEC).balance == 2L * lround(0.1 * STEPS_PER_REV_DEC * MICROSTEPPING_MUL), "DEC at %ld pulses",
+          s.axis(SIM_DEC).balance);
+}
+
+TEST(schedule_time_of_day_conversion) {
+    SubSecondRTC::adjust(2024, 3, 20, 20, 0, 0);
+    Clock::recalc_LST_offset(LONGITUDE);
+    Simulator::instance().run_for(250000ULL);
+
+    // :XSU waits for the UTC time, even over midnight
+    double now = 3600 * Clock::get_decimal_time();
+    CHECK(fabs(Clock::seconds_until(now + 100, false) - 100) < 0.01, "100 s of UTC are %.3f s",
+          Clock::seconds_until(now + 100, false));
+    CHECK(fabs(Clock::seconds_until(fmod(now + 5 * 3600, 86400), false) - 5 * 3600) < 0.01, "5 h of UTC over midnight are %.3f s",
+          Clock::seconds_until(fmod(now + 5 * 3600, 86400), false));
+    CHECK(Clock::seconds_until(now - 60, false) > 43200, "a minute ago is %.3f s ahead, :XSU takes it",
+          Clock::seconds_until(now - 60, false));
+
+    // :XSL waits for the sidereal time, an hour of it is shorter than an hour of UTC
+    double lst = 3600 * Clock::get_decimal_LST();
+    double hour = Clock::seconds_until(fmod(lst + 3600, 86400), true);
+    CHECK(fabs(hour - 3600 / 1.00273790935) < 0.01, "a sidereal hour is %.3f s of UTC", hour);
+
+    // the sidereal time of the longitude at 20:00 UTC of the equinox (8844.5 days after J2000), the offset keeps whole seconds
+    double gmst = fmod(18.697374558 + 24.06570982441908 * (8844.5 + 20 / 24.0) + LONGITUDE / 15.0, 24.0);
+    CHECK(fabs(fmod(lst / 3600 - gmst + 36, 24.0) - 12) < 2 / 3600.0, "LST %.5f h instead of %.5f h", lst / 3600, gmst);
+}
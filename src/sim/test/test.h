@@ -0,0 +1,40 @@
+#ifndef SIM_TEST_H
+#define SIM_TEST_H
+
+#include <stdint.h>
+
+// Regression tests of the step engine on the simulator (native_test env in platformio.ini). Every
+// test runs in a process of its own, so it starts at the virtual time 0 with an engine which was
+// never initialized. Failed checks are printed and the test goes on, the program fails if any did.
+//
+//     sim_test [part of test names]
+
+namespace sim {
+
+struct test_t {
+    const char* name;
+    void (*run)();
+    test_t* next;
+
+    // registers the test, see TEST
+    test_t(const char* name, void (*run)());
+};
+
+// first registered test
+test_t*& tests();
+
+// counts the check of the running test, prints it with the message if it failed
+bool check(bool passed, const char* condition, const char* file, int line, const char* format, ...)
+    __attribute__((format(printf, 5, 6)));
+
+}
+
+#define TEST(name) \
+    static void test_##name(); \
+    static sim::test_t test_##name##_entry(#name, &test_##name); \
+    static void test_##name()
+
+// the message (printf format and arguments) tells the values which failed the condition
+#define CHECK(condition, ...) sim::check((condition), #condition, __FILE__, __LINE__, __VA_ARGS__)
+
+#endif
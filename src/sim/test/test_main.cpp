@@ -0,0 +1,73 @@
+#include <Arduino.h>
+#include <stdarg.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+#include "../simulator.h"
+#include "test.h"
+
+namespace sim {
+
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+test_t::test_t(const char* name, void (*run)()) : name(name), run(run), next(tests()) {
+    tests() = this;
+}
+
+test_t*& tests() {
+    static test_t* first = NULL;
+    return first;
+}
+
+bool check(bool passed, const char* condition, const char* file, int line, const char* format, ...) {
+    ++checks;
+    if (passed) return true;
+    ++failures;
+    printf("  %s:%d: %s failed at %.6f s, ", file, line, condition, Simulator::instance().now() / 1e6);
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    return false;
+}
+
+}
+
+using namespace sim;
+
+int main(int argc, char** argv) {
+    const char* filter = argc > 1 ? argv[1] : "";
+
+    // registration order depends on the linker, names do not
+    std::vector<test_t*> selected;
+    for (test_t* t = tests(); t != NULL; t = t->next) {
+        if (strstr(t->name, filter) != NULL) selected.push_back(t);
+    }
+    std::sort(selected.begin(), selected.end(), [](const test_t* a, const test_t* b) { return strcmp(a->name, b->name) < 0; });
+
+    printf("%u tests, microstepping %d\n", (unsigned)selected.size(), MICROSTEPPING_MUL);
+    uint32_t failed = 0;
+    for (test_t* t : selected) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            Simulator::instance().initialize();
+            srand(42);
+            t->run();
+            printf("%-6s %s (%u checks)\n", failures ? "FAIL" : "ok", t->name, checks);
+            fflush(stdout);
+            _exit(failures ? 1 : 0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) continue;
+        ++failed;
+        if (!WIFEXITED(status)) printf("FAIL   %s (crashed, status %d)\n", t->name, status);
+    }
+    printf("%u of %u tests failed\n", failed, (unsigned)selected.size());
+    return failed ? 1 : 0;
+}
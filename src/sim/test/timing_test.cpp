@@ -0,0 +1,163 @@
+#include <Arduino.h>
+
+#include "../../config.h"
+#include "../../core/motor_controller.h"
+#include "../simulator.h"
+#include "test.h"
+
+// Every edge of the step engine has its own timer alarm, so edges follow the commanded period
+// up to the microsecond of the timer, nothing accumulates and idle axes cost no wake ups.
+
+using namespace sim;
+
+// delay (µs) between two pulses (edges) of the axis running with 'speed' (revolutions per second)
+static double pulse_period(double speed, uint32_t steps_per_rev) {
+    return 1000000.0 / (fabs(speed) * steps_per_rev * MICROSTEPPING_MUL * 2.0);
+}
+
+// compares edges of the axis with the schedule of 'period' from its first edge, the timer has whole microseconds,
+// edges of one axis may be done up to MIN_ALARM_LEAD early with those of the other one, late ones by the latency
+// of wake ups
+static void check_schedule(uint8_t axis, double period, uint32_t expected, uint32_t latency) {
+    const std::vector<edge_t>& edges = Simulator::instance().edges();
+    uint64_t first = 0;
+    uint32_t count = 0;
+    double earliest = 0, latest = 0;
+    for (const edge_t& edge : edges) {
+        if (edge.axis != axis) continue;
+        if (count == 0) first = edge.time_us;
+        double error = (double)(edge.time_us - first) - count * period;
+        earliest = min(earliest, error);
+        latest = max(latest, error);
+        ++count;
+    }
+    CHECK(count == expected, "axis %d did %u edges instead of %u", axis, count, expected);
+    CHECK(earliest > -MIN_ALARM_LEAD - 1, "an edge of axis %d came %.2f us early", axis, -earliest);
+    CHECK(latest < latency + 1, "an edge of axis %d came %.2f us late, latency up to %u us", axis, latest, latency);
+}
+
+TEST(timing_slow_turn_edges) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    s.record_edges(true);
+
+    // periods with fractions of microsecond, neither of them is a multiple of the other one
+    motors.slow_turn(0.25 / MICROSTEPPING_MUL, -0.125 / MICROSTEPPING_MUL, 1.7 / MICROSTEPPING_MUL, 0.9 / MICROSTEPPING_MUL, false);
+    CHECK(s.run_idle(10000000ULL), "the turn did not end");
+
+    uint32_t dec_edges = 0.25 * STEPS_PER_REV_DEC * 2;
+    uint32_t ra_edges = 0.125 * STEPS_PER_REV_RA * 2;
+    check_schedule(SIM_DEC, pulse_period(1.7 / MICROSTEPPING_MUL, STEPS_PER_REV_DEC), dec_edges, 0);
+    check_schedule(SIM_RA, pulse_period(0.9 / MICROSTEPPING_MUL, STEPS_PER_REV_RA), ra_edges, 0);
+    CHECK(s.axis(SIM_DEC).balance == (long)dec_edges, "DEC balance %ld", s.axis(SIM_DEC).balance);
+    CHECK(s.axis(SIM_RA).balance == -(long)ra_edges, "RA balance %ld", s.axis(SIM_RA).balance);
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+
+    // nothing to do, so the engine is woken up just by the simulator calling it once
+    uint64_t ticks = s.ticks();
+    s.run_for(10000000ULL);
+    CHECK(s.ticks() - ticks <= 1, "%llu wake ups of idle axes", (unsigned long long)(s.ticks() - ticks));
+}
+
+TEST(timing_late_wakeups_do_not_accumulate) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    s.record_edges(true);
+    s.set_latency(50);
+
+    motors.slow_turn(0.5 / MICROSTEPPING_MUL, 0.25 / MICROSTEPPING_MUL, 0.6 / MICROSTEPPING_MUL, 0.35 / MICROSTEPPING_MUL, false);
+    CHECK(s.run_idle(10000000ULL), "the turn did not end");
+
+    uint32_t dec_edges = 0.5 * STEPS_PER_REV_DEC * 2;
+    uint32_t ra_edges = 0.25 * STEPS_PER_REV_RA * 2;
+    check_schedule(SIM_DEC, pulse_period(0.6 / MICROSTEPPING_MUL, STEPS_PER_REV_DEC), dec_edges, 50);
+    check_schedule(SIM_RA, pulse_period(0.35 / MICROSTEPPING_MUL, STEPS_PER_REV_RA), ra_edges, 50);
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+TEST(timing_velocity_edges) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    s.record_edges(true);
+
+    // 100 times the sidereal rate of a motor directly on the RA axis, the speed is below the jump one, so it is taken at once
+    double speed = RATE_SIDEREAL / 3600.0 / 360.0 * DEG_PER_MOUNT_REV_RA * 100;
+    motors.set_velocity(0, speed, false);
+    s.run_for(60000000ULL);
+
+    double period = pulse_period(speed, STEPS_PER_REV_RA);
+    uint32_t expected = s.edges().empty() ? 0 : (s.now() - s.edges().front().time_us) / period + 1;
+    check_schedule(SIM_RA, period, expected, 0);
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+    CHECK(s.axis(SIM_DEC).edges == 0, "DEC did %u edges", s.axis(SIM_DEC).edges);
+}
+
+TEST(timing_fast_turn_min_interval) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // the top of ramps with FAST_DELAY_END 0 is bounded by MIN_PULSE_DELAY
+    motors.fast_turn(3, -1, false);
+    CHECK(s.run_idle(60000000ULL), "the turn did not end");
+    CHECK(s.axis(SIM_DEC).min_interval_us >= MIN_PULSE_DELAY, "DEC edges %u us apart", s.axis(SIM_DEC).min_interval_us);
+    CHECK(s.axis(SIM_RA).min_interval_us >= MIN_PULSE_DELAY, "RA edges %u us apart", s.axis(SIM_RA).min_interval_us);
+    CHECK(s.axis(SIM_DEC).microsteps == 3L * STEPS_PER_REV_DEC * MICROSTEPPING_MUL, "DEC at %ld microsteps", s.axis(SIM_DEC).microsteps);
+    CHECK(s.axis(SIM_RA).microsteps == -1L * STEPS_PER_REV_RA * MICROSTEPPING_MUL, "RA at %ld microsteps", s.axis(SIM_RA).microsteps);
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+#if STEPS_PER_REV_FOCUS != 0
+TEST(timing_aux_axis_beside_mount) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    s.record_edges(true);
+
+    // the focuser runs with the :F+ rate 2, below the jump speed, while the mount turns, each of them on its own schedule
+    const uint8_t focus = 2 + AXIS_FOCUS;
+    double speed = -motors.aux_max_speed(AXIS_FOCUS) / 16;
+    motors.aux_velocity(AXIS_FOCUS, speed);
+    motors.slow_turn(0.25 / MICROSTEPPING_MUL, -0.125 / MICROSTEPPING_MUL, 0.3 / MICROSTEPPING_MUL, 0.2 / MICROSTEPPING_MUL, false);
+    s.run_for(2000000ULL);
+    CHECK(motors.is_ready(), "the turn did not end");
+    CHECK(motors.aux_busy(AXIS_FOCUS), "the focuser does not run");
+
+    // :FQ stops it at the next pulse, which completes a step at most
+    uint64_t stop = s.now();
+    motors.aux_stop(AXIS_FOCUS, false);
+    CHECK(s.run_idle(10000000ULL), "the focuser did not stop");
+    CHECK(!motors.aux_busy(AXIS_FOCUS), "the focuser is busy");
+
+    double period = pulse_period(speed, STEPS_PER_REV_FOCUS);
+    uint32_t focus_edges = s.axis(focus).edges;
+    uint64_t first = stop;
+    for (const edge_t& edge : s.edges()) if (edge.axis == focus) { first = edge.time_us; break; }
+    uint32_t due = (stop - first) / period + 1;
+    CHECK(focus_edges >= due && focus_edges <= due + 2, "the focuser did %u edges, %u were due before the stop", focus_edges, due);
+    CHECK(s.axis(focus).balance == -(long)focus_edges && focus_edges % 2 == 0, "focuser balance %ld", s.axis(focus).balance);
+    CHECK(fabs(motors.aux_revolutions(AXIS_FOCUS) + focus_edges / 2.0 / STEPS_PER_REV_FOCUS / MICROSTEPPING_MUL) < 1e-9,
+          "focuser at %f revolutions", motors.aux_revolutions(AXIS_FOCUS));
+    check_schedule(focus, period, focus_edges, 0);
+
+    // edges of the mount are where they would be without the focuser
+    uint32_t dec_edges = 0.25 * STEPS_PER_REV_DEC * 2;
+    uint32_t ra_edges = 0.125 * STEPS_PER_REV_RA * 2;
+    check_schedule(SIM_DEC, pulse_period(0.3 / MICROSTEPPING_MUL, STEPS_PER_REV_DEC), dec_edges, 0);
+    check_schedule(SIM_RA, pulse_period(0.2 / MICROSTEPPING_MUL, STEPS_PER_REV_RA), ra_edges, 0);
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+    CHECK(s.balance_error(focus) == 0, "focuser balance error %ld", s.balance_error(focus));
+
+    // nothing runs after the stop
+    uint32_t edges = s.edges().size();
+    s.run_for(5000000ULL);
+    CHECK(s.edges().size() == edges, "%zu edges after the stop", s.edges().size() - edges);
+}
+#endif
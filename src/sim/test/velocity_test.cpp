@@ -0,0 +1,150 @@
+#include <Arduino.h>
+
+#include "../../config.h"
+#include "../../core/motor_controller.h"
+#include "../simulator.h"
+#include "test.h"
+
+// Velocity mode of the step engine, speeds of both axes are changed on the fly along their ramps.
+
+using namespace sim;
+
+// pulses (edges) per second of the axis running with 'speed' (revolutions per second)
+static double pulse_rate(double speed, uint32_t steps_per_rev) {
+    return speed * steps_per_rev * MICROSTEPPING_MUL * 2.0;
+}
+
+// longest time (µs) between two recorded edges of the axis after 'since'
+static uint64_t longest_gap(uint8_t axis, uint64_t since) {
+    uint64_t last = 0, gap = 0;
+    for (const edge_t& edge : Simulator::instance().edges()) {
+        if (edge.axis != axis || edge.time_us < since) continue;
+        if (last != 0) gap = max(gap, edge.time_us - last);
+        last = edge.time_us;
+    }
+    return gap;
+}
+
+TEST(velocity_hour_without_drift) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    // 100 times the sidereal rate, the exact 32.32 period does not drift, pulses of the hour after the start are counted
+    double speed = RATE_SIDEREAL / 3600.0 / 360.0 * DEG_PER_MOUNT_REV_RA * 100;
+    motors.set_velocity(-speed / 3, speed, false);
+    s.run_for(10000000ULL);
+    long dec_start = s.axis(SIM_DEC).balance, ra_start = s.axis(SIM_RA).balance;
+    s.run_for(3600000000ULL);
+
+    long dec = s.axis(SIM_DEC).balance - dec_start, ra = s.axis(SIM_RA).balance - ra_start;
+    double dec_expected = -pulse_rate(speed / 3, STEPS_PER_REV_DEC) * 3600, ra_expected = pulse_rate(speed, STEPS_PER_REV_RA) * 3600;
+    printf("  an hour: DEC %ld pulses of %.3f, RA %ld of %.3f\n", dec, dec_expected, ra, ra_expected);
+    CHECK(fabs(dec - dec_expected) <= 1, "DEC did %ld pulses instead of %.3f", dec, dec_expected);
+    CHECK(fabs(ra - ra_expected) <= 1, "RA did %ld pulses instead of %.3f", ra, ra_expected);
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+// tracking rates of the mount (arcsec per second), the mount sets them once per TRACKING_PERIOD and corrects
+// the pointing meanwhile, here the engine runs them open loop, so any drift of its fixed point periods stays,
+// the last edge is compared with the time when the ideal motor would get there
+TEST(velocity_rates_eight_hours_open_loop) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    static const struct { const char* name; double rate; } RATES[] = {
+        { "sidereal", RATE_SIDEREAL }, { "solar", RATE_SOLAR }, { "lunar", RATE_LUNAR }, { "King", RATE_KING },
+    };
+    for (const auto& rate : RATES) {
+        double speed = rate.rate / 3600.0 / 360.0 * DEG_PER_MOUNT_REV_RA;
+        double period = 1000000.0 / pulse_rate(speed, STEPS_PER_REV_RA);
+        motors.set_velocity(0, speed, false);
+        s.run_for(10000000ULL);
+        s.record_edges(true);
+        s.run_for(8 * 3600000000ULL);
+
+        const std::vector<edge_t>& edges = s.edges();
+        CHECK(edges.size() > 1, "%s rate did %zu pulses", rate.name, edges.size());
+        if (edges.size() < 2) continue;
+        double drift = (edges.back().time_us - edges.front().time_us) - (edges.size() - 1) * period;
+        printf("  %-8s 8 hours: RA %zu pulses, the last one %+.3f us off (%+.5f arcsec)\n", rate.name, edges.size(),
+               drift, drift / 1e6 * rate.rate);
+        CHECK(fabs(drift) <= 1, "%s rate drifted by %.3f us", rate.name, drift);
+
+        s.record_edges(false);
+        motors.stop();
+        CHECK(s.run_idle(60000000ULL), "motors did not stop");
+        CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+    }
+}
+
+TEST(velocity_rate_changes_on_the_fly) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+    s.record_edges(true);
+
+    // both accelerate along ramps, then DEC turns back and RA speeds up, RA never stops meanwhile
+    motors.set_velocity(1.0 / MICROSTEPPING_MUL, 0.5 / MICROSTEPPING_MUL, false);
+    s.run_for(3000000ULL);
+    uint64_t changed = s.now();
+    motors.set_velocity(-0.5 / MICROSTEPPING_MUL, 2.0 / MICROSTEPPING_MUL, false);
+    s.run_for(5000000ULL);
+    // above the jump speed full steps are done, RA only speeds up, so no gap is longer than a full step at the old speed
+    double full_step = 1000000.0 / (0.5 / MICROSTEPPING_MUL * STEPS_PER_REV_RA * 2);
+    CHECK(longest_gap(SIM_RA, changed) <= full_step + 1, "RA stood %llu us, a full step takes %.1f us",
+          (unsigned long long)longest_gap(SIM_RA, changed), full_step);
+    CHECK(s.axis(SIM_DEC).reversals >= 1, "DEC did not turn back");
+
+    // the last second runs at the new speeds
+    long dec = s.axis(SIM_DEC).balance, ra = s.axis(SIM_RA).balance;
+    s.run_for(1000000ULL);
+    double dec_rate = s.axis(SIM_DEC).balance - dec, ra_rate = s.axis(SIM_RA).balance - ra;
+    CHECK(fabs(dec_rate + pulse_rate(0.5 / MICROSTEPPING_MUL, STEPS_PER_REV_DEC)) <= 1, "DEC at %.0f pulses/s", dec_rate);
+    CHECK(fabs(ra_rate - pulse_rate(2.0 / MICROSTEPPING_MUL, STEPS_PER_REV_RA)) <= 1, "RA at %.0f pulses/s", ra_rate);
+
+    // a stop ramps speeds down to zero
+    motors.stop();
+    CHECK(s.run_idle(10000000ULL), "motors did not stop");
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+// a movement queued behind the velocity mode is dropped by a stop, the engine must leave the velocity mode
+// once motors stand and take following commands
+static void check_stop_of_queued(bool fast) {
+    Simulator& s = Simulator::instance();
+    MotorController& motors = MotorController::instance();
+    motors.initialize();
+
+    motors.set_velocity(0.5 / MICROSTEPPING_MUL, 0.5 / MICROSTEPPING_MUL, false);
+    s.run_for(2000000ULL);
+    if (fast) motors.fast_turn(1, 1, true);
+    else motors.slow_turn(0.1, 0.1, 0.2, 0.2, true);
+    s.run_for(1000ULL);
+    motors.stop();
+    CHECK(s.run_idle(10000000ULL), "motors did not stop");
+    CHECK(motors.is_ready(), "the engine has a job after the stop");
+
+    long dec = s.axis(SIM_DEC).balance, ra = s.axis(SIM_RA).balance;
+    motors.fast_turn(0.5, -0.25, false);
+    CHECK(s.run_idle(10000000ULL), "the turn after the stop did not end");
+    CHECK(s.axis(SIM_DEC).balance - dec == STEPS_PER_REV_DEC * MICROSTEPPING_MUL, "DEC moved by %ld pulses", s.axis(SIM_DEC).balance - dec);
+    CHECK(s.axis(SIM_RA).balance - ra == -STEPS_PER_REV_RA * MICROSTEPPING_MUL / 2, "RA moved by %ld pulses", s.axis(SIM_RA).balance - ra);
+    motors.move_to(0, 0, true);
+    CHECK(s.run_idle(60000000ULL), "the move after the stop did not end");
+    CHECK(s.axis(SIM_DEC).balance == 0 && s.axis(SIM_RA).balance == 0, "not back at 0, at %ld %ld", s.axis(SIM_DEC).balance,
+          s.axis(SIM_RA).balance);
+    CHECK(s.balance_error(SIM_DEC) == 0, "DEC balance error %ld", s.balance_error(SIM_DEC));
+    CHECK(s.balance_error(SIM_RA) == 0, "RA balance error %ld", s.balance_error(SIM_RA));
+}
+
+TEST(velocity_stop_drops_queued_fast_turn) {
+    check_stop_of_queued(true);
+}
+
+TEST(velocity_stop_drops_queued_slow_turn) {
+    check_stop_of_queued(false);
+}